@@ -0,0 +1,254 @@
+/**
+ * Microbenchmark: archiving days of 5 s samples of simulated inverters,
+ * reading them back, checking they are unchanged and comparing the size
+ * with the line protocol main would write.
+ * Build with `make bench`, run ./bench/archive [inverters] [days]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+#include "sma.h"
+#include "sma_map.h"
+#include "archive.h"
+#include "lineproto.hpp"
+
+#define INTERVAL_MS 5000
+// 2024-06-21 00:00 UTC
+#define START_MS 1718928000000LL
+
+typedef struct
+{
+    int inverters;
+    long per_inverter;
+    std::vector<archive_value> values;  // By inverter, sample and register
+    std::vector<unsigned long> masks;
+    long read;
+    long wrong;
+    LineBuffer line;
+    std::string lines;
+} bench_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double noise(double amplitude)
+{
+    return (drand48() * 2 - 1) * amplitude;
+}
+
+static double quantize(double v, double scale)
+{
+    return round(v * scale) / scale;
+}
+
+/**
+ * A sunny day with some clouds: DC strings, AC side, temperature and yields,
+ * at the resolution the registers have. The inverter is off at night.
+ */
+static unsigned long simulate(SMA_Inverter *inv, long long ts, int i)
+{
+    double hour = (ts % ARCHIVE_DAY_MS) / 3600000.0;
+    double sun = hour > 5 && hour < 21 ? sin((hour - 5) / 16 * M_PI) : 0;
+    sun *= 0.85 + 0.15 * sin(ts / 700000.0 + i) + noise(0.01);
+    if (sun <= 0)
+    {
+        inv->Condition = SMA_CONDITION_OFF;
+        if (hour < 1)
+            inv->DayYield = 0;
+        return 1UL << 0 | 1UL << 2 | 1UL << 3;
+    }
+
+    inv->Condition = SMA_CONDITION_OK;
+    inv->GridRelay = SMA_RELAY_CLOSED;
+    inv->Udc1 = quantize(560 + 60 * sun + noise(0.5), 100);
+    inv->Pdc1 = (long)(4000 * sun);
+    inv->Idc1 = quantize(inv->Pdc1 / inv->Udc1, 1000);
+    inv->Udc2 = quantize(540 + 60 * sun + noise(0.5), 100);
+    inv->Pdc2 = (long)(3500 * sun);
+    inv->Idc2 = quantize(inv->Pdc2 / inv->Udc2, 1000);
+    inv->Pac1 = (long)((inv->Pdc1 + inv->Pdc2) * 0.97);
+    inv->Uac1 = quantize(231 + noise(1.5), 100);
+    inv->Iac1 = quantize(inv->Pac1 / inv->Uac1, 1000);
+    inv->GridFreq = quantize(50 + noise(0.03), 100);
+    inv->ReactivePower = (long)(inv->Pac1 * 0.05);
+    inv->ApparentPower = inv->Pac1 + inv->ReactivePower / 4;
+    inv->Temperature = quantize(25 + 25 * sun + noise(0.2), 10);
+    inv->TotalYield += inv->Pac1 * INTERVAL_MS / 3600000;
+    inv->DayYield += inv->Pac1 * INTERVAL_MS / 3600000;
+    return ~0UL;
+}
+
+/**
+ * Checks a sample read back and writes it as line protocol
+ */
+static void check(void *ctx, const char *name, const archive_field *fields, int nfields,
+    long long ts_ms, const archive_value *values, unsigned long mask)
+{
+    bench_t *b = (bench_t *)ctx;
+    int i = atoi(name + 3);
+    long s = (ts_ms - START_MS) / INTERVAL_MS;
+    size_t base = ((size_t)i * b->per_inverter + s) * sma_inverter_registers_count;
+
+    if (i < 0 || i >= b->inverters || s < 0 || s >= b->per_inverter || b->masks[(size_t)i * b->per_inverter + s] != mask)
+        b->wrong++;
+    else
+    {
+        for (int f = 0; f < nfields; f++)
+            if (mask & (1UL << f) && memcmp(&values[f], &b->values[base + f], sizeof(archive_value)) != 0)
+            {
+                b->wrong++;
+                break;
+            }
+    }
+    b->read++;
+
+    LineBuffer &line = b->line;
+    line.clear();
+    line.append("measurement,inverter=", 21);
+    line.appendTag(name);
+    line.append(' ');
+    bool first = true;
+    for (int f = 0; f < nfields; f++)
+    {
+        if (!(mask & (1UL << f)))
+            continue;
+        if (!first)
+            line.append(',');
+        first = false;
+        line.append(fields[f].name, strlen(fields[f].name));
+        line.append('=');
+        if (fields[f].kind == SMA_FIELD_DOUBLE)
+            line.append(values[f].d);
+        else
+        {
+            if (fields[f].kind == SMA_FIELD_LONG)
+                line.append((long long)values[f].l);
+            else
+                line.append((unsigned long long)values[f].u);
+            line.append('i');
+        }
+    }
+    line.append(' ');
+    line.append((unsigned long long)ts_ms);
+    line.append('\n');
+    b->lines.append(line.data(), line.length());
+}
+
+int main(int argc, char **argv)
+{
+    bench_t b;
+    b.inverters = argc > 1 ? atoi(argv[1]) : 10;
+    int days = argc > 2 ? atoi(argv[2]) : 2;
+    b.per_inverter = days * ARCHIVE_DAY_MS / INTERVAL_MS;
+    b.values.resize((size_t)b.inverters * b.per_inverter * sma_inverter_registers_count);
+    b.masks.resize((size_t)b.inverters * b.per_inverter);
+    b.read = 0;
+    b.wrong = 0;
+
+    char dir[] = "/tmp/archive.XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return 1;
+    archive_t *ar = archive_open(dir);
+    if (ar == NULL)
+        return 1;
+
+    /**
+     * Samples are simulated up front, only archiving is timed
+     */
+    std::vector<SMA_Inverter> invs(b.inverters);
+    std::vector<std::string> names(b.inverters);
+    for (int i = 0; i < b.inverters; i++)
+    {
+        memset(&invs[i], 0, sizeof(SMA_Inverter));
+        invs[i].TotalYield = 25000000 + i * 1000000;
+        names[i] = "SMA" + std::to_string(i);
+    }
+
+    srand48(1);
+    std::vector<SMA_Inverter> samples((size_t)b.inverters * b.per_inverter);
+    for (long s = 0; s < b.per_inverter; s++)
+    {
+        for (int i = 0; i < b.inverters; i++)
+        {
+            size_t n = (size_t)i * b.per_inverter + s;
+            b.masks[n] = simulate(&invs[i], START_MS + s * INTERVAL_MS, i) & ((1UL << sma_inverter_registers_count) - 1);
+            samples[n] = invs[i];
+            for (size_t r = 0; r < sma_inverter_registers_count; r++)
+                memcpy(&b.values[n * sma_inverter_registers_count + r], (char *)&invs[i] + sma_inverter_registers[r].offset, sizeof(archive_value));
+        }
+    }
+
+    double start = now();
+    for (long s = 0; s < b.per_inverter; s++)
+    {
+        for (int i = 0; i < b.inverters; i++)
+        {
+            size_t n = (size_t)i * b.per_inverter + s;
+            archive_append(ar, i, names[i].c_str(), sma_inverter_registers, sma_inverter_registers_count,
+                &samples[n], b.masks[n], START_MS + s * INTERVAL_MS);
+        }
+    }
+    archive_close(ar);
+    double written = now() - start;
+
+    /**
+     * Read every day file back
+     */
+    size_t archived = 0;
+    double readTime = 0;
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    std::vector<std::string> files;
+    while ((de = readdir(d)) != NULL)
+        if (de->d_name[0] != '.')
+            files.push_back(std::string(dir) + "/" + de->d_name);
+    closedir(d);
+
+    for (const std::string &path : files)
+    {
+        FILE *f = fopen(path.c_str(), "rb");
+        fseek(f, 0, SEEK_END);
+        archived += ftell(f);
+        fclose(f);
+
+        if (path.compare(path.size() - 4, 4, ".sma") == 0)
+        {
+            start = now();
+            archive_read(path.c_str(), 0, LLONG_MAX, NULL, check, &b);
+            readTime += now() - start;
+        }
+    }
+    for (const std::string &path : files)
+        unlink(path.c_str());
+    rmdir(dir);
+
+    long total = b.inverters * b.per_inverter;
+    if (b.read != total || b.wrong != 0)
+    {
+        fprintf(stderr, "archive: %ld of %ld samples read, %ld differ\n", b.read, total, b.wrong);
+        return 1;
+    }
+
+    uLongf gzipped = compressBound(b.lines.size());
+    std::vector<Bytef> gz(gzipped);
+    compress2(gz.data(), &gzipped, (const Bytef *)b.lines.data(), b.lines.size(), 6);
+
+    printf("%d inverters, %d days of %d s samples, %ld samples\n", b.inverters, days, INTERVAL_MS / 1000, total);
+    printf("line protocol %10lu bytes %7.1f bytes/sample\n", (unsigned long)b.lines.size(), (double)b.lines.size() / total);
+    printf("zlib -6       %10lu bytes %7.1f bytes/sample %5.1fx\n", (unsigned long)gzipped, (double)gzipped / total, (double)b.lines.size() / gzipped);
+    printf("archive       %10lu bytes %7.1f bytes/sample %5.1fx\n", (unsigned long)archived, (double)archived / total, (double)b.lines.size() / archived);
+    printf("append %.0f ns/sample, read %.0f ns/sample\n", written * 1e9 / total, readTime * 1e9 / total);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/**
+ * Microbenchmark: decoding a full 125 register block register by register
+ * with getValue versus sma_decode_block, which swaps the block in one pass.
+ * Build with `make bench`, run ./bench/decode [blocks]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "modbus.h"
+#include "sma.h"
+#include "sma_map.h"
+#include "sma_decode.h"
+
+#define REGS (SMA_MAX_BLOCK_REGS / 2)
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long blocks, double seconds)
+{
+    printf("%-10s %10.0f blocks/s %8.1f ns/block %6.2f ns/register\n",
+        name, blocks / seconds, seconds * 1e9 / blocks, seconds * 1e9 / blocks / REGS);
+}
+
+/**
+ * How blocks were decoded before: a big-endian U32 per register, scaled by hand
+ */
+static void decode_getvalue(const sma_plan *plan, modbus_regs rsp, SMA_Inverter *inv)
+{
+    const sma_block *b = &plan->blocks[0];
+    for (unsigned short i = b->first; i < b->first + b->count; i++)
+    {
+        const sma_register *r = &plan->regs[i];
+        unsigned long raw = getValue(rsp, b->addr, r->addr);
+        *(double *)((char *)inv + r->offset) = (double)(int)raw / r->scale;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long blocks = argc > 1 ? atol(argv[1]) : 1000000;
+
+    // Alternating signed measurements and counters, decoded into a few members
+    sma_register regs[REGS];
+    static const size_t members[] = {offsetof(SMA_Inverter, Udc1), offsetof(SMA_Inverter, Idc1), offsetof(SMA_Inverter, Uac1), offsetof(SMA_Inverter, GridFreq)};
+    for (int i = 0; i < REGS; i++)
+        regs[i] = {(unsigned short)(30001 + i * 2), i % 2 ? SMA_S32 : SMA_FIX2, 100, "r", members[i % 4], SMA_FIELD_DOUBLE};
+
+    sma_plan plan;
+    if (sma_plan_blocks(&plan, regs, REGS, 0) != 1)
+        return 1;
+
+    uint8_t rsp[MODBUS_MAX_FRAME_LENGTH] = {0};
+    rsp[MODBUS_DATA_OFFSET - 1] = plan.blocks[0].qoc * 2;
+    for (int i = 0; i < plan.blocks[0].qoc * 2; i++)
+        rsp[MODBUS_DATA_OFFSET + i] = (uint8_t)(i * 37);
+
+    SMA_Inverter a = {}, b = {};
+    decode_getvalue(&plan, rsp, &a);
+    sma_decode_block(&plan, 0, rsp, &b);
+    if (a.Udc1 != b.Udc1 || a.Idc1 != b.Idc1 || a.Uac1 != b.Uac1 || a.GridFreq != b.GridFreq)
+    {
+        fprintf(stderr, "decode: results differ\n");
+        return 1;
+    }
+
+    double start = now();
+    for (long i = 0; i < blocks; i++)
+    {
+        rsp[MODBUS_DATA_OFFSET] = (uint8_t)i;
+        decode_getvalue(&plan, rsp, &a);
+    }
+    report("getValue", blocks, now() - start);
+
+    start = now();
+    for (long i = 0; i < blocks; i++)
+    {
+        rsp[MODBUS_DATA_OFFSET] = (uint8_t)i;
+        sma_decode_block(&plan, 0, rsp, &b);
+    }
+    report("block", blocks, now() - start);
+
+    printf("%d registers per block, checksum %f\n", REGS, a.Udc1 + b.Udc1);
+    return 0;
+}
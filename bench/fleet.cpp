@@ -0,0 +1,201 @@
+/**
+ * Fleet load benchmark against sma_sim
+ * Polls n simulated inverters through the poller and reports cycle latency
+ * percentiles and polls per second.
+ *
+ * ./sma_sim -p 1502 -n 1000 -l 20 &
+ * ./bench/fleet -p 1502 -n 1000 -c 50
+ *
+ * With -u every port is a gateway, its units are polled over one connection:
+ * ./sma_sim -p 1502 -n 10 -u 32 -l 20 &
+ * ./bench/fleet -p 1502 -n 10 -u 32 -P 8
+ *
+ * With -a every inverter is polled by a coroutine on the reactor of
+ * modbus_async.h instead, one block after the other.
+ *
+ * Built with `make IO_URING=1` the poller uses io_uring, compare the CPU time
+ * per poll of both builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "modbus.h"
+#include "sma.h"
+#include "sma_map.h"
+#include "poller.h"
+#include "modbus_async.h"
+
+/**
+ * CPU time the process used in microseconds, user and system
+ */
+static long long cpu_us(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long percentile(long long *sorted, int n, double p)
+{
+    if (n == 0)
+        return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void report(const char *name, long long *samples, int n)
+{
+    qsort(samples, n, sizeof(long long), compare);
+    printf("%-10s p50 %5lld ms  p90 %5lld ms  p99 %5lld ms  max %5lld ms  (%d samples)\n", name,
+        percentile(samples, n, 0.5), percentile(samples, n, 0.9), percentile(samples, n, 0.99),
+        n ? samples[n - 1] : 0, n);
+}
+
+/**
+ * Polls all blocks of an inverter as straight-line code
+ * @param ms Time the poll took, -1 when it failed
+ */
+static mb_task pollInverter(mb_client *c, const sma_plan *plan, SMA_Inverter *inv, long long *ms)
+{
+    long long start = modbus_now_ms();
+    *ms = -1;
+
+    if (co_await c->connect() != 0)
+        co_return;
+
+    for (int b = 0; b < plan->nblocks; b++)
+    {
+        int len = co_await c->read(plan->blocks[b].addr, plan->blocks[b].qoc);
+        if (len < 0 || sma_decode_block(plan, b, c->rsp, inv) != 0)
+            co_return;
+    }
+
+    *ms = modbus_now_ms() - start;
+}
+
+int main(int argc, char **argv)
+{
+    int port = 1502;
+    int count = 1;
+    int units = 1;
+    int cycles = 20;
+    int depth = 1;
+    int gap = SMA_DEFAULT_MAX_GAP;
+    int coroutines = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:u:c:P:g:a")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p': port = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'u': units = atoi(optarg) > 1 ? atoi(optarg) : 1; break;
+        case 'c': cycles = atoi(optarg); break;
+        case 'P': depth = atoi(optarg); break;
+        case 'g': gap = atoi(optarg); break;
+        case 'a': coroutines = 1; break;
+        default:
+            fprintf(stderr, "usage: fleet [-p first port] [-n inverters] [-u units per port] [-c cycles] [-P pipeline depth] [-g max gap] [-a]\n");
+            return 1;
+        }
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    sma_plan plan;
+    if (sma_plan_blocks(&plan, sma_inverter_registers, sma_inverter_registers_count, gap) < 0)
+        return 1;
+
+    poller_t *poller = poller_create(MODBUS_RETRY_TIMEOUT_MS);
+    int ndevs = count * units;
+    SMA_Inverter *invs = (SMA_Inverter *)calloc(ndevs, sizeof(SMA_Inverter));
+    poll_device *devs = (poll_device *)calloc(ndevs, sizeof(poll_device));
+    mb_reactor *reactor = mb_reactor_create();
+    mb_client *clients = (mb_client *)calloc(ndevs, sizeof(mb_client));
+    long long *client_ms = (long long *)calloc(ndevs, sizeof(long long));
+
+    for (int i = 0; i < count; i++)
+    {
+        modbus_t *mb = modbus_connect_tcp("127.0.0.1", port + i);
+        if (mb != NULL)
+            modbus_set_pipeline(mb, depth);
+
+        // The units behind a port share its connection
+        for (int u = 0; u < units; u++)
+        {
+            poll_device *dev = &devs[i * units + u];
+            dev->inv = &invs[i * units + u];
+            dev->mb = mb;
+            dev->plan = &plan;
+            dev->unit = 0x03 + u;
+            clients[i * units + u] = {reactor, mb, dev->unit, {}};
+            if (!coroutines)
+                poller_add(poller, dev);
+        }
+    }
+
+    long long *cycle_ms = (long long *)calloc(cycles, sizeof(long long));
+    long long *device_ms = (long long *)calloc((size_t)cycles * ndevs, sizeof(long long));
+    int ndevice = 0;
+    long polls = 0, failed = 0;
+
+    long long start = modbus_now_ms();
+    long long cpu = cpu_us();
+    for (int c = 0; c < cycles; c++)
+    {
+        long long cycle_start = modbus_now_ms();
+        if (coroutines)
+        {
+            for (int i = 0; i < ndevs; i++)
+                if (clients[i].mb != NULL)
+                    pollInverter(&clients[i], &plan, devs[i].inv, &client_ms[i]);
+            mb_reactor_run(reactor);
+            cycle_ms[c] = modbus_now_ms() - cycle_start;
+
+            for (int i = 0; i < ndevs; i++)
+            {
+                if (clients[i].mb == NULL || client_ms[i] < 0)
+                {
+                    failed++;
+                    continue;
+                }
+                device_ms[ndevice++] = client_ms[i];
+                polls++;
+            }
+            continue;
+        }
+
+        failed += poller_run_cycle(poller);
+        cycle_ms[c] = modbus_now_ms() - cycle_start;
+
+        for (int i = 0; i < ndevs; i++)
+        {
+            if (devs[i].state != POLL_DONE)
+                continue;
+            device_ms[ndevice++] = devs[i].finished - devs[i].started;
+            polls++;
+        }
+    }
+    long long elapsed = modbus_now_ms() - start;
+    cpu = cpu_us() - cpu;
+
+    printf("%d inverters on %d connections, %d cycles, %d blocks per inverter, pipeline depth %d, %s\n", ndevs, count, cycles, plan.nblocks, depth, coroutines ? "coroutines" : poller_backend(poller));
+    report("cycle", cycle_ms, cycles);
+    report("inverter", device_ms, ndevice);
+    printf("%.0f polls/s, %ld failed, %.1f us CPU per poll\n", elapsed ? polls * 1000.0 / elapsed : 0, failed, polls ? (double)cpu / polls : 0);
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+/**
+ * Microbenchmark: serializing an inverter with the Influx builder
+ * versus the compile-time line protocol schema.
+ * Build with `make bench`, run ./bench/lineproto [points]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sma.h"
+#include "influx.hpp"
+#include "lineproto.hpp"
+#include "alloc_stats.h"
+
+static constexpr auto inverterLine = lineSchema<SMA_Inverter>("measurement", "inverter",
+    lineField("Condition", &SMA_Inverter::Condition),
+    lineField("Temperature", &SMA_Inverter::Temperature),
+    lineField("DayYield", &SMA_Inverter::DayYield),
+    lineField("TotalYield", &SMA_Inverter::TotalYield),
+    lineField("Pac1", &SMA_Inverter::Pac1),
+    lineField("Pdc1", &SMA_Inverter::Pdc1),
+    lineField("Pdc2", &SMA_Inverter::Pdc2),
+    lineField("Uac1", &SMA_Inverter::Uac1),
+    lineField("Udc1", &SMA_Inverter::Udc1),
+    lineField("Udc2", &SMA_Inverter::Udc2),
+    lineField("Iac1", &SMA_Inverter::Iac1),
+    lineField("Idc1", &SMA_Inverter::Idc1),
+    lineField("Idc2", &SMA_Inverter::Idc2),
+    lineField("GridRelay", &SMA_Inverter::GridRelay),
+    lineField("GridFreq", &SMA_Inverter::GridFreq),
+    lineField("ReactivePower", &SMA_Inverter::ReactivePower),
+    lineField("ApparentPower", &SMA_Inverter::ApparentPower));
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long points, double seconds, unsigned long allocations, size_t bytes)
+{
+    printf("%-8s %10.0f points/s %8.1f ns/point %6.2f allocations/point (%lu bytes)\n",
+        name, points / seconds, seconds * 1e9 / points, (double)allocations / points, (unsigned long)bytes);
+}
+
+int main(int argc, char **argv)
+{
+    long points = argc > 1 ? atol(argv[1]) : 1000000;
+
+    SMA_Inverter inv = {};
+    inv.Name = (char *)"SB4000TL-21";
+    inv.Condition = 307;
+    inv.Temperature = 30.1;
+    inv.DayYield = 1954;
+    inv.TotalYield = 39230580;
+    inv.Pac1 = 496;
+    inv.Pdc1 = 335;
+    inv.Pdc2 = 186;
+    inv.Uac1 = 233.83;
+    inv.Udc1 = 358.76;
+    inv.Udc2 = 220.24;
+    inv.Iac1 = 2.147;
+    inv.Idc1 = 0.936;
+    inv.Idc2 = 0.847;
+    inv.GridRelay = 51;
+    inv.GridFreq = 49.99;
+    inv.ApparentPower = 500;
+
+    /**
+     * Before: builder with a string per field
+     */
+    Influx ifx("localhost", 8086, "org", "bucket", "token");
+    size_t bytes = 0;
+    unsigned long allocations = alloc_stats_count();
+    double start = now();
+    for (long i = 0; i < points; i++)
+    {
+        ifx.meas("measurement")
+            .tag("inverter", inv.Name)
+            .field("Condition", inv.Condition)
+            .field("Temperature", inv.Temperature)
+            .field("DayYield", inv.DayYield)
+            .field("TotalYield", inv.TotalYield)
+            .field("Pac1", inv.Pac1)
+            .field("Pdc1", inv.Pdc1)
+            .field("Pdc2", inv.Pdc2)
+            .field("Uac1", inv.Uac1)
+            .field("Udc1", inv.Udc1)
+            .field("Udc2", inv.Udc2)
+            .field("Iac1", inv.Iac1)
+            .field("Idc1", inv.Idc1)
+            .field("Idc2", inv.Idc2)
+            .field("GridRelay", inv.GridRelay)
+            .field("GridFreq", inv.GridFreq)
+            .field("ReactivePower", inv.ReactivePower)
+            .field("ApparentPower", inv.ApparentPower)
+            .timestamp(1716631685 + i);
+        bytes += ifx.line().length();
+        ifx.clear();
+    }
+    report("builder", points, now() - start, alloc_stats_count() - allocations, bytes);
+
+    /**
+     * After: compile-time schema into a reused buffer
+     */
+    LineBuffer line;
+    bytes = 0;
+    allocations = alloc_stats_count();
+    start = now();
+    for (long i = 0; i < points; i++)
+    {
+        line.clear();
+        inverterLine.write(line, inv, inv.Name, 1716631685 + i);
+        bytes += line.length();
+    }
+    report("schema", points, now() - start, alloc_stats_count() - allocations, bytes);
+
+    printf("%.*s\n", (int)line.length(), line.data());
+
+    return 0;
+}
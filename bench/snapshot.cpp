@@ -0,0 +1,114 @@
+/**
+ * Microbenchmark: reading the shared memory snapshot while a thread publishes
+ * into it, by default as fast as it can, the worst case for the seqlock.
+ * Every sample has all fields set to its own sequence number, so a torn read shows.
+ * Build with `make bench`, run ./bench/snapshot [reads] [us between samples]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sma.h"
+#include "sma_map.h"
+#include "snapshot.h"
+
+static int stop;
+static int period_us;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *publish(void *arg)
+{
+    snapshot_t *sn = (snapshot_t *)arg;
+    SMA_Inverter inv = {};
+    long long i = 1;
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        for (size_t r = 0; r < sma_inverter_registers_count; r++)
+        {
+            char *member = (char *)&inv + sma_inverter_registers[r].offset;
+            if (sma_inverter_registers[r].kind == SMA_FIELD_DOUBLE)
+                *(double *)member = (double)i;
+            else
+                *(unsigned long *)member = (unsigned long)i;
+        }
+        snapshot_publish(sn, 0, sma_inverter_registers, sma_inverter_registers_count, &inv, ~0UL, i++);
+        if (period_us > 0)
+            usleep(period_us);
+    }
+    return (void *)(long)i;
+}
+
+int main(int argc, char **argv)
+{
+    long reads = argc > 1 ? atol(argv[1]) : 10000000;
+    period_us = argc > 2 ? atoi(argv[2]) : 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/sma-bench-%d", (int)getpid());
+    snapshot_t *sn = snapshot_open(name);
+    const snapshot_segment *seg = sn ? snapshot_attach(name) : NULL;
+    if (seg == NULL)
+        return 1;
+    int slot = snapshot_slot_of(sn, "bench");
+    int pac = snapshot_field(seg, "Pac1");
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, publish, sn);
+    while (__atomic_load_n(&seg->slots[slot].sample.ts_ms, __ATOMIC_ACQUIRE) == 0)
+        ;
+
+    snapshot_sample sample;
+    long busy = 0, torn = 0;
+    double start = now();
+    for (long i = 0; i < reads; i++)
+    {
+        if (snapshot_read(seg, slot, &sample) != 0)
+        {
+            busy++;
+            continue;
+        }
+        for (uint32_t f = 0; f < seg->nfields; f++)
+            if (sample.values[f] != (double)sample.ts_ms)
+            {
+                torn++;
+                break;
+            }
+    }
+    double full = now() - start;
+
+    double value;
+    int64_t ts;
+    long busyValue = 0, tornValue = 0;
+    start = now();
+    for (long i = 0; i < reads; i++)
+    {
+        if (snapshot_read_value(seg, slot, pac, &value, &ts) != 0)
+            busyValue++;
+        else if (value != (double)ts)
+            tornValue++;
+    }
+    double single = now() - start;
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    void *published;
+    pthread_join(writer, &published);
+
+    snapshot_detach(seg);
+    snapshot_close(sn);
+    shm_unlink(name);
+
+    printf("%ld samples published while reading\n", (long)published);
+    printf("snapshot_read       %6.1f ns/read, %ld gave up, %ld torn\n", full * 1e9 / reads, busy, torn);
+    printf("snapshot_read_value %6.1f ns/read, %ld gave up, %ld torn\n", single * 1e9 / reads, busyValue, tornValue);
+    return torn + tornValue > 0;
+}
@@ -0,0 +1,441 @@
+/**
+ * SMA Modbus TCP simulator
+ * Serves the registers of sma_inverter_registers for any number of virtual
+ * inverters, one per port, and injects the faults we see on real Sunny Boys.
+ * With -u every port is a gateway to that many inverters, unit IDs 3 and up.
+ *
+ * ./sma_sim -p 1502 -n 1000 -l 20 -j 10 -f 0.01 -e 0.001 -d 0.001
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "modbus.h"
+#include "sma_map.h"
+#include "config.h"
+
+#define SIM_MAX_EVENTS 256
+#define SIM_MAX_PENDING 16
+
+enum
+{
+    SIM_LISTENER,
+    SIM_CONNECTION,
+};
+
+typedef struct
+{
+    int kind;
+    int fd;
+    int inverter;
+} sim_listener;
+
+/**
+ * Response waiting for its injected latency
+ */
+typedef struct
+{
+    long long due;
+    int lone_ff;        // Send SMA's lone 0xFF first
+    int len;
+    uint8_t frame[MODBUS_MAX_FRAME_LENGTH];
+} sim_response;
+
+typedef struct
+{
+    int kind;
+    int fd;
+    int inverter;
+
+    uint8_t rx[MODBUS_RX_BUFFER];
+    int rx_len;
+
+    sim_response out[SIM_MAX_PENDING];
+    int nout;
+} sim_conn;
+
+typedef struct
+{
+    int latency;        // ms
+    int jitter;         // ms, added uniformly
+    double lone_ff;     // Probability of a lone 0xFF before a response
+    double exception;   // Probability of an Illegal Data Address exception
+    double disconnect;  // Probability of closing the connection instead of answering
+} sim_faults;
+
+static sim_faults faults;
+static int epfd;
+static int units = 1;   // Inverters behind every port
+
+static sim_conn **conns = NULL;
+static int nconns = 0;
+
+static unsigned long requests = 0;
+
+static double chance(void)
+{
+    return drand48();
+}
+
+/**
+ * Plausible value of a register, varying over time and between inverters
+ * @return raw register value, as the inverter would send it
+ */
+static unsigned int sim_value(int inverter, unsigned short addr, time_t now)
+{
+    // Daylight curve peaking at noon, 0 at night
+    double t = (now % 86400) / 86400.0;
+    double sun = fmax(0, sin((t - 0.25) * 2 * M_PI));
+    double p = sun * (3000 + (inverter % 10) * 100) + (inverter % 7);
+
+    switch (addr)
+    {
+    case 30201: return sun > 0 ? 307 : 303;             // Condition: Ok / Off
+    case 30217: return sun > 0 ? 51 : 311;              // GridRelay: Closed / Open
+    case 30529: return 39230580 + inverter * 1000 + (unsigned int)(now / 10);  // TotalYield Wh
+    case 30535: return (unsigned int)(p * t * 10);      // DayYield Wh
+    case 30769: return (unsigned int)(p / 2 / 350 * 1000); // Idc1 FIX3
+    case 30771: return sun > 0 ? 35000 + inverter % 1000 : 0; // Udc1 FIX2
+    case 30773: return (unsigned int)(p / 2);           // Pdc1
+    case 30775: return (unsigned int)(p * 0.96);        // Pac1
+    case 30783: return 23000 + (inverter * 13) % 600;   // Uac1 FIX2
+    case 30803: return 4995 + (now + inverter) % 10;    // GridFreq FIX2
+    case 30805: return 0;                               // ReactivePower
+    case 30813: return (unsigned int)(p * 0.97);        // ApparentPower
+    case 30953: return sun > 0 ? 250 + (unsigned int)(sun * 200) : 0x80000000; // Temperature TEMP, NaN at night
+    case 30957: return (unsigned int)(p / 2 / 220 * 1000); // Idc2 FIX3
+    case 30959: return sun > 0 ? 22000 + inverter % 1000 : 0; // Udc2 FIX2
+    case 30961: return (unsigned int)(p / 2);           // Pdc2
+    case 30977: return (unsigned int)(p / 230 * 1000);  // Iac1 FIX3
+    }
+
+    return 0xFFFFFFFF;
+}
+
+/**
+ * Whether a 32 bit value of the register map starts at addr
+ */
+static int sim_known(unsigned int addr)
+{
+    for (size_t i = 0; i < sma_inverter_registers_count; i++)
+        if (sma_inverter_registers[i].addr == addr)
+            return 1;
+    return 0;
+}
+
+/**
+ * Builds the response to a read request
+ * @return length of the frame
+ */
+static int sim_respond(sim_conn *c, const uint8_t *req, uint8_t *frame)
+{
+    unsigned char function = req[7];
+    unsigned short addr = (req[8] << 8) | req[9];
+    unsigned short qoc = (req[10] << 8) | req[11];
+    unsigned char exception = 0;
+    int unit = req[6] - CONFIG_DEFAULT_UNIT;
+
+    if (units > 1 && (unit < 0 || unit >= units))
+        exception = MODBUS_EXCEPTION_GATEWAY_TARGET;
+    else if (function != MODBUS_READ_HOLDING_REGISTERS)
+        exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    else if (qoc == 0 || qoc > SMA_MAX_BLOCK_REGS)
+        exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    else if (addr < 30001 || chance() < faults.exception)
+        exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    // Transaction ID, protocol and unit ID are echoed
+    memcpy(frame, req, 7);
+
+    if (exception)
+    {
+        frame[4] = 0;
+        frame[5] = 3;
+        frame[7] = function | 0x80;
+        frame[8] = exception;
+        return MODBUS_DATA_OFFSET;
+    }
+
+    int length = 3 + qoc * 2;
+    frame[4] = length >> 8;
+    frame[5] = length & 0xFF;
+    frame[7] = function;
+    frame[8] = qoc * 2;
+
+    /**
+     * SMA values are 32 bit big-endian over two registers
+     */
+    time_t now = time(NULL);
+    int inverter = units > 1 ? c->inverter * units + unit : c->inverter;
+    uint8_t *data = frame + MODBUS_DATA_OFFSET;
+    for (unsigned int r = addr; r < (unsigned int)addr + qoc; r++)
+    {
+        // Registers we don't simulate read as NaN
+        unsigned short word = 0xFFFF;
+        if (sim_known(r))
+            word = sim_value(inverter, r, now) >> 16;
+        else if (sim_known(r - 1))
+            word = sim_value(inverter, r - 1, now) & 0xFFFF;
+
+        *data++ = word >> 8;
+        *data++ = word & 0xFF;
+    }
+
+    return MODBUS_MBAP_LENGTH + length;
+}
+
+static void sim_close(sim_conn *c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conns[i] == c)
+        {
+            conns[i] = conns[--nconns];
+            break;
+        }
+    }
+    free(c);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Sends responses whose latency passed
+ * @return 0, or -1 when the connection was closed
+ */
+static int sim_flush(sim_conn *c, long long now)
+{
+    int i = 0;
+    while (i < c->nout)
+    {
+        sim_response *r = &c->out[i];
+        if (r->due > now)
+        {
+            i++;
+            continue;
+        }
+
+        if (r->lone_ff)
+            send(c->fd, "\xFF", 1, MSG_NOSIGNAL);
+        if (send(c->fd, r->frame, r->len, MSG_NOSIGNAL) != r->len)
+        {
+            sim_close(c);
+            return -1;
+        }
+
+        c->out[i] = c->out[--c->nout];
+    }
+    return 0;
+}
+
+/**
+ * Handles all complete requests in the receive buffer
+ */
+static void sim_receive(sim_conn *c)
+{
+    for (;;)
+    {
+        int rc = recv(c->fd, c->rx + c->rx_len, sizeof(c->rx) - c->rx_len, 0);
+        if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            sim_close(c);
+            return;
+        }
+        if (rc < 0)
+            break;
+        c->rx_len += rc;
+
+        while (c->rx_len >= MODBUS_TCP_REQ_LENGTH)
+        {
+            requests++;
+
+            if (chance() < faults.disconnect)
+            {
+                sim_close(c);
+                return;
+            }
+
+            if (c->nout < SIM_MAX_PENDING)
+            {
+                sim_response *r = &c->out[c->nout++];
+                r->due = now_ms() + faults.latency + (faults.jitter ? rand() % (faults.jitter + 1) : 0);
+                r->lone_ff = chance() < faults.lone_ff;
+                r->len = sim_respond(c, c->rx, r->frame);
+            }
+
+            memmove(c->rx, c->rx + MODBUS_TCP_REQ_LENGTH, c->rx_len - MODBUS_TCP_REQ_LENGTH);
+            c->rx_len -= MODBUS_TCP_REQ_LENGTH;
+        }
+    }
+
+    sim_flush(c, now_ms());
+}
+
+static void sim_accept(sim_listener *l)
+{
+    for (;;)
+    {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1)
+            return;
+
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+        sim_conn *c = (sim_conn *)calloc(1, sizeof(sim_conn));
+        c->kind = SIM_CONNECTION;
+        c->fd = fd;
+        c->inverter = l->inverter;
+
+        conns = (sim_conn **)realloc(conns, sizeof(sim_conn *) * (nconns + 1));
+        conns[nconns++] = c;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static int sim_listen(int port, int inverter)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int flag = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(fd, 16) == -1)
+    {
+        fprintf(stderr, "sma_sim: Can't listen on %d\n", port);
+        close(fd);
+        return -1;
+    }
+
+    sim_listener *l = (sim_listener *)malloc(sizeof(sim_listener));
+    l->kind = SIM_LISTENER;
+    l->fd = fd;
+    l->inverter = inverter;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sma_sim [-p first port] [-n inverters] [-u units per port] [-l latency ms] [-j jitter ms]\n"
+                    "               [-f lone 0xFF probability] [-e exception probability] [-d disconnect probability]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int port = 1502;
+    int count = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:u:l:j:f:e:d:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p': port = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'u': units = atoi(optarg) > 1 ? atoi(optarg) : 1; break;
+        case 'l': faults.latency = atoi(optarg); break;
+        case 'j': faults.jitter = atoi(optarg); break;
+        case 'f': faults.lone_ff = atof(optarg); break;
+        case 'e': faults.exception = atof(optarg); break;
+        case 'd': faults.disconnect = atof(optarg); break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    // A socket per inverter plus its connections
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    signal(SIGPIPE, SIG_IGN);
+    srand48(time(NULL));
+
+    epfd = epoll_create1(0);
+    for (int i = 0; i < count; i++)
+    {
+        if (sim_listen(port + i, i) != 0)
+            return 1;
+    }
+
+    printf("sma_sim: %d x %d inverters on 127.0.0.1:%d-%d, latency %d+%d ms, 0xFF %.3f, exception %.3f, disconnect %.3f\n",
+        count, units, port, port + count - 1, faults.latency, faults.jitter, faults.lone_ff, faults.exception, faults.disconnect);
+    fflush(stdout);
+
+    struct epoll_event events[SIM_MAX_EVENTS];
+    for (;;)
+    {
+        /**
+         * Wake up for the earliest delayed response
+         */
+        long long now = now_ms();
+        long long next = -1;
+        for (int i = 0; i < nconns; i++)
+        {
+            for (int r = 0; r < conns[i]->nout; r++)
+            {
+                long long wait = conns[i]->out[r].due - now;
+                if (next == -1 || wait < next)
+                    next = wait < 0 ? 0 : wait;
+            }
+        }
+
+        int n = epoll_wait(epfd, events, SIM_MAX_EVENTS, (int)next);
+        for (int i = 0; i < n; i++)
+        {
+            int kind = *(int *)events[i].data.ptr;
+            if (kind == SIM_LISTENER)
+                sim_accept((sim_listener *)events[i].data.ptr);
+            else
+                sim_receive((sim_conn *)events[i].data.ptr);
+        }
+
+        now = now_ms();
+        for (int i = nconns - 1; i >= 0; i--)
+        {
+            if (i < nconns && conns[i]->nout > 0)
+                sim_flush(conns[i], now);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <stddef.h>
+
+#include "alloc_stats.h"
+
+// Per thread, so one thread can check its own allocations while others allocate
+static __thread unsigned long allocations = 0;
+
+#ifdef ALLOC_STATS
+/**
+ * Wrap glibc's allocator. operator new ends up in malloc as well.
+ */
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t nmemb, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+    void __libc_free(void *ptr);
+
+    void *malloc(size_t size)
+    {
+        allocations++;
+        return __libc_malloc(size);
+    }
+
+    void *calloc(size_t nmemb, size_t size)
+    {
+        allocations++;
+        return __libc_calloc(nmemb, size);
+    }
+
+    void *realloc(void *ptr, size_t size)
+    {
+        allocations++;
+        return __libc_realloc(ptr, size);
+    }
+
+    void free(void *ptr)
+    {
+        __libc_free(ptr);
+    }
+}
+#endif
+
+unsigned long alloc_stats_count(void)
+{
+    return allocations;
+}
@@ -0,0 +1,10 @@
+#ifndef ALLOC_STATS_H
+#define ALLOC_STATS_H
+
+/**
+ * Counts heap allocations of the calling thread.
+ * Only available when built with `make ALLOC_STATS=1`, otherwise always 0.
+ */
+unsigned long alloc_stats_count(void);
+
+#endif
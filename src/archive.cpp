@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+
+// XOR window of a double that has none yet, no value fits it
+#define ARCHIVE_NO_WINDOW 0xFF
+
+// Bit widths of the buckets for the delta of delta of timestamps and the delta of counters
+static const unsigned char archive_dod_widths[] = {7, 9, 12, 32};
+static const unsigned char archive_delta_widths[] = {8, 16, 32, 64};
+
+/**
+ * Bit stream of a chunk being read
+ */
+typedef struct
+{
+    const uint8_t *bits;
+    size_t nbits;
+    size_t pos;
+    int overrun;            // Read past the end, the chunk is corrupt
+} archive_reader;
+
+/**
+ * Appends the n lowest bits of v, most significant first
+ */
+static void archive_put(archive_series *s, unsigned long long v, int n)
+{
+    while (n > 0)
+    {
+        int room = 8 - (int)(s->nbits & 7);
+        int take = n < room ? n : room;
+        unsigned int bits = (unsigned int)(v >> (n - take)) & ((1U << take) - 1);
+
+        s->bits[s->nbits >> 3] |= bits << (room - take);
+        s->nbits += take;
+        n -= take;
+    }
+}
+
+static unsigned long long archive_get(archive_reader *r, int n)
+{
+    unsigned long long v = 0;
+    while (n > 0)
+    {
+        if (r->pos >= r->nbits)
+        {
+            r->overrun = 1;
+            return 0;
+        }
+
+        int room = 8 - (int)(r->pos & 7);
+        int take = n < room ? n : room;
+        v = (v << take) | ((r->bits[r->pos >> 3] >> (room - take)) & ((1U << take) - 1));
+        r->pos += take;
+        n -= take;
+    }
+    return v;
+}
+
+/**
+ * Appends a signed value in the smallest bucket it fits:
+ * 0 for 0, else one 1 per bucket, a 0 unless it is the last, and the value
+ */
+static void archive_put_signed(archive_series *s, long long v, const unsigned char *widths, int nwidths)
+{
+    if (v == 0)
+    {
+        archive_put(s, 0, 1);
+        return;
+    }
+
+    int i = 0;
+    while (i < nwidths - 1 && (v < -(1LL << (widths[i] - 1)) || v >= (1LL << (widths[i] - 1))))
+        i++;
+
+    if (i < nwidths - 1)
+        archive_put(s, ((1ULL << (i + 1)) - 1) << 1, i + 2);
+    else
+        archive_put(s, (1ULL << nwidths) - 1, nwidths);
+    archive_put(s, (unsigned long long)v, widths[i]);
+}
+
+static long long archive_get_signed(archive_reader *r, const unsigned char *widths, int nwidths)
+{
+    int ones = 0;
+    while (ones < nwidths && archive_get(r, 1))
+        ones++;
+    if (ones == 0)
+        return 0;
+
+    int width = widths[ones - 1];
+    unsigned long long v = archive_get(r, width);
+    if (width < 64 && (v >> (width - 1)) & 1)
+        v |= ~0ULL << width;
+    return (long long)v;
+}
+
+/**
+ * Appends a double XORed with the previous one of its field:
+ * 0 when unchanged, 10 and the bits that changed when they fit the window
+ * of the previous value, else 11, leading zeros, length and the bits
+ */
+static void archive_put_double(archive_series *s, int f, double d)
+{
+    unsigned long long bits;
+    memcpy(&bits, &d, sizeof(bits));
+    unsigned long long x = bits ^ s->prev[f];
+    s->prev[f] = bits;
+
+    if (x == 0)
+    {
+        archive_put(s, 0, 1);
+        return;
+    }
+
+    int lead = __builtin_clzll(x);
+    int trail = __builtin_ctzll(x);
+    if (lead > 31)
+        lead = 31;
+
+    if (lead >= s->lead[f] && trail >= s->trail[f])
+    {
+        archive_put(s, 2, 2);
+        archive_put(s, x >> s->trail[f], 64 - s->lead[f] - s->trail[f]);
+        return;
+    }
+
+    int sig = 64 - lead - trail;
+    archive_put(s, 3, 2);
+    archive_put(s, lead, 5);
+    archive_put(s, sig - 1, 6);
+    archive_put(s, x >> trail, sig);
+    s->lead[f] = lead;
+    s->trail[f] = trail;
+}
+
+/**
+ * Appends a double read with a register scale: 0 and the delta of value * scale
+ * when that gives the value back exactly, which is far smaller than the XOR
+ * of a noisy decimal, else 1 and the double
+ * @param scale Of the register, 0 when it has none
+ */
+static void archive_put_decimal(archive_series *s, int f, double d, uint32_t scale)
+{
+    if (scale != 0)
+    {
+        double k = round(d * scale);
+        double back = fabs(k) < 9007199254740992.0 ? (double)(long long)k / scale : NAN;
+        if (memcmp(&back, &d, sizeof(d)) == 0)
+        {
+            archive_put(s, 0, 1);
+            archive_put_signed(s, (long long)k - s->scaled[f], archive_delta_widths, sizeof(archive_delta_widths));
+            s->scaled[f] = (long long)k;
+            memcpy(&s->prev[f], &d, sizeof(d));
+            return;
+        }
+        archive_put(s, 1, 1);
+    }
+    archive_put_double(s, f, d);
+}
+
+/**
+ * Scale of a register as stored in the chunk, 0 when it isn't a whole number
+ */
+static uint32_t archive_scale(const sma_register *reg)
+{
+    if (reg->kind != SMA_FIELD_DOUBLE || !(reg->scale >= 1 && reg->scale <= UINT32_MAX) || reg->scale != floor(reg->scale))
+        return 0;
+    return (uint32_t)reg->scale;
+}
+
+/**
+ * Reads a double written by archive_put_double
+ * @return 0, -1 when the stream is corrupt
+ */
+static int archive_get_double(archive_reader *r, unsigned long long *prev, unsigned char *lead, unsigned char *trail)
+{
+    if (archive_get(r, 1) == 0)
+        return 0;
+
+    if (archive_get(r, 1) == 0)
+    {
+        if (*lead == ARCHIVE_NO_WINDOW)
+            return -1;
+        *prev ^= archive_get(r, 64 - *lead - *trail) << *trail;
+        return 0;
+    }
+
+    *lead = (unsigned char)archive_get(r, 5);
+    int sig = (int)archive_get(r, 6) + 1;
+    if (*lead + sig > 64)
+        return -1;
+    *trail = (unsigned char)(64 - *lead - sig);
+    *prev ^= archive_get(r, sig) << *trail;
+    return 0;
+}
+
+/**
+ * Creates the directory of the archive if needed, files are opened by the first chunk
+ * @param dir Directory the day files are written to
+ * @return archive, NULL when failed
+ */
+archive_t *archive_open(const char *dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "archive: Can't create %s\n", dir);
+        return NULL;
+    }
+
+    archive_t *ar = (archive_t *)malloc(sizeof(archive_t));
+    ar->dir = strdup(dir);
+    ar->day = -1;
+    ar->data_fd = -1;
+    ar->index_fd = -1;
+    ar->data_size = 0;
+    ar->series = NULL;
+    ar->nseries = 0;
+    return ar;
+}
+
+static void archive_close_day(archive_t *ar)
+{
+    if (ar->data_fd >= 0)
+        close(ar->data_fd);
+    if (ar->index_fd >= 0)
+        close(ar->index_fd);
+    ar->data_fd = -1;
+    ar->index_fd = -1;
+    ar->day = -1;
+}
+
+/**
+ * Opens the files of a day for appending.
+ * A chunk without index entry was cut off by a crash and is dropped,
+ * so is an index entry whose chunk is missing.
+ * @param day Days since the epoch, UTC
+ */
+static int archive_open_day(archive_t *ar, int day)
+{
+    archive_close_day(ar);
+
+    char path[PATH_MAX];
+    time_t t = (time_t)day * 86400;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    int len = snprintf(path, sizeof(path), "%s/%04d%02d%02d.sma", ar->dir, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    ar->data_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    memcpy(path + len - 3, "idx", 3);
+    ar->index_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (ar->data_fd == -1 || ar->index_fd == -1)
+    {
+        fprintf(stderr, "archive: Can't open %s\n", path);
+        archive_close_day(ar);
+        return -1;
+    }
+
+    memcpy(path + len - 3, "sma", 3);
+
+    struct stat data, index;
+    if (fstat(ar->data_fd, &data) == -1 || fstat(ar->index_fd, &index) == -1)
+    {
+        archive_close_day(ar);
+        return -1;
+    }
+
+    uint64_t n = index.st_size / sizeof(archive_index_entry);
+    uint64_t end = 0;
+    for (; n > 0; n--)
+    {
+        archive_index_entry e;
+        if (pread(ar->index_fd, &e, sizeof(e), (n - 1) * sizeof(e)) == sizeof(e) && e.offset + e.length <= (uint64_t)data.st_size)
+        {
+            end = e.offset + e.length;
+            break;
+        }
+    }
+
+    if ((uint64_t)index.st_size != n * sizeof(archive_index_entry) || (uint64_t)data.st_size != end)
+    {
+        fprintf(stderr, "archive: Dropping the incomplete end of %s\n", path);
+        if (ftruncate(ar->index_fd, n * sizeof(archive_index_entry)) == -1 || ftruncate(ar->data_fd, end) == -1)
+        {
+            archive_close_day(ar);
+            return -1;
+        }
+    }
+
+    ar->data_size = end;
+    ar->day = day;
+    return 0;
+}
+
+static int archive_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Writes the chunk of a series with its index entry and starts a new one.
+ * A chunk that can't be written is dropped.
+ */
+static void archive_write_chunk(archive_t *ar, archive_series *s)
+{
+    if (s->count == 0)
+        return;
+
+    size_t nbytes = (s->nbits + 7) / 8;
+    int day = (int)(s->first_ms / ARCHIVE_DAY_MS);
+
+    if (day == ar->day || archive_open_day(ar, day) == 0)
+    {
+        uint8_t *body = ar->chunk + sizeof(archive_chunk_header);
+        uint8_t *p = body;
+
+        size_t name_len = strlen(s->name);
+        memcpy(p, s->name, name_len);
+        p += name_len;
+        for (size_t r = 0; r < s->nregs; r++)
+        {
+            size_t len = strnlen(s->regs[r].name, ARCHIVE_MAX_NAME);
+            uint32_t scale = archive_scale(&s->regs[r]);
+            *p++ = (uint8_t)s->regs[r].kind;
+            *p++ = (uint8_t)len;
+            memcpy(p, &scale, sizeof(scale));
+            memcpy(p + sizeof(scale), s->regs[r].name, len);
+            p += sizeof(scale) + len;
+        }
+        memcpy(p, s->bits, nbytes);
+        p += nbytes;
+
+        archive_chunk_header hdr;
+        hdr.magic = ARCHIVE_CHUNK_MAGIC;
+        hdr.length = (uint32_t)(p - body);
+        hdr.crc = (uint32_t)crc32(0, body, hdr.length);
+        hdr.nsamples = (uint16_t)s->count;
+        hdr.nfields = (uint8_t)s->nregs;
+        hdr.name_len = (uint8_t)name_len;
+        hdr.first_ms = s->first_ms;
+        hdr.last_ms = s->last_ms;
+        memcpy(ar->chunk, &hdr, sizeof(hdr));
+
+        archive_index_entry e;
+        e.offset = ar->data_size;
+        e.length = (uint32_t)(p - ar->chunk);
+        e.nsamples = s->count;
+        e.first_ms = s->first_ms;
+        e.last_ms = s->last_ms;
+
+        if (archive_write_all(ar->data_fd, ar->chunk, e.length) != 0 || archive_write_all(ar->index_fd, &e, sizeof(e)) != 0)
+        {
+            fprintf(stderr, "archive: Can't write %s, %u samples lost\n", s->name, s->count);
+            archive_close_day(ar);
+        }
+        else
+            ar->data_size += e.length;
+    }
+
+    memset(s->bits, 0, nbytes);
+    s->nbits = 0;
+    s->count = 0;
+}
+
+/**
+ * Adds a sample of an inverter to its chunk, writes the chunk once it is full
+ * @param device Index of the inverter in the fleet
+ * @param name Name of the inverter, the tag written back
+ * @param regs Registers of the inverter, the fields
+ * @param valid Fields to keep, bit per register, the others weren't read or are NaN
+ * @param ts_ms Wall clock ms of the sample
+ * @return 0, -1 when out of memory
+ */
+int archive_append(archive_t *ar, int device, const char *name, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms)
+{
+    if (nregs > ARCHIVE_MAX_FIELDS)
+        return -1;
+    if (nregs < ARCHIVE_MAX_FIELDS)
+        valid &= (1UL << nregs) - 1;
+    if (valid == 0)
+        return 0;
+
+    if (device >= ar->nseries)
+    {
+        archive_series **series = (archive_series **)realloc(ar->series, sizeof(archive_series *) * (device + 1));
+        if (series == NULL)
+            return -1;
+        memset(series + ar->nseries, 0, sizeof(archive_series *) * (device + 1 - ar->nseries));
+        ar->series = series;
+        ar->nseries = device + 1;
+    }
+    if (ar->series[device] == NULL && (ar->series[device] = (archive_series *)calloc(1, sizeof(archive_series))) == NULL)
+        return -1;
+    archive_series *s = ar->series[device];
+
+    // Worst case: timestamp, mask and every field as unscaled double with 11, 5 + 6 bits of window and 64 bits
+    size_t worst = 4 + 32 + 1 + nregs + nregs * 78;
+    if (s->count > 0 && (s->nbits + worst > ARCHIVE_CHUNK_BYTES * 8 || s->count == UINT16_MAX
+        || s->regs != regs || s->nregs != nregs
+        || ts_ms < s->last_ms || ts_ms - s->first_ms >= ARCHIVE_CHUNK_AGE_MS
+        || ts_ms / ARCHIVE_DAY_MS != s->first_ms / ARCHIVE_DAY_MS))
+        archive_write_chunk(ar, s);
+
+    if (s->count == 0)
+    {
+        snprintf(s->name, sizeof(s->name), "%s", name);
+        s->regs = regs;
+        s->nregs = nregs;
+        s->first_ms = ts_ms;
+        s->delta = 0;
+        memset(s->prev, 0, sizeof(s->prev));
+        memset(s->scaled, 0, sizeof(s->scaled));
+        memset(s->lead, ARCHIVE_NO_WINDOW, sizeof(s->lead));
+        memset(s->trail, 0, sizeof(s->trail));
+    }
+    else
+    {
+        long long delta = ts_ms - s->last_ms;
+        archive_put_signed(s, delta - s->delta, archive_dod_widths, sizeof(archive_dod_widths));
+        s->delta = delta;
+    }
+
+    // Mostly the same fields as last time
+    if (s->count == 0 || valid != s->mask)
+    {
+        archive_put(s, 1, 1);
+        archive_put(s, valid, (int)nregs);
+        s->mask = valid;
+    }
+    else
+        archive_put(s, 0, 1);
+
+    for (size_t r = 0; r < nregs; r++)
+    {
+        if (!(valid & (1UL << r)))
+            continue;
+
+        const char *member = (const char *)inv + regs[r].offset;
+        if (regs[r].kind == SMA_FIELD_DOUBLE)
+            archive_put_decimal(s, (int)r, *(const double *)member, archive_scale(&regs[r]));
+        else
+        {
+            // Deltas of long members wrap the same way
+            unsigned long long v = *(const unsigned long *)member;
+            archive_put_signed(s, (long long)(v - s->prev[r]), archive_delta_widths, sizeof(archive_delta_widths));
+            s->prev[r] = v;
+        }
+    }
+
+    s->last_ms = ts_ms;
+    s->count++;
+    return 0;
+}
+
+/**
+ * Writes the chunks whose first sample is ARCHIVE_CHUNK_AGE_MS old
+ * @param now_ms Wall clock ms
+ */
+void archive_flush_due(archive_t *ar, long long now_ms)
+{
+    for (int i = 0; i < ar->nseries; i++)
+        if (ar->series[i] != NULL && ar->series[i]->count > 0 && now_ms - ar->series[i]->first_ms >= ARCHIVE_CHUNK_AGE_MS)
+            archive_write_chunk(ar, ar->series[i]);
+}
+
+/**
+ * Writes all chunks in progress, e.g. before the inverters change
+ */
+void archive_flush(archive_t *ar)
+{
+    for (int i = 0; i < ar->nseries; i++)
+        if (ar->series[i] != NULL)
+            archive_write_chunk(ar, ar->series[i]);
+}
+
+void archive_close(archive_t *ar)
+{
+    archive_flush(ar);
+    archive_close_day(ar);
+
+    for (int i = 0; i < ar->nseries; i++)
+        free(ar->series[i]);
+    free(ar->series);
+    free(ar->dir);
+    free(ar);
+}
+
+/**
+ * Decodes the samples of a chunk
+ * @return number of samples passed to visit, -1 when the chunk is corrupt
+ */
+static long archive_decode(const uint8_t *buf, size_t len, long long from_ms, long long to_ms, const char *name,
+    archive_visit visit, void *ctx)
+{
+    archive_chunk_header hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != ARCHIVE_CHUNK_MAGIC || sizeof(hdr) + hdr.length != len || hdr.nfields > ARCHIVE_MAX_FIELDS
+        || crc32(0, buf + sizeof(hdr), hdr.length) != hdr.crc)
+        return -1;
+
+    const uint8_t *p = buf + sizeof(hdr);
+    const uint8_t *end = p + hdr.length;
+
+    char chunk_name[ARCHIVE_MAX_NAME + 1];
+    if (hdr.name_len > end - p)
+        return -1;
+    memcpy(chunk_name, p, hdr.name_len);
+    chunk_name[hdr.name_len] = '\0';
+    p += hdr.name_len;
+    if (name != NULL && strcmp(name, chunk_name) != 0)
+        return 0;
+
+    archive_field fields[ARCHIVE_MAX_FIELDS];
+    for (int f = 0; f < hdr.nfields; f++)
+    {
+        if (end - p < 6 || p[1] > end - p - 6)
+            return -1;
+        fields[f].kind = (sma_field_kind)p[0];
+        memcpy(&fields[f].scale, p + 2, sizeof(fields[f].scale));
+        memcpy(fields[f].name, p + 6, p[1]);
+        fields[f].name[p[1]] = '\0';
+        p += 6 + p[1];
+    }
+
+    archive_reader r = {p, (size_t)(end - p) * 8, 0, 0};
+    unsigned long long prev[ARCHIVE_MAX_FIELDS] = {0};
+    long long scaled[ARCHIVE_MAX_FIELDS] = {0};
+    unsigned char lead[ARCHIVE_MAX_FIELDS];
+    unsigned char trail[ARCHIVE_MAX_FIELDS] = {0};
+    memset(lead, ARCHIVE_NO_WINDOW, sizeof(lead));
+    archive_value values[ARCHIVE_MAX_FIELDS];
+
+    long long ts = hdr.first_ms;
+    long long delta = 0;
+    unsigned long mask = 0;
+    long n = 0;
+
+    for (int i = 0; i < hdr.nsamples; i++)
+    {
+        if (i > 0)
+        {
+            delta += archive_get_signed(&r, archive_dod_widths, sizeof(archive_dod_widths));
+            ts += delta;
+        }
+        if (archive_get(&r, 1))
+            mask = archive_get(&r, hdr.nfields);
+
+        for (int f = 0; f < hdr.nfields; f++)
+        {
+            if (!(mask & (1UL << f)))
+                continue;
+
+            if (fields[f].kind == SMA_FIELD_DOUBLE && fields[f].scale != 0 && archive_get(&r, 1) == 0)
+            {
+                scaled[f] += archive_get_signed(&r, archive_delta_widths, sizeof(archive_delta_widths));
+                values[f].d = (double)scaled[f] / fields[f].scale;
+                memcpy(&prev[f], &values[f].d, sizeof(double));
+            }
+            else if (fields[f].kind == SMA_FIELD_DOUBLE)
+            {
+                if (archive_get_double(&r, &prev[f], &lead[f], &trail[f]) != 0)
+                    return -1;
+                memcpy(&values[f].d, &prev[f], sizeof(double));
+            }
+            else
+            {
+                prev[f] += archive_get_signed(&r, archive_delta_widths, sizeof(archive_delta_widths));
+                if (fields[f].kind == SMA_FIELD_LONG)
+                    values[f].l = (long)prev[f];
+                else
+                    values[f].u = (unsigned long)prev[f];
+            }
+        }
+
+        if (r.overrun)
+            return -1;
+        if (ts >= from_ms && ts <= to_ms)
+        {
+            visit(ctx, chunk_name, fields, hdr.nfields, ts, values, mask);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Reads the samples of a day file back, in the order they were written.
+ * Corrupt chunks are skipped.
+ * @param path .sma file, its .idx is next to it
+ * @param from_ms First wall clock ms to read
+ * @param to_ms Last wall clock ms to read
+ * @param name Only this inverter, NULL for all
+ * @return number of samples read, -1 when the files can't be read
+ */
+long archive_read(const char *path, long long from_ms, long long to_ms, const char *name, archive_visit visit, void *ctx)
+{
+    size_t len = strlen(path);
+    if (len < 4 || strcmp(path + len - 4, ".sma") != 0 || len >= PATH_MAX)
+    {
+        fprintf(stderr, "archive: %s is no .sma file\n", path);
+        return -1;
+    }
+
+    char index_path[PATH_MAX];
+    memcpy(index_path, path, len - 3);
+    memcpy(index_path + len - 3, "idx", 4);
+
+    int data_fd = open(path, O_RDONLY);
+    int index_fd = open(index_path, O_RDONLY);
+    uint8_t *buf = (uint8_t *)malloc(ARCHIVE_MAX_CHUNK);
+    if (data_fd == -1 || index_fd == -1)
+    {
+        fprintf(stderr, "archive: Can't open %s\n", data_fd == -1 ? path : index_path);
+        if (data_fd >= 0)
+            close(data_fd);
+        if (index_fd >= 0)
+            close(index_fd);
+        free(buf);
+        return -1;
+    }
+
+    long total = 0;
+    archive_index_entry entries[256];
+    ssize_t rb;
+    while ((rb = read(index_fd, entries, sizeof(entries))) >= (ssize_t)sizeof(archive_index_entry))
+    {
+        for (size_t i = 0; i < rb / sizeof(archive_index_entry); i++)
+        {
+            archive_index_entry *e = &entries[i];
+            if (e->last_ms < from_ms || e->first_ms > to_ms)
+                continue;
+
+            long n = -1;
+            if (e->length >= sizeof(archive_chunk_header) && e->length <= ARCHIVE_MAX_CHUNK
+                && pread(data_fd, buf, e->length, e->offset) == (ssize_t)e->length)
+                n = archive_decode(buf, e->length, from_ms, to_ms, name, visit, ctx);
+
+            if (n < 0)
+                fprintf(stderr, "archive: %s: Skipping corrupt chunk at %llu\n", path, (unsigned long long)e->offset);
+            else
+                total += n;
+        }
+    }
+
+    close(data_fd);
+    close(index_fd);
+    free(buf);
+    return total;
+}
@@ -0,0 +1,138 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sma.h"
+#include "sma_map.h"
+
+/**
+ * Local archive of inverter samples, one pair of files per UTC day:
+ * YYYYMMDD.sma holds chunks of samples, YYYYMMDD.idx an entry per chunk.
+ * A chunk covers one inverter for up to ARCHIVE_CHUNK_AGE_MS, compressed like Gorilla:
+ * timestamps as delta of delta and counters as delta. Doubles are decimals
+ * read with a register scale, so they are stored as the delta of value * scale
+ * when that gives them back exactly, else XORed with their previous value.
+ * Fields that weren't read or are NaN are left out.
+ */
+
+#define ARCHIVE_CHUNK_MAGIC 0x43414D53U // "SMAC"
+
+// Bit stream of a chunk, written once full
+#define ARCHIVE_CHUNK_BYTES 4096
+
+// A chunk is written at the latest this long after its first sample, which is also
+// what a crash can lose
+#define ARCHIVE_CHUNK_AGE_MS (10 * 60 * 1000)
+
+#define ARCHIVE_MAX_FIELDS 64
+#define ARCHIVE_MAX_NAME 255
+
+// Largest chunk: header, name, field table and bit stream
+#define ARCHIVE_MAX_CHUNK (32 + ARCHIVE_MAX_NAME + ARCHIVE_MAX_FIELDS * (6 + ARCHIVE_MAX_NAME) + ARCHIVE_CHUNK_BYTES)
+
+#define ARCHIVE_DAY_MS (24 * 60 * 60 * 1000LL)
+
+/**
+ * Start of a chunk in the .sma file, followed by the inverter name,
+ * per field its kind, name length, scale (uint32, 0 when none) and name,
+ * then the bit stream
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t length;    // Bytes after the header
+    uint32_t crc;       // crc32 of those bytes
+    uint16_t nsamples;
+    uint8_t nfields;
+    uint8_t name_len;
+    int64_t first_ms;   // Wall clock ms of the first sample
+    int64_t last_ms;    // And of the last
+} archive_chunk_header;
+
+/**
+ * Entry of the .idx file, one per chunk in the order they were written
+ */
+typedef struct
+{
+    uint64_t offset;    // Of the chunk in the .sma file
+    uint32_t length;    // Of the whole chunk
+    uint32_t nsamples;
+    int64_t first_ms;
+    int64_t last_ms;
+} archive_index_entry;
+
+/**
+ * Chunk in progress of one inverter
+ */
+typedef struct
+{
+    char name[ARCHIVE_MAX_NAME + 1];
+    const sma_register *regs;
+    size_t nregs;
+
+    unsigned int count;         // Samples in the chunk, 0 when none
+    long long first_ms;
+    long long last_ms;
+    long long delta;            // Between the last two timestamps
+    unsigned long mask;         // Fields of the last sample
+    unsigned long long prev[ARCHIVE_MAX_FIELDS]; // Last value per field, doubles as bits
+    long long scaled[ARCHIVE_MAX_FIELDS];        // Last double * scale stored as such
+    unsigned char lead[ARCHIVE_MAX_FIELDS];      // XOR window of doubles, leading zeros
+    unsigned char trail[ARCHIVE_MAX_FIELDS];     // and trailing zeros
+
+    uint8_t bits[ARCHIVE_CHUNK_BYTES];
+    size_t nbits;
+} archive_series;
+
+typedef struct
+{
+    char *dir;
+    int day;                    // Days since the epoch of the open files, -1 when none
+    int data_fd;
+    int index_fd;
+    uint64_t data_size;         // Offset of the next chunk
+
+    archive_series **series;    // By device
+    int nseries;
+
+    uint8_t chunk[ARCHIVE_MAX_CHUNK]; // A chunk being written or read
+} archive_t;
+
+/**
+ * A field of a chunk being read
+ */
+typedef struct
+{
+    char name[ARCHIVE_MAX_NAME + 1];
+    sma_field_kind kind;
+    uint32_t scale;
+} archive_field;
+
+typedef union
+{
+    double d;               // SMA_FIELD_DOUBLE
+    unsigned long u;        // SMA_FIELD_ULONG
+    long l;                 // SMA_FIELD_LONG
+} archive_value;
+
+/**
+ * Called for every sample read back
+ * @param values Per field, valid where mask has its bit
+ */
+typedef void (*archive_visit)(void *ctx, const char *name, const archive_field *fields, int nfields,
+    long long ts_ms, const archive_value *values, unsigned long mask);
+
+/**
+ * Function predefinitions
+ */
+archive_t *archive_open(const char *dir);
+int archive_append(archive_t *ar, int device, const char *name, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms);
+void archive_flush_due(archive_t *ar, long long now_ms);
+void archive_flush(archive_t *ar);
+void archive_close(archive_t *ar);
+long archive_read(const char *path, long long from_ms, long long to_ms, const char *name, archive_visit visit, void *ctx);
+
+#endif
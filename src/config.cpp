@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+
+/**
+ * Strips leading and trailing whitespace in place
+ */
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+        s++;
+
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+/**
+ * Starts a device with the defaults
+ */
+static config_device *config_add(config_t *cfg, const char *name, int interval)
+{
+    if (cfg->ndevices >= CONFIG_MAX_DEVICES)
+        return NULL;
+
+    config_device *dev = &cfg->devices[cfg->ndevices++];
+    memset(dev, 0, sizeof(config_device));
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    dev->port = CONFIG_DEFAULT_PORT;
+    dev->unit = CONFIG_DEFAULT_UNIT;
+    dev->interval = interval;
+    dev->probe = CONFIG_DEFAULT_PROBE;
+    dev->heartbeat = DEADBAND_DEFAULT_HEARTBEAT;
+
+    // Without a deadband every value is written
+    dev->deadband = (deadband_spec *)malloc(sizeof(deadband_spec) * sma_inverter_registers_count);
+    for (size_t r = 0; r < sma_inverter_registers_count; r++)
+        dev->deadband[r].value = -1;
+
+    return dev;
+}
+
+/**
+ * Selects registers of sma_inverter_registers by field name.
+ * The selection keeps the order of the map, so it stays sorted.
+ * @param list Comma separated field names, NULL selects all
+ * @return 0 on success, -1 on an unknown name
+ */
+static int config_registers(config_device *dev, char *list)
+{
+    free(dev->regs);
+    dev->regs = (sma_register *)malloc(sizeof(sma_register) * sma_inverter_registers_count);
+    dev->nregs = 0;
+
+    if (list == NULL)
+    {
+        memcpy(dev->regs, sma_inverter_registers, sizeof(sma_register) * sma_inverter_registers_count);
+        dev->nregs = sma_inverter_registers_count;
+        return 0;
+    }
+
+    unsigned char *selected = (unsigned char *)calloc(sma_inverter_registers_count, 1);
+
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        name = trim(name);
+        size_t r = 0;
+        while (r < sma_inverter_registers_count && strcmp(sma_inverter_registers[r].name, name) != 0)
+            r++;
+        if (r == sma_inverter_registers_count)
+        {
+            fprintf(stderr, "config: %s: unknown register %s\n", dev->name, name);
+            free(selected);
+            return -1;
+        }
+        selected[r] = 1;
+    }
+
+    for (size_t r = 0; r < sma_inverter_registers_count; r++)
+        if (selected[r])
+            dev->regs[dev->nregs++] = sma_inverter_registers[r];
+
+    free(selected);
+    return 0;
+}
+
+/**
+ * Sets the deadband of one field, or of all fields without one
+ * @param name Field name, NULL for all
+ * @return 0 on success, -1 when invalid
+ */
+static int config_deadband(config_device *dev, deadband_spec *all, const char *name, const char *value)
+{
+    deadband_spec spec;
+    if (deadband_parse(value, &spec) != 0)
+    {
+        fprintf(stderr, "config: %s: invalid deadband %s\n", dev->name, value);
+        return -1;
+    }
+
+    if (name == NULL)
+    {
+        *all = spec;
+        return 0;
+    }
+
+    for (size_t r = 0; r < sma_inverter_registers_count; r++)
+    {
+        if (strcmp(sma_inverter_registers[r].name, name) == 0)
+        {
+            dev->deadband[r] = spec;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "config: %s: unknown register %s\n", dev->name, name);
+    return -1;
+}
+
+/**
+ * Reads an INI file with one [section] per inverter:
+ *
+ *   [SB3000TL-21]
+ *   ip = 172.19.30.0
+ *   port = 502
+ *   unit = 3
+ *   pipeline = 4
+ *   interval = 15
+ *   probe = 300
+ *   registers = Condition, DayYield, TotalYield, Pac1
+ *   deadband = 1%
+ *   deadband.Pac1 = 5
+ *   heartbeat = 600
+ *   window = 60
+ *
+ * Everything but ip is optional, registers defaults to all of them.
+ * Sections with the same ip and port are units behind one gateway, polled over one connection.
+ * A deadband is absolute or relative (%) and applies to all fields or one.
+ * Fields without a deadband are written every time.
+ * An inverter that isn't producing is only probed every probe seconds.
+ * With a window, min/max/mean/last over the window are written instead of the samples.
+ * @param path Config file
+ * @param interval Poll interval of devices that don't set one
+ * @return config, NULL when failed
+ */
+config_t *config_load(const char *path, int interval)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "config: Can't open %s\n", path);
+        return NULL;
+    }
+
+    config_t *cfg = (config_t *)calloc(1, sizeof(config_t));
+    cfg->devices = (config_device *)calloc(CONFIG_MAX_DEVICES, sizeof(config_device));
+
+    config_device *dev = NULL;
+    deadband_spec all[CONFIG_MAX_DEVICES];
+    char line[1024];
+    int lineno = 0;
+    int err = 0;
+
+    while (!err && fgets(line, sizeof(line), f) != NULL)
+    {
+        lineno++;
+        char *s = trim(line);
+        if (*s == '\0' || *s == '#' || *s == ';')
+            continue;
+
+        if (*s == '[')
+        {
+            char *end = strchr(s, ']');
+            if (end == NULL)
+            {
+                fprintf(stderr, "config: %s:%d: missing ]\n", path, lineno);
+                err = 1;
+                break;
+            }
+            *end = '\0';
+
+            // The name keys the history, the snapshot and the metrics
+            const char *name = trim(s + 1);
+            for (int d = 0; d < cfg->ndevices; d++)
+            {
+                if (strcmp(cfg->devices[d].name, name) == 0)
+                {
+                    fprintf(stderr, "config: %s:%d: [%s] is there already\n", path, lineno, name);
+                    err = 1;
+                }
+            }
+            if (err)
+                break;
+
+            dev = config_add(cfg, name, interval);
+            if (dev == NULL)
+            {
+                fprintf(stderr, "config: %s:%d: more than %d inverters\n", path, lineno, CONFIG_MAX_DEVICES);
+                err = 1;
+            }
+            else
+            {
+                all[cfg->ndevices - 1].value = -1;
+                err = config_registers(dev, NULL) != 0;
+            }
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if (eq == NULL || dev == NULL)
+        {
+            fprintf(stderr, "config: %s:%d: expected key = value in a [section]\n", path, lineno);
+            err = 1;
+            break;
+        }
+        *eq = '\0';
+        char *key = trim(s);
+        char *value = trim(eq + 1);
+
+        if (strcmp(key, "ip") == 0)
+            snprintf(dev->ip, sizeof(dev->ip), "%s", value);
+        else if (strcmp(key, "port") == 0)
+        {
+            int port = atoi(value);
+            if (port < 1 || port > 65535)
+            {
+                fprintf(stderr, "config: %s:%d: port must be 1 to 65535\n", path, lineno);
+                err = 1;
+            }
+            dev->port = (unsigned short)port;
+        }
+        else if (strcmp(key, "unit") == 0)
+        {
+            // 0 is broadcast, 248 and up are reserved
+            int unit = atoi(value);
+            if (unit < 1 || unit > 247)
+            {
+                fprintf(stderr, "config: %s:%d: unit must be 1 to 247\n", path, lineno);
+                err = 1;
+            }
+            dev->unit = (unsigned char)unit;
+        }
+        else if (strcmp(key, "pipeline") == 0)
+            dev->pipeline = atoi(value);
+        else if (strcmp(key, "interval") == 0)
+            dev->interval = atoi(value);
+        else if (strcmp(key, "probe") == 0)
+            dev->probe = atoi(value);
+        else if (strcmp(key, "registers") == 0)
+            err = config_registers(dev, value);
+        else if (strcmp(key, "deadband") == 0)
+            err = config_deadband(dev, &all[cfg->ndevices - 1], NULL, value);
+        else if (strncmp(key, "deadband.", 9) == 0)
+            err = config_deadband(dev, &all[cfg->ndevices - 1], key + 9, value);
+        else if (strcmp(key, "heartbeat") == 0)
+            dev->heartbeat = atoi(value);
+        else if (strcmp(key, "window") == 0)
+            dev->window = atoi(value);
+        else
+        {
+            fprintf(stderr, "config: %s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+        }
+    }
+    fclose(f);
+
+    for (int i = 0; !err && i < cfg->ndevices; i++)
+    {
+        for (size_t r = 0; r < sma_inverter_registers_count; r++)
+            if (cfg->devices[i].deadband[r].value < 0)
+                cfg->devices[i].deadband[r] = all[i];
+
+        if (cfg->devices[i].ip[0] == '\0' || cfg->devices[i].interval <= 0 || cfg->devices[i].nregs == 0)
+        {
+            fprintf(stderr, "config: %s: %s needs an ip, an interval and registers\n", path, cfg->devices[i].name);
+            err = 1;
+        }
+    }
+
+    if (err)
+    {
+        config_free(cfg);
+        return NULL;
+    }
+
+    return cfg;
+}
+
+/**
+ * The two inverters this collector was written for, used without a config file
+ * @param interval Poll interval
+ */
+config_t *config_default(int interval)
+{
+    config_t *cfg = (config_t *)calloc(1, sizeof(config_t));
+    cfg->devices = (config_device *)calloc(CONFIG_MAX_DEVICES, sizeof(config_device));
+
+    config_device *dev = config_add(cfg, "SB3000TL-21", interval);
+    snprintf(dev->ip, sizeof(dev->ip), "172.19.30.0");
+    config_registers(dev, NULL);
+
+    dev = config_add(cfg, "SB4000TL-21", interval);
+    snprintf(dev->ip, sizeof(dev->ip), "172.19.40.0");
+    config_registers(dev, NULL);
+
+    return cfg;
+}
+
+void config_free(config_t *cfg)
+{
+    if (cfg == NULL)
+        return;
+
+    for (int i = 0; i < cfg->ndevices; i++)
+    {
+        free(cfg->devices[i].regs);
+        free(cfg->devices[i].deadband);
+    }
+    free(cfg->devices);
+    free(cfg);
+}
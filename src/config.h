@@ -0,0 +1,44 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "sma_map.h"
+#include "deadband.h"
+
+#define CONFIG_MAX_DEVICES 256
+#define CONFIG_DEFAULT_PORT 502
+#define CONFIG_DEFAULT_UNIT 3
+#define CONFIG_DEFAULT_PROBE 300
+
+/**
+ * One inverter of the fleet, a [section] of the config file
+ */
+typedef struct
+{
+    char name[64];
+    char ip[64];
+    unsigned short port;
+    unsigned char unit;         // Modbus unit ID
+    int pipeline;               // Requests in flight on the connection, 0 for MODBUS_PIPELINE
+    int interval;               // Seconds between polls
+    int probe;                  // Seconds between probes while idle, 0 always polls at interval
+    sma_register *regs;         // Registers to read, sorted by address
+    size_t nregs;
+    deadband_spec *deadband;    // Per entry of sma_inverter_registers
+    int heartbeat;              // Seconds a field may be left out by its deadband
+    int window;                 // Seconds summarized into one point, 0 writes every sample
+} config_device;
+
+typedef struct
+{
+    config_device *devices;
+    int ndevices;
+} config_t;
+
+/**
+ * Function predefinitions
+ */
+config_t *config_load(const char *path, int interval);
+config_t *config_default(int interval);
+void config_free(config_t *cfg);
+
+#endif
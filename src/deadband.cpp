@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "deadband.h"
+
+/**
+ * Parses a deadband like "5" (absolute) or "2%" (relative)
+ * @return 0 on success, -1 when invalid
+ */
+int deadband_parse(const char *text, deadband_spec *spec)
+{
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return -1;
+
+    spec->relative = *end == '%';
+    if (spec->relative)
+    {
+        value /= 100;
+        end++;
+    }
+    spec->value = value;
+
+    return *end == '\0' ? 0 : -1;
+}
+
+/**
+ * @param regs Registers of the inverter, at most one bit of an unsigned long each
+ * @param spec Deadband per register
+ * @param heartbeat Max number of seconds a field is left out
+ * @return filter, NULL when there are too many registers
+ */
+deadband_t *deadband_create(const sma_register *regs, size_t nregs, const deadband_spec *spec, int heartbeat)
+{
+    if (nregs > sizeof(unsigned long) * 8)
+        return NULL;
+
+    deadband_t *db = (deadband_t *)calloc(1, sizeof(deadband_t));
+    db->regs = regs;
+    db->nregs = nregs;
+    db->spec = (deadband_spec *)malloc(sizeof(deadband_spec) * (nregs ? nregs : 1));
+    db->state = (deadband_state *)calloc(nregs ? nregs : 1, sizeof(deadband_state));
+    db->heartbeat_ms = heartbeat * 1000LL;
+    memcpy(db->spec, spec, sizeof(deadband_spec) * nregs);
+
+    return db;
+}
+
+/**
+ * Picks the fields that changed enough since they were last written,
+ * or that weren't written for a heartbeat
+ * @param now Wall clock ms
+ * @return bit r set for register r
+ */
+unsigned long deadband_filter(const deadband_t *db, const SMA_Inverter *inv, long long now)
+{
+    unsigned long pass = 0;
+
+    for (size_t r = 0; r < db->nregs; r++)
+    {
+        const deadband_spec *spec = &db->spec[r];
+        const deadband_state *st = &db->state[r];
+
+        if (spec->value < 0 || st->written == 0 || now - st->written >= db->heartbeat_ms)
+        {
+            pass |= 1UL << r;
+            continue;
+        }
+
+        double value = sma_field_value(&db->regs[r], inv);
+        double band = spec->relative ? spec->value * fabs(st->last) : spec->value;
+        if (fabs(value - st->last) > band || (band == 0 && value != st->last))
+            pass |= 1UL << r;
+    }
+
+    return pass;
+}
+
+/**
+ * Remembers the fields that were written
+ * @param written Bit r set for register r
+ * @param now Wall clock ms
+ */
+void deadband_commit(deadband_t *db, unsigned long written, const SMA_Inverter *inv, long long now)
+{
+    for (size_t r = 0; r < db->nregs; r++)
+    {
+        if (written & (1UL << r))
+        {
+            db->state[r].last = sma_field_value(&db->regs[r], inv);
+            db->state[r].written = now;
+        }
+    }
+}
+
+void deadband_destroy(deadband_t *db)
+{
+    if (db == NULL)
+        return;
+
+    free(db->spec);
+    free(db->state);
+    free(db);
+}
@@ -0,0 +1,47 @@
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include "sma_map.h"
+
+#define DEADBAND_DEFAULT_HEARTBEAT 600
+
+/**
+ * How much a field has to change before it is written again
+ */
+typedef struct
+{
+    double value;       // Negative writes every value
+    int relative;       // value is a fraction of the value last written
+} deadband_spec;
+
+/**
+ * A field as it was last written
+ */
+typedef struct
+{
+    double last;
+    long long written;  // Wall clock ms, 0 when never written
+} deadband_state;
+
+/**
+ * Change-only filter over the registers of an inverter
+ */
+typedef struct
+{
+    const sma_register *regs;
+    size_t nregs;
+    deadband_spec *spec;        // Per register
+    deadband_state *state;      // Per register
+    long long heartbeat_ms;     // Write a field at least this often
+} deadband_t;
+
+/**
+ * Function predefinitions
+ */
+int deadband_parse(const char *text, deadband_spec *spec);
+deadband_t *deadband_create(const sma_register *regs, size_t nregs, const deadband_spec *spec, int heartbeat);
+unsigned long deadband_filter(const deadband_t *db, const SMA_Inverter *inv, long long now);
+void deadband_commit(deadband_t *db, unsigned long written, const SMA_Inverter *inv, long long now);
+void deadband_destroy(deadband_t *db);
+
+#endif
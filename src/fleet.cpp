@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fleet.h"
+#include "metrics.h"
+#include "sma_decode.h"
+
+/**
+ * Finds an earlier inverter at the same address, like another unit behind a gateway
+ * @param i Index of the inverter
+ * @return inverter whose connection i shares, NULL when i is the first
+ */
+static fleet_device *fleet_gateway(fleet_t *fleet, int i)
+{
+    const config_device *c = fleet->devs[i].cfg;
+    for (int g = 0; g < i; g++)
+    {
+        const config_device *o = fleet->devs[g].cfg;
+        if (o->port == c->port && strcmp(o->ip, c->ip) == 0)
+            return &fleet->devs[g];
+    }
+    return NULL;
+}
+
+/**
+ * Plans the probe of an inverter from the registers it is configured with
+ * @return 0 on success, -1 when it doesn't read all registers of the probe
+ */
+static int fleet_plan_probe(fleet_device *fd, unsigned short max_gap)
+{
+    static const char *const names[FLEET_PROBE_REGS] = {"Condition", "GridRelay", "Pac1"};
+
+    int n = 0;
+    for (size_t r = 0; r < fd->cfg->nregs; r++)
+    {
+        for (int i = 0; i < FLEET_PROBE_REGS; i++)
+        {
+            if (strcmp(fd->cfg->regs[r].name, names[i]) == 0)
+            {
+                fd->probe_regs[n++] = fd->cfg->regs[r];
+                fd->probe_mask |= 1UL << r;
+            }
+        }
+    }
+
+    if (n != FLEET_PROBE_REGS)
+        return -1;
+    return sma_plan_blocks(&fd->probe, fd->probe_regs, n, max_gap) < 0 ? -1 : 0;
+}
+
+/**
+ * Prepares all inverters of a config, the pollers connect to them
+ * @param cfg Config, owned by the fleet from now on
+ * @param max_gap Max number of unused registers read to merge two blocks
+ * @param pipeline Requests in flight per inverter, 0 keeps the default
+ * @param nshards Number of pollers the inverters are spread over
+ * @return fleet, NULL when the config can't be polled
+ */
+fleet_t *fleet_open(config_t *cfg, unsigned short max_gap, int pipeline, int nshards)
+{
+    fleet_t *fleet = (fleet_t *)calloc(1, sizeof(fleet_t));
+    fleet->cfg = cfg;
+    fleet->devs = (fleet_device *)calloc(cfg->ndevices > 0 ? cfg->ndevices : 1, sizeof(fleet_device));
+
+    nshards = nshards < 1 ? 1 : nshards > FLEET_MAX_SHARDS ? FLEET_MAX_SHARDS : nshards;
+    for (int s = 0; s < nshards; s++)
+    {
+        fleet->pollers[s] = poller_create(MODBUS_RETRY_TIMEOUT_MS);
+        if (fleet->pollers[s] == NULL)
+        {
+            fleet_close(fleet);
+            return NULL;
+        }
+        fleet->nshards++;
+    }
+
+    for (int i = 0; i < cfg->ndevices; i++)
+    {
+        config_device *c = &cfg->devices[i];
+        fleet_device *fd = &fleet->devs[i];
+        fleet->ndevs++;
+
+        fd->cfg = c;
+        fd->shard = i % fleet->nshards;
+        fd->inv.Ip = c->ip;
+        fd->inv.Port = c->port;
+        fd->inv.Name = c->name;
+
+        /**
+         * Merge the registers we need into as few Modbus reads as possible
+         */
+        if (sma_plan_blocks(&fd->plan, c->regs, c->nregs, max_gap) < 0)
+        {
+            fprintf(stderr, "fleet: Invalid register map for %s\n", c->name);
+            fleet_close(fleet);
+            return NULL;
+        }
+        for (int b = 0; b < fd->plan.nblocks; b++)
+            printf("fleet: %s: Reading %d registers from %d\n", c->name, fd->plan.blocks[b].qoc, fd->plan.blocks[b].addr);
+
+        deadband_spec spec[FLEET_MAX_REGS];
+        for (size_t r = 0; r < c->nregs && r < FLEET_MAX_REGS; r++)
+        {
+            size_t m = 0;
+            while (sma_inverter_registers[m].addr != c->regs[r].addr)
+                m++;
+            spec[r] = c->deadband[m];
+        }
+        fd->deadband = deadband_create(c->regs, c->nregs, spec, c->heartbeat);
+        if (fd->deadband == NULL)
+        {
+            fprintf(stderr, "fleet: Too many registers for %s\n", c->name);
+            fleet_close(fleet);
+            return NULL;
+        }
+
+        if (c->window > 0)
+            fd->window = window_create(c->regs, c->nregs, c->window);
+
+        if (c->probe > 0 && fleet_plan_probe(fd, max_gap) != 0)
+        {
+            fprintf(stderr, "fleet: %s doesn't read Condition, GridRelay and Pac1, polling every %d s day and night\n", c->name, c->interval);
+            memset(&fd->probe, 0, sizeof(fd->probe));
+        }
+
+        fd->dev.inv = &fd->inv;
+        fd->dev.plan = &fd->plan;
+        fd->dev.unit = c->unit;
+        fd->dev.metrics = metrics_add_device(c->name, &fd->plan);
+
+        /**
+         * Inverters behind the same gateway share its connection and poller,
+         * the smallest pipeline of them limits the requests in flight
+         */
+        int depth = c->pipeline > 0 ? c->pipeline : pipeline;
+        fleet_device *gw = fleet_gateway(fleet, i);
+        if (gw != NULL)
+        {
+            fd->shard = gw->shard;
+            fd->dev.mb = gw->dev.mb;
+            if (depth > 0 && fd->dev.mb != NULL && depth < fd->dev.mb->depth)
+                modbus_set_pipeline(fd->dev.mb, depth);
+        }
+        else
+        {
+            // Connected by the poller, which also reconnects when the inverter goes away
+            fd->dev.mb = modbus_new_tcp(c->ip, c->port);
+            if (fd->dev.mb != NULL && depth > 0)
+                modbus_set_pipeline(fd->dev.mb, depth);
+        }
+
+        if (fd->dev.mb == NULL)
+            fprintf(stderr, "fleet: Can't poll %s at %s:%d\n", c->name, c->ip, c->port);
+
+        poller_add(fleet->pollers[fd->shard], &fd->dev);
+    }
+
+    return fleet;
+}
+
+/**
+ * Seconds until the next poll of an inverter
+ */
+int fleet_interval(const fleet_device *fd)
+{
+    return fd->probing ? fd->cfg->probe : fd->cfg->interval;
+}
+
+/**
+ * Whether an inverter feeds into the grid: its Condition is Ok or Warning,
+ * the grid relay is closed and it produces AC power
+ */
+static int fleet_producing(const SMA_Inverter *inv)
+{
+    int ok = inv->Condition == SMA_CONDITION_OK || inv->Condition == SMA_CONDITION_WARNING;
+    int pac = inv->Pac1 > 0;
+    return ok && inv->GridRelay == SMA_RELAY_CLOSED && pac;
+}
+
+/**
+ * Switches between full polls and probes after a successful poll.
+ * An inverter that hasn't produced for probe seconds is only probed,
+ * it is polled in full again as soon as a probe finds it producing.
+ * @param now Wall clock ms
+ * @return 1 when the inverter switched, 0 otherwise
+ */
+int fleet_adapt(fleet_device *fd, long long now)
+{
+    if (fd->probe.nblocks == 0)
+        return 0;
+
+    if (fleet_producing(&fd->inv))
+    {
+        fd->idle_since = 0;
+        if (!fd->probing)
+            return 0;
+
+        printf("fleet: %s is producing, polling every %d s\n", fd->cfg->name, fd->cfg->interval);
+        fd->probing = 0;
+        fd->dev.plan = &fd->plan;
+    }
+    else
+    {
+        if (fd->idle_since == 0)
+            fd->idle_since = now;
+        if (fd->probing || now - fd->idle_since < fd->cfg->probe * 1000LL)
+            return 0;
+
+        printf("fleet: %s is idle, probing every %d s\n", fd->cfg->name, fd->cfg->probe);
+        fd->probing = 1;
+        fd->dev.plan = &fd->probe;
+    }
+
+    if (fd->dev.metrics)
+        __atomic_store_n(&fd->dev.metrics->probing, fd->probing, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * Disconnects from all inverters and frees the config
+ */
+void fleet_close(fleet_t *fleet)
+{
+    for (int s = 0; s < fleet->nshards; s++)
+        poller_destroy(fleet->pollers[s]);
+
+    for (int i = 0; i < fleet->ndevs; i++)
+    {
+        if (fleet->devs[i].dev.mb != NULL && fleet_gateway(fleet, i) == NULL)
+            modbus_close(fleet->devs[i].dev.mb);
+        deadband_destroy(fleet->devs[i].deadband);
+        window_destroy(fleet->devs[i].window);
+    }
+
+    config_free(fleet->cfg);
+    free(fleet->devs);
+    free(fleet);
+}
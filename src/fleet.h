@@ -0,0 +1,66 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "config.h"
+#include "poller.h"
+#include "deadband.h"
+#include "window.h"
+
+// Registers per inverter, one bit each in the field masks
+#define FLEET_MAX_REGS 64
+
+// Poller threads
+#define FLEET_MAX_SHARDS 64
+
+// Registers read while an inverter is idle: Condition, GridRelay and Pac1
+#define FLEET_PROBE_REGS 3
+
+/**
+ * An inverter of the config with everything needed to poll it
+ */
+typedef struct
+{
+    const config_device *cfg;
+    int shard;                  // Poller the inverter is driven from
+    SMA_Inverter inv;
+    sma_plan plan;
+    poll_device dev;
+
+    /**
+     * Idle inverters are only probed, see fleet_adapt
+     */
+    sma_register probe_regs[FLEET_PROBE_REGS];
+    sma_plan probe;             // No blocks when the inverter is always polled in full
+    unsigned long probe_mask;   // Bit per register of cfg->regs read by the probe
+    int probing;
+    long long idle_since;       // Wall clock ms since the inverter isn't producing, 0 while it is
+
+    deadband_t *deadband;       // Leaves out fields that barely changed
+    window_t *window;           // Summarizes samples, NULL writes every sample
+    unsigned long line_bit[FLEET_MAX_REGS]; // Line protocol field of each register, see main.cpp
+    unsigned long off_bit[FLEET_MAX_REGS];  // Same for while the inverter is off
+    unsigned long fields;       // All line protocol fields read from the inverter
+    unsigned long off_fields;
+} fleet_device;
+
+/**
+ * All inverters of a config, spread over one poller per shard
+ */
+typedef struct
+{
+    config_t *cfg;
+    fleet_device *devs;
+    int ndevs;
+    poller_t *pollers[FLEET_MAX_SHARDS];
+    int nshards;
+} fleet_t;
+
+/**
+ * Function predefinitions
+ */
+fleet_t *fleet_open(config_t *cfg, unsigned short max_gap, int pipeline, int nshards);
+int fleet_interval(const fleet_device *fd);
+int fleet_adapt(fleet_device *fd, long long now);
+void fleet_close(fleet_t *fleet);
+
+#endif
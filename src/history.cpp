@@ -0,0 +1,607 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "history.h"
+#include "lineproto.hpp"
+
+/**
+ * Keeps the last capacity samples of every inverter
+ * @return history, NULL when out of memory
+ */
+history_t *history_create(size_t capacity)
+{
+    history_t *h = (history_t *)calloc(1, sizeof(history_t));
+    if (h == NULL)
+        return NULL;
+
+    h->capacity = capacity > 0 ? capacity : 1;
+    h->nfields = (int)(sma_inverter_registers_count < HISTORY_MAX_FIELDS ? sma_inverter_registers_count : HISTORY_MAX_FIELDS);
+    h->listen_fd = -1;
+    memset(h->field_of, -1, sizeof(h->field_of));
+    for (int f = 0; f < h->nfields; f++)
+        h->field_of[sma_inverter_registers[f].offset] = (signed char)f;
+    pthread_mutex_init(&h->lock, NULL);
+
+    return h;
+}
+
+/**
+ * Ring of an inverter, created on first use. An inverter that was added before,
+ * e.g. before the config was reloaded, keeps its samples.
+ * @return series, -1 when there are too many inverters or out of memory
+ */
+int history_series_of(history_t *h, const char *name)
+{
+    pthread_mutex_lock(&h->lock);
+
+    int i = history_find(h, name);
+    if (i >= 0 || h->nseries == HISTORY_MAX_SERIES)
+    {
+        pthread_mutex_unlock(&h->lock);
+        return i;
+    }
+
+    history_series *s = (history_series *)calloc(1, sizeof(history_series));
+    if (s != NULL)
+    {
+        s->ts = (long long *)malloc(sizeof(long long) * h->capacity);
+        s->values = (double *)malloc(sizeof(double) * h->capacity * h->nfields);
+    }
+    if (s == NULL || s->ts == NULL || s->values == NULL)
+    {
+        fprintf(stderr, "history: Out of memory for %s\n", name);
+        if (s != NULL)
+        {
+            free(s->ts);
+            free(s->values);
+        }
+        free(s);
+        pthread_mutex_unlock(&h->lock);
+        return -1;
+    }
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    pthread_mutex_init(&s->lock, NULL);
+
+    // Queries walk the series without the lock
+    i = h->nseries;
+    h->series[i] = s;
+    __atomic_store_n(&h->nseries, i + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&h->lock);
+    return i;
+}
+
+/**
+ * @return series of an inverter, -1 when it has none
+ */
+int history_find(history_t *h, const char *name)
+{
+    int n = __atomic_load_n(&h->nseries, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++)
+        if (strcmp(h->series[i]->name, name) == 0)
+            return i;
+    return -1;
+}
+
+/**
+ * @return field of a register name, its index in sma_inverter_registers, -1 when unknown
+ */
+int history_field(history_t *h, const char *name)
+{
+    for (int f = 0; f < h->nfields; f++)
+        if (strcmp(sma_inverter_registers[f].name, name) == 0)
+            return f;
+    return -1;
+}
+
+/**
+ * Adds a sample, replacing the oldest once the ring is full
+ * @param series See history_series_of, nothing is kept for -1
+ * @param valid Registers to keep, bit per entry of regs
+ * @param ts_ms Wall clock ms of the sample
+ */
+void history_append(history_t *h, int series, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms)
+{
+    if (series < 0)
+        return;
+    history_series *s = h->series[series];
+
+    pthread_mutex_lock(&s->lock);
+
+    size_t slot = s->head;
+    s->ts[slot] = ts_ms;
+    for (int f = 0; f < h->nfields; f++)
+        s->values[f * h->capacity + slot] = NAN;
+
+    for (size_t r = 0; r < nregs; r++)
+    {
+        int f = h->field_of[regs[r].offset];
+        if (!(valid & (1UL << r)) || f < 0)
+            continue;
+
+        s->values[f * h->capacity + slot] = sma_field_value(&regs[r], inv);
+    }
+
+    s->head = slot + 1 == h->capacity ? 0 : slot + 1;
+    if (s->count < h->capacity)
+        s->count++;
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Slot of the i-th oldest sample
+ */
+static size_t history_slot(const history_t *h, const history_series *s, size_t i)
+{
+    return (s->head + h->capacity - s->count + i) % h->capacity;
+}
+
+/**
+ * First sample at or after ms, samples are in the order they were polled
+ */
+static size_t history_lower(const history_t *h, const history_series *s, long long ms)
+{
+    size_t lo = 0, hi = s->count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (s->ts[history_slot(h, s, mid)] < ms)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Newest sample of an inverter
+ * @param values Per field, NaN where the sample doesn't have it
+ * @return 0, -1 when there is none yet
+ */
+int history_latest(history_t *h, int series, long long *ts_ms, double *values)
+{
+    history_series *s = h->series[series];
+    pthread_mutex_lock(&s->lock);
+
+    if (s->count == 0)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    size_t slot = history_slot(h, s, s->count - 1);
+    *ts_ms = s->ts[slot];
+    for (int f = 0; f < h->nfields; f++)
+        values[f] = s->values[f * h->capacity + slot];
+
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/**
+ * Samples of one field from from_ms to to_ms, oldest first.
+ * Samples without the field are left out.
+ * @param max Room in ts and values
+ * @return number of samples copied
+ */
+size_t history_range(history_t *h, int series, int field, long long from_ms, long long to_ms,
+    long long *ts, double *values, size_t max)
+{
+    history_series *s = h->series[series];
+    const double *column = s->values + field * h->capacity;
+    size_t n = 0;
+
+    pthread_mutex_lock(&s->lock);
+    for (size_t i = history_lower(h, s, from_ms); i < s->count && n < max; i++)
+    {
+        size_t slot = history_slot(h, s, i);
+        if (s->ts[slot] > to_ms)
+            break;
+        if (isnan(column[slot]))
+            continue;
+        ts[n] = s->ts[slot];
+        values[n++] = column[slot];
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+/**
+ * Min, max, mean, first and last of one field from from_ms to to_ms.
+ * The ring is at most two runs of contiguous slots, scanned as such.
+ * @return 0, st->count is 0 without samples
+ */
+int history_aggregate(history_t *h, int series, int field, long long from_ms, long long to_ms, history_stats *st)
+{
+    history_series *s = h->series[series];
+    const double *column = s->values + field * h->capacity;
+
+    memset(st, 0, sizeof(history_stats));
+    st->min = INFINITY;
+    st->max = -INFINITY;
+    double sum = 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    size_t lo = history_lower(h, s, from_ms);
+    size_t hi = to_ms == LLONG_MAX ? s->count : history_lower(h, s, to_ms + 1);
+    while (lo < hi)
+    {
+        size_t start = history_slot(h, s, lo);
+        size_t end = start + (hi - lo) < h->capacity ? start + (hi - lo) : h->capacity;
+
+        for (size_t slot = start; slot < end; slot++)
+        {
+            double v = column[slot];
+            if (isnan(v))
+                continue;
+            if (st->count == 0)
+            {
+                st->first = v;
+                st->first_ms = s->ts[slot];
+            }
+            st->last = v;
+            st->last_ms = s->ts[slot];
+            st->min = v < st->min ? v : st->min;
+            st->max = v > st->max ? v : st->max;
+            sum += v;
+            st->count++;
+        }
+        lo += end - start;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    if (st->count > 0)
+        st->mean = sum / st->count;
+    return 0;
+}
+
+/**
+ * Value of a query parameter, URL decoded
+ * @return 1 when found, 0 when not
+ */
+static int history_param(const char *query, const char *key, char *buf, size_t size)
+{
+    size_t klen = strlen(key);
+    for (const char *p = query; p != NULL && *p != '\0'; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL)
+    {
+        if (strncmp(p, key, klen) != 0 || p[klen] != '=')
+            continue;
+
+        size_t n = 0;
+        for (p += klen + 1; *p != '\0' && *p != '&' && n + 1 < size; n++)
+        {
+            if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2]))
+            {
+                char hex[3] = {p[1], p[2], '\0'};
+                buf[n] = (char)strtol(hex, NULL, 16);
+                p += 3;
+            }
+            else
+            {
+                buf[n] = *p == '+' ? ' ' : *p;
+                p++;
+            }
+        }
+        buf[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+static void appendJson(LineBuffer &out, const char *s)
+{
+    out.append('"');
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            out.append('\\');
+            out.append(*s);
+        }
+        else if ((unsigned char)*s < 0x20)
+        {
+            char esc[8];
+            out.append(esc, snprintf(esc, sizeof(esc), "\\u%04x", *s));
+        }
+        else
+            out.append(*s);
+    }
+    out.append('"');
+}
+
+static void appendKey(LineBuffer &out, const char *key)
+{
+    out.append(',');
+    appendJson(out, key);
+    out.append(':');
+}
+
+/**
+ * Writes a sample as a JSON object, see history_latest
+ */
+static void history_write_sample(history_t *h, int series, long long ts, const double *values, LineBuffer &out)
+{
+    out.append("{\"inverter\":", 12);
+    appendJson(out, h->series[series]->name);
+    appendKey(out, "ts");
+    out.append((unsigned long long)ts);
+    for (int f = 0; f < h->nfields; f++)
+    {
+        if (isnan(values[f]))
+            continue;
+        appendKey(out, sma_inverter_registers[f].name);
+        out.append(values[f]);
+    }
+    out.append('}');
+}
+
+static int history_error(LineBuffer &out, int status, const char *error)
+{
+    out.clear();
+    out.append("{\"error\":", 9);
+    appendJson(out, error);
+    out.append('}');
+    return status;
+}
+
+/**
+ * Answers one request with JSON
+ * @param ts, values Room for a whole ring
+ * @return HTTP status
+ */
+static int history_answer(history_t *h, char *req, LineBuffer &out, long long *ts, double *values)
+{
+    if (strncmp(req, "GET ", 4) != 0)
+        return history_error(out, 405, "only GET");
+
+    char *path = req + 4;
+    char *query = NULL;
+    path[strcspn(path, " \r\n")] = '\0';
+    if ((query = strchr(path, '?')) != NULL)
+        *query++ = '\0';
+
+    char inverter[64], field[64], arg[32];
+    int has_inverter = history_param(query, "inverter", inverter, sizeof(inverter));
+    int has_field = history_param(query, "field", field, sizeof(field));
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long from_ms = history_param(query, "from", arg, sizeof(arg)) ? atoll(arg) : 0;
+    long long to_ms = history_param(query, "to", arg, sizeof(arg)) ? atoll(arg) : LLONG_MAX;
+    if (history_param(query, "last", arg, sizeof(arg)))
+        from_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000 - atoll(arg) * 1000;
+
+    int series = has_inverter ? history_find(h, inverter) : -1;
+    int f = has_field ? history_field(h, field) : -1;
+    long long latest;
+    double sample[HISTORY_MAX_FIELDS];
+
+    if (strcmp(path, "/latest") == 0 && !has_inverter)
+    {
+        // All inverters that have a sample
+        out.append('[');
+        int n = __atomic_load_n(&h->nseries, __ATOMIC_ACQUIRE);
+        for (int i = 0, first = 1; i < n; i++)
+        {
+            if (history_latest(h, i, &latest, sample) != 0)
+                continue;
+            if (!first)
+                out.append(',');
+            first = 0;
+            history_write_sample(h, i, latest, sample, out);
+        }
+        out.append(']');
+        return 200;
+    }
+
+    if (strcmp(path, "/latest") != 0 && strcmp(path, "/range") != 0 && strcmp(path, "/aggregate") != 0)
+        return history_error(out, 404, "use /latest, /range or /aggregate");
+    if (series < 0)
+        return history_error(out, 404, "unknown inverter");
+    if (strcmp(path, "/latest") == 0)
+    {
+        if (history_latest(h, series, &latest, sample) != 0)
+            return history_error(out, 404, "no samples yet");
+        history_write_sample(h, series, latest, sample, out);
+        return 200;
+    }
+    if (f < 0)
+        return history_error(out, 400, "unknown field");
+
+    out.append("{\"inverter\":", 12);
+    appendJson(out, h->series[series]->name);
+    appendKey(out, "field");
+    appendJson(out, sma_inverter_registers[f].name);
+
+    if (strcmp(path, "/range") == 0)
+    {
+        size_t n = history_range(h, series, f, from_ms, to_ms, ts, values, h->capacity);
+        appendKey(out, "ts");
+        out.append('[');
+        for (size_t i = 0; i < n; i++)
+        {
+            if (i > 0)
+                out.append(',');
+            out.append((unsigned long long)ts[i]);
+        }
+        out.append(']');
+        appendKey(out, "values");
+        out.append('[');
+        for (size_t i = 0; i < n; i++)
+        {
+            if (i > 0)
+                out.append(',');
+            out.append(values[i]);
+        }
+        out.append(']');
+    }
+    else
+    {
+        history_stats st;
+        history_aggregate(h, series, f, from_ms, to_ms, &st);
+        appendKey(out, "count");
+        out.append((unsigned long long)st.count);
+        if (st.count > 0)
+        {
+            appendKey(out, "min");
+            out.append(st.min);
+            appendKey(out, "max");
+            out.append(st.max);
+            appendKey(out, "mean");
+            out.append(st.mean);
+            appendKey(out, "first");
+            out.append(st.first);
+            appendKey(out, "last");
+            out.append(st.last);
+            appendKey(out, "first_ts");
+            out.append((unsigned long long)st.first_ms);
+            appendKey(out, "last_ts");
+            out.append((unsigned long long)st.last_ms);
+        }
+    }
+    out.append('}');
+    return 200;
+}
+
+/**
+ * Answers queries, one connection at a time
+ */
+static void *history_serve(void *arg)
+{
+    history_t *h = (history_t *)arg;
+    LineBuffer out(64 * 1024);
+    long long *ts = (long long *)malloc(sizeof(long long) * h->capacity);
+    double *values = (double *)malloc(sizeof(double) * h->capacity);
+
+    for (;;)
+    {
+        int c = accept(h->listen_fd, NULL, NULL);
+        if (c == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // Out of descriptors or memory for now, wait for some to be freed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                usleep(100000);
+                continue;
+            }
+
+            fprintf(stderr, "history: accept failed, no longer answering queries\n");
+            break;
+        }
+
+        // Don't let a silent client hold up the others
+        struct timeval tv = {1, 0};
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char req[2048];
+        ssize_t n = recv(c, req, sizeof(req) - 1, 0);
+        if (n <= 0)
+        {
+            close(c);
+            continue;
+        }
+        req[n] = '\0';
+
+        out.clear();
+        int status = history_answer(h, req, out, ts, values);
+
+        char header[256];
+        int hlen = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+            status, status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" : "Method Not Allowed", (unsigned long)out.length());
+        send(c, header, hlen, MSG_NOSIGNAL);
+        send(c, out.data(), out.length(), MSG_NOSIGNAL);
+        close(c);
+    }
+
+    free(ts);
+    free(values);
+    return NULL;
+}
+
+/**
+ * Serves queries over HTTP on a background thread:
+ * /latest, /range and /aggregate, see README
+ * @param addr TCP port on 127.0.0.1, or path of a Unix socket
+ * @return 0 on success, -1 when failed
+ */
+int history_listen(history_t *h, const char *addr)
+{
+    int s;
+    int rc;
+    if (addr[0] != '\0' && strspn(addr, "0123456789") == strlen(addr))
+    {
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        int flag = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+        struct sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sa.sin_port = htons(atoi(addr));
+        rc = bind(s, (struct sockaddr *)&sa, sizeof(sa));
+    }
+    else
+    {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sa.sun_path))
+        {
+            fprintf(stderr, "history: Socket path %s is too long\n", addr);
+            return -1;
+        }
+        strcpy(sa.sun_path, addr);
+
+        // Left over from the last run
+        unlink(addr);
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        rc = bind(s, (struct sockaddr *)&sa, sizeof(sa));
+    }
+
+    if (rc == -1 || listen(s, 8) == -1)
+    {
+        fprintf(stderr, "history: Can't listen on %s\n", addr);
+        close(s);
+        return -1;
+    }
+    h->listen_fd = s;
+
+    // Signals like SIGHUP are for the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_t thread;
+    rc = pthread_create(&thread, NULL, history_serve, h);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+    {
+        close(s);
+        h->listen_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+
+    printf("history: Serving on %s\n", addr);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "sma.h"
+#include "sma_map.h"
+
+#define HISTORY_MAX_SERIES 256
+#define HISTORY_MAX_FIELDS 64
+#define HISTORY_DEFAULT_CAPACITY 3600
+
+/**
+ * Recent samples of one inverter in a ring of fixed size.
+ * Every field of sma_inverter_registers has its own contiguous array,
+ * so a query over one field only touches its own cache lines.
+ * Fields a sample doesn't have are NaN.
+ */
+typedef struct
+{
+    char name[64];
+    pthread_mutex_t lock;       // Taken by the exporter for every sample and by queries
+    size_t head;                // Slot of the next sample
+    size_t count;               // Samples kept, up to capacity
+    long long *ts;              // Wall clock ms per slot
+    double *values;             // capacity slots per field, field after field
+} history_series;
+
+typedef struct
+{
+    size_t capacity;            // Samples per inverter
+    int nfields;                // The first of sma_inverter_registers
+    signed char field_of[sizeof(SMA_Inverter)]; // Field by offset of its member, -1 when none
+
+    history_series *series[HISTORY_MAX_SERIES];
+    int nseries;                // Series are only added, and kept across reloads
+    pthread_mutex_t lock;       // Adding series
+    int listen_fd;              // Query API, see history_listen
+} history_t;
+
+/**
+ * Summary of a field over a time range
+ */
+typedef struct
+{
+    size_t count;               // Samples that have the field
+    double min;
+    double max;
+    double mean;
+    double first;
+    double last;
+    long long first_ms;
+    long long last_ms;
+} history_stats;
+
+/**
+ * Function predefinitions
+ */
+history_t *history_create(size_t capacity);
+int history_series_of(history_t *h, const char *name);
+int history_find(history_t *h, const char *name);
+int history_field(history_t *h, const char *name);
+void history_append(history_t *h, int series, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms);
+int history_latest(history_t *h, int series, long long *ts_ms, double *values);
+size_t history_range(history_t *h, int series, int field, long long from_ms, long long to_ms,
+    long long *ts, double *values, size_t max);
+int history_aggregate(history_t *h, int series, int field, long long from_ms, long long to_ms, history_stats *st);
+int history_listen(history_t *h, const char *addr);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <map>
 #include <string.h>
 #include <sstream>
@@ -14,12 +15,47 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <netdb.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#include "lineproto.hpp"
 
 class Influx
 {
+public:
+    // Return codes of the write functions
+    static const int ERR_REJECTED = -1;     // Server answered with an error, see status()
+    static const int ERR_CONNECTION = -2;   // Could not reach the server
+
+    /**
+     * Called with the HTTP status of every response, the time since its request was sent
+     * and the size of the request body as sent. status is ERR_CONNECTION when the connection failed.
+     */
+    typedef void (*Observer)(int status, long long us, size_t bytes);
+
 private:
     int sockfd = 0;
     static const unsigned int bufsize = 8196;
+    int timeoutMs_ = 5000;          // Max wait for a response or for room to send, see timeout()
+    static const int connectTimeoutMs = 1000;
+    static const int reconnectDelay = 10;   // Seconds between reconnect attempts
+
+    // HTTP/1.1 keep-alive connection
+    std::string rx_;                // Received bytes not parsed yet
+    unsigned int inflight_ = 0;     // Requests sent without a response yet
+    unsigned int maxInflight_ = 1;  // Pipelining limit
+    int status_ = 0;                // Status of the last response
+    time_t retryAfter_ = 0;         // Don't write before this time (429/503)
+    time_t reconnectAt_ = 0;        // Don't reconnect before this time
+
+    std::deque<std::string> sent_;  // Bodies of the requests in flight
+    std::deque<std::pair<long long, size_t>> sentAt_; // Monotonic us and size of the requests in flight
+    std::deque<std::string> failed_;// Bodies worth retrying later, see takeFailed()
+    Observer observer_ = nullptr;
 
     std::string host_;
     unsigned short port_;
@@ -31,6 +67,366 @@ private:
     std::vector<std::string> fields;
     std::string timestamp_;
 
+    // Lines waiting to be written, see queue()
+    std::string batch_;
+    size_t batchSize_ = 0;      // Flush when the batch grows beyond this many bytes
+    unsigned int batchAge_ = 0; // Flush when the oldest line is this many seconds old
+    time_t batchStart_ = 0;
+    bool gzip_ = false;
+
+    std::string precision_ = "s";   // Of the timestamps in the lines
+
+    /**
+     * Compresses body into a gzip stream
+     * @return 0 on success
+     */
+    static int compress(const std::string &body, std::string &out)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+
+        // 15 window bits + 16 = gzip header instead of zlib
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+
+        out.resize(deflateBound(&zs, body.length()));
+        zs.next_in = (Bytef *)body.data();
+        zs.avail_in = body.length();
+        zs.next_out = (Bytef *)&out[0];
+        zs.avail_out = out.length();
+
+        int rc = deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        return rc == Z_STREAM_END ? 0 : -1;
+    }
+
+    static long long nowUs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    void notify(int status, long long us, size_t bytes)
+    {
+        if (observer_)
+            observer_(status, us, bytes);
+    }
+
+    /**
+     * Reads until rx_ holds at least n bytes
+     * @return 0 on success, 1 when timed out, ERR_CONNECTION when the connection is gone
+     */
+    int fill(size_t n, int timeout)
+    {
+        char buf[bufsize];
+
+        while (rx_.length() < n)
+        {
+            struct pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = POLLIN;
+
+            int rc = poll(&pfd, 1, timeout);
+            if (rc == 0)
+                return 1;
+            if (rc < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return ERR_CONNECTION;
+            }
+
+            ssize_t rb = recv(sockfd, buf, sizeof(buf), 0);
+            if (rb <= 0)
+                return ERR_CONNECTION;
+            rx_.append(buf, rb);
+        }
+
+        return 0;
+    }
+
+    /**
+     * Reads and parses one HTTP response
+     * @param timeout How long to wait in ms, 0 to only parse what is available
+     * @param closing Set when the server will close the connection
+     * @return HTTP status, 0 when timed out or ERR_CONNECTION
+     */
+    int readResponse(int timeout, bool &closing)
+    {
+        size_t end;
+        while ((end = rx_.find("\r\n\r\n")) == std::string::npos)
+        {
+            int rc = fill(rx_.length() + 1, timeout);
+            if (rc != 0)
+                return rc < 0 ? rc : 0;
+        }
+
+        // Status line: HTTP/1.1 204 No Content
+        int status = 0;
+        if (sscanf(rx_.c_str(), "HTTP/%*d.%*d %d", &status) != 1)
+        {
+            fprintf(stderr, "influxdb: Invalid response\n");
+            return ERR_CONNECTION;
+        }
+
+        // Headers we care about
+        long contentLength = 0;
+        bool chunked = false;
+        time_t retryAfter = 0;
+        closing = false;
+
+        size_t pos = rx_.find("\r\n") + 2;
+        while (pos < end)
+        {
+            size_t eol = rx_.find("\r\n", pos);
+            const char *h = rx_.c_str() + pos;
+
+            if (strncasecmp(h, "Content-Length:", 15) == 0)
+                contentLength = atol(h + 15);
+            else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0)
+                chunked = strstr(rx_.substr(pos, eol - pos).c_str(), "chunked") != NULL;
+            else if (strncasecmp(h, "Connection:", 11) == 0)
+                closing = strcasestr(rx_.substr(pos, eol - pos).c_str(), "close") != NULL;
+            else if (strncasecmp(h, "Retry-After:", 12) == 0)
+                retryAfter = time(NULL) + atol(h + 12);
+
+            pos = eol + 2;
+        }
+
+        // Body
+        std::string body;
+        pos = end + 4;
+        if (chunked)
+        {
+            for (;;)
+            {
+                size_t eol;
+                while ((eol = rx_.find("\r\n", pos)) == std::string::npos)
+                    if (fill(rx_.length() + 1, timeoutMs_) != 0)
+                        return ERR_CONNECTION;
+
+                long size = strtol(rx_.c_str() + pos, NULL, 16);
+                pos = eol + 2;
+                if (fill(pos + size + 2, timeoutMs_) != 0)
+                    return ERR_CONNECTION;
+                body.append(rx_, pos, size);
+                pos += size + 2;
+
+                if (size == 0)
+                    break;
+            }
+        }
+        else
+        {
+            if (fill(pos + contentLength, timeoutMs_) != 0)
+                return ERR_CONNECTION;
+            body = rx_.substr(pos, contentLength);
+            pos += contentLength;
+        }
+        rx_.erase(0, pos);
+
+        if (status >= 400)
+        {
+            fprintf(stderr, "influxdb: HTTP %d %s\n", status, body.c_str());
+            // Too Many Requests or Service Unavailable, back off
+            if (status == 429 || status == 503)
+                retryAfter_ = retryAfter ? retryAfter : time(NULL) + 30;
+        }
+
+        return status;
+    }
+
+    /**
+     * Handles responses to earlier requests
+     * @param limit Wait until at most this many requests are in flight
+     * @return 0 when all handled responses were successful, ERR_* otherwise
+     */
+    int drain(unsigned int limit)
+    {
+        int ret = 0;
+
+        while (inflight_ > 0)
+        {
+            bool closing;
+            int status = readResponse(inflight_ > limit ? timeoutMs_ : 0, closing);
+            if (status == 0 && inflight_ <= limit)
+                break;
+            if (status <= 0)
+            {
+                fprintf(stderr, "influxdb: Lost connection, %u requests unanswered\n", inflight_);
+                notify(ERR_CONNECTION, 0, 0);
+                disconnect();
+                return ERR_CONNECTION;
+            }
+
+            inflight_--;
+            status_ = status;
+            notify(status, nowUs() - sentAt_.front().first, sentAt_.front().second);
+            sentAt_.pop_front();
+            if (status >= 300)
+                ret = ERR_REJECTED;
+
+            // Only rejected points are dropped, they would be rejected again. The rest,
+            // e.g. rate limits, server trouble, a revoked token or a missing bucket, may pass later
+            if (status >= 300 && status != 400 && status != 413 && status != 422)
+                failed_.push_back(std::move(sent_.front()));
+            sent_.pop_front();
+
+            if (closing)
+            {
+                if (inflight_ > 0)
+                    fprintf(stderr, "influxdb: Server closed connection, %u requests unanswered\n", inflight_);
+                disconnect();
+                break;
+            }
+        }
+
+        return ret;
+    }
+
+    void disconnect()
+    {
+        close();
+        sockfd = 0;
+        rx_.clear();
+        inflight_ = 0;
+        sentAt_.clear();
+
+        // Unanswered requests may or may not have been written
+        while (!sent_.empty())
+        {
+            failed_.push_back(std::move(sent_.front()));
+            sent_.pop_front();
+        }
+    }
+
+    /**
+     * Whether the server closed the connection while no request was in flight,
+     * e.g. once its keep-alive timeout passed
+     */
+    bool closedByPeer()
+    {
+        struct pollfd pfd;
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) != 1)
+            return false;
+
+        char c;
+        ssize_t rb = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return rb == 0 || (rb < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+    }
+
+    /**
+     * Bounds how long a send may block when the server doesn't read
+     */
+    void applySendTimeout()
+    {
+        struct timeval tv;
+        tv.tv_sec = timeoutMs_ / 1000;
+        tv.tv_usec = timeoutMs_ % 1000 * 1000;
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    /**
+     * Sends all bytes
+     * @return 0 on success, -1 when failed or timed out
+     */
+    int sendAll(const std::string &buffer)
+    {
+        size_t sent = 0;
+        while (sent < buffer.length())
+        {
+            ssize_t rc = send(sockfd, buffer.data() + sent, buffer.length() - sent, MSG_NOSIGNAL);
+            if (rc <= 0)
+            {
+                if (rc < 0 && errno == EINTR)
+                    continue;
+                return -1;
+            }
+            sent += rc;
+        }
+        return 0;
+    }
+
+    /**
+     * Sends a write request on the keep-alive connection.
+     * Responses are read as they arrive, so errors of pipelined requests
+     * are reported by a later call.
+     * @param body One or more lines, separated by newlines
+     * @return 0 on success, ERR_REJECTED or ERR_CONNECTION
+     */
+    int write(const std::string &body)
+    {
+        if (retryAfter_ > time(NULL))
+        {
+            fprintf(stderr, "influxdb: Server asked to retry after %ld s\n", (long)(retryAfter_ - time(NULL)));
+            failed_.push_back(body);
+            return ERR_REJECTED;
+        }
+
+        std::string compressed;
+        const std::string *payload = &body;
+
+        if (gzip_)
+        {
+            if (compress(body, compressed) != 0)
+            {
+                fprintf(stderr, "influxdb: gzip failed\n");
+                return ERR_REJECTED;
+            }
+            payload = &compressed;
+        }
+
+        char header[512];
+        snprintf(header, sizeof(header), "POST /api/v2/write?bucket=%s&org=%s&precision=%s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: influxdb-client-cheader\r\nContent-Length: %d\r\n%sAuthorization: Token %s\r\n\r\n",
+                 bkt_.c_str(), org_.c_str(), precision_.c_str(), host_.c_str(), port_, (int)payload->length(),
+                 gzip_ ? "Content-Encoding: gzip\r\n" : "", tkn_.c_str());
+
+        // Combine header and body
+        std::string buffer = std::string(header) + *payload;
+
+        // Make room in the pipeline
+        int ret = drain(maxInflight_ - 1);
+
+        // A request on a connection the server already closed would be lost
+        if (sockfd > 0 && inflight_ == 0 && closedByPeer())
+            disconnect();
+
+        for (int attempt = 0; attempt < 2; attempt++)
+        {
+            if (sockfd <= 0 && (time(NULL) < reconnectAt_ || connectNow() != 0))
+            {
+                failed_.push_back(body);
+                return ERR_CONNECTION;
+            }
+
+            if (sendAll(buffer) == 0)
+            {
+                inflight_++;
+                sent_.push_back(body);
+                sentAt_.emplace_back(nowUs(), payload->length());
+                break;
+            }
+
+            fprintf(stderr, "influxdb: Lost connection\n");
+            notify(ERR_CONNECTION, 0, 0);
+            disconnect();
+            if (attempt == 1)
+            {
+                failed_.push_back(body);
+                return ERR_CONNECTION;
+            }
+        }
+
+        // Pick up responses that already arrived
+        int rc = drain(maxInflight_ - 1);
+        return ret != 0 ? ret : rc;
+    }
+
 public:
     Influx(const std::string &host, const unsigned short port, const std::string &org, const std::string &bucket, const std::string &token)
     {
@@ -45,7 +441,9 @@ public:
     {
         fprintf(stdout, "influxdb: Connecting to %s:%d with organisation %s and bucket %s .\n",
             host_.c_str(), port_, org_.c_str(), bkt_.c_str());
-        sockfd = sockfd ? sockfd: socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd > 0)
+            disconnect();
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
         if (sockfd <= 0)
         {
             fprintf(stderr, "influxdb: socket failed\n");
@@ -61,6 +459,9 @@ public:
         int status = getaddrinfo(host_.c_str(), NULL, &hints, &res);
         if (status != 0) {
             fprintf(stderr, "influxdb: getaddrinfo error : %s\n", gai_strerror(status));
+            reconnectAt_ = time(NULL) + reconnectDelay;
+            notify(ERR_CONNECTION, 0, 0);
+            disconnect();
             return -2;
         }
 
@@ -71,11 +472,34 @@ public:
 
         freeaddrinfo(res);
 
-        if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        // Don't hang on an unreachable server
+        reconnectAt_ = time(NULL) + reconnectDelay;
+        int flags = fcntl(sockfd, F_GETFL, 0);
+        fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+        int rc = connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+        if (rc < 0 && errno == EINPROGRESS)
+        {
+            struct pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = POLLOUT;
+
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            if (poll(&pfd, 1, connectTimeoutMs) == 1 && getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0)
+                rc = 0;
+        }
+        fcntl(sockfd, F_SETFL, flags);
+        applySendTimeout();
+
+        if (rc < 0)
         {
             std::cerr << "influxdb: connect() failed\n";
+            notify(ERR_CONNECTION, 0, 0);
+            disconnect();
             return -2;
         }
+        reconnectAt_ = 0;
 
         fprintf(stdout, "influxdb: Connected!\n");
 
@@ -88,6 +512,111 @@ public:
             ::close(sockfd);
     }
 
+    /**
+     * Sets the function told about every response, see Observer
+     */
+    void observe(Observer observer)
+    {
+        observer_ = observer;
+    }
+
+    /**
+     * Sets the precision of the timestamps written
+     * @param precision s, ms, us or ns
+     * @return false when unknown
+     */
+    bool precision(const std::string &precision)
+    {
+        if (linePrecisionNs(precision.c_str()) == 0)
+            return false;
+        precision_ = precision;
+        return true;
+    }
+
+    /**
+     * Length of a timestamp unit of the lines written, in ns
+     */
+    long long precisionNs() const
+    {
+        return linePrecisionNs(precision_.c_str());
+    }
+
+    /**
+     * Sets how long a write may wait for a response, or for the server to take
+     * the request. A write at pipeline depth 1 waits for its own response.
+     * @param ms Timeout in ms
+     */
+    void timeout(int ms)
+    {
+        timeoutMs_ = ms > 0 ? ms : 1;
+        if (sockfd > 0)
+            applySendTimeout();
+    }
+
+    /**
+     * Sets how many write requests may wait for their response
+     */
+    void pipeline(unsigned int maxInflight)
+    {
+        maxInflight_ = maxInflight > 0 ? maxInflight : 1;
+    }
+
+    /**
+     * Waits for the responses to all requests in flight
+     * @return 0 when all were successful, ERR_REJECTED or ERR_CONNECTION
+     */
+    int sync()
+    {
+        return drain(0);
+    }
+
+    /**
+     * Takes the body of a write that failed for a reason worth retrying:
+     * connection lost, or any error status but 400, 413 and 422
+     * @return false when there is none
+     */
+    bool takeFailed(std::string &body)
+    {
+        if (failed_.empty())
+            return false;
+        body = std::move(failed_.front());
+        failed_.pop_front();
+        return true;
+    }
+
+    /**
+     * Whether a write would be attempted right now
+     */
+    bool available() const
+    {
+        time_t now = time(NULL);
+        return retryAfter_ <= now && (sockfd > 0 || reconnectAt_ <= now);
+    }
+
+    /**
+     * Writes lines without batching them, e.g. replayed from a spool
+     */
+    int writeLines(const std::string &lines)
+    {
+        return write(lines);
+    }
+
+    /**
+     * HTTP status of the last response
+     */
+    int status() const
+    {
+        return status_;
+    }
+
+    /**
+     * Time before which the server asked not to write (429/503 Retry-After), 0 if none
+     */
+    time_t retryAfter() const
+    {
+        return retryAfter_ > time(NULL) ? retryAfter_ : 0;
+    }
+
     Influx &meas(const std::string name)
     {
         lines_ << name;
@@ -109,6 +638,11 @@ public:
         fields.push_back(fieldKey + "=" + std::to_string(fieldValue) + "i");
         return *this;
     }
+    Influx &field(const std::string fieldKey, const long fieldValue)
+    {
+        fields.push_back(fieldKey + "=" + std::to_string(fieldValue) + "i");
+        return *this;
+    }
     Influx &field(const std::string fieldKey, const double fieldValue)
     {
         fields.push_back(fieldKey + "=" + std::to_string(fieldValue));
@@ -126,7 +660,10 @@ public:
         fields.clear();
     }
 
-    int post()
+    /**
+     * Builds the line of the current point
+     */
+    std::string line()
     {
         std::string body = lines_.str();
         // Construct fields section
@@ -139,34 +676,78 @@ public:
             }
         }
         body += " " + timestamp_;
+        return body;
+    }
 
-        char header[512];
-        std::string buffer;
+    /**
+     * Writes the current point right away
+     */
+    int post()
+    {
+        return write(line());
+    }
 
-        ssize_t len = sprintf(header, "POST /api/v2/write?bucket=%s&org=%s&precision=s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: influxdb-client-cheader\r\nContent-Length: %d\r\nAuthorization: Token %s\r\n\r\n",
-                              bkt_.c_str(), org_.c_str(), host_.c_str(), port_, (int)body.length(), tkn_.c_str());
+    /**
+     * Configures batching of queue()d points
+     * @param maxBytes Flush as soon as the batch reaches this many bytes
+     * @param maxAge Flush when the oldest point is this many seconds old, 0 to flush on every flushIfDue()
+     * @param gzip Compress request bodies with Content-Encoding: gzip
+     */
+    void batch(size_t maxBytes, unsigned int maxAge, bool gzip)
+    {
+        batchSize_ = maxBytes;
+        batchAge_ = maxAge;
+        gzip_ = gzip;
+    }
 
-        // Combine header and body
-        buffer = std::string(header) + body;
-        size_t buffer_len = buffer.length();
+    /**
+     * Adds the current point to the batch, flushes when the batch is full
+     */
+    int queue()
+    {
+        std::string l = line();
+        clear();
+        return queueLine(l.data(), l.length());
+    }
 
-        int rc = write(sockfd, buffer.c_str(), buffer_len);
-        if (rc < len)
-        {
-            // TODO Do this properly :)
-            fprintf(stderr, "influxdb: Could not POST!\n");
-            if (rc == 0)
-            {
-                fprintf(stderr, "influxdb: Lost connection\n");
-                // Disconnected
-                this->connectNow();
-            }
-            else
-                return -1;
-        }
+    /**
+     * Adds a line serialized elsewhere (see lineproto.hpp) to the batch
+     */
+    int queueLine(const char *line, size_t len)
+    {
+        if (batch_.empty())
+            batchStart_ = time(NULL);
+        else
+            batch_ += '\n';
+        batch_.append(line, len);
 
+        if (batch_.length() >= batchSize_)
+            return flush();
         return 0;
     }
+
+    /**
+     * Flushes the batch when the oldest point reached the max age
+     */
+    int flushIfDue()
+    {
+        if (batch_.empty() || time(NULL) - batchStart_ < (time_t)batchAge_)
+            return 0;
+        return flush();
+    }
+
+    /**
+     * Writes all queued points in one request
+     */
+    int flush()
+    {
+        if (batch_.empty())
+            return 0;
+
+        int rc = write(batch_);
+        batch_.clear();
+        return rc;
+    }
 };
 
 #endif
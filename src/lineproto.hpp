@@ -0,0 +1,213 @@
+#ifndef __lineproto_h_
+#define __lineproto_h_
+
+#include <charconv>
+#include <string.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Growable byte buffer for line protocol.
+ * Reuse it between points, once it is big enough it no longer allocates.
+ */
+class LineBuffer
+{
+private:
+    std::vector<char> buf_;
+    size_t len_ = 0;
+
+    char *reserve(size_t n)
+    {
+        if (len_ + n > buf_.size())
+            buf_.resize((len_ + n) * 2);
+        return buf_.data() + len_;
+    }
+
+public:
+    explicit LineBuffer(size_t capacity = 1024) : buf_(capacity) {}
+
+    void clear() { len_ = 0; }
+    const char *data() const { return buf_.data(); }
+    size_t length() const { return len_; }
+
+    void append(char c)
+    {
+        *reserve(1) = c;
+        len_++;
+    }
+    void append(const char *s, size_t n)
+    {
+        memcpy(reserve(n), s, n);
+        len_ += n;
+    }
+    void append(unsigned long long v)
+    {
+        char *p = reserve(20);
+        len_ = std::to_chars(p, p + 20, v).ptr - buf_.data();
+    }
+    void append(long long v)
+    {
+        char *p = reserve(20);
+        len_ = std::to_chars(p, p + 20, v).ptr - buf_.data();
+    }
+    void append(double v)
+    {
+        // Shortest representation that reads back as the same double
+        char *p = reserve(32);
+        len_ = std::to_chars(p, p + 32, v).ptr - buf_.data();
+    }
+
+    /**
+     * Appends a tag value, escaping commas, equals signs and spaces
+     */
+    void appendTag(const char *s)
+    {
+        for (; *s; s++)
+        {
+            if (*s == ',' || *s == '=' || *s == ' ')
+                append('\\');
+            append(*s);
+        }
+    }
+};
+
+/**
+ * Keys are compile-time constants, make sure they never need escaping
+ */
+constexpr bool lineKeyValid(const char *key)
+{
+    for (; *key; key++)
+        if (*key == ',' || *key == '=' || *key == ' ' || *key == '"' || *key == '\\')
+            return false;
+    return true;
+}
+
+/**
+ * Length of a timestamp unit, as in the precision parameter of a write
+ * @param precision s, ms, us or ns
+ * @return ns, 0 when unknown
+ */
+inline long long linePrecisionNs(const char *precision)
+{
+    return strcmp(precision, "s") == 0 ? 1000000000
+        : strcmp(precision, "ms") == 0 ? 1000000
+        : strcmp(precision, "us") == 0 ? 1000
+        : strcmp(precision, "ns") == 0 ? 1 : 0;
+}
+
+/**
+ * Field of a point, read from a member of T
+ */
+template <typename T, typename V>
+struct LineField
+{
+    const char *key;
+    size_t len;
+    V T::*member;
+};
+
+template <typename T, typename V, size_t N>
+constexpr LineField<T, V> lineField(const char (&key)[N], V T::*member)
+{
+    return lineKeyValid(key) ? LineField<T, V>{key, N - 1, member} : throw "line protocol key needs escaping";
+}
+
+/**
+ * Measurement, one tag and a fixed set of fields.
+ * Declare it constexpr so invalid keys fail to compile.
+ */
+template <typename T, typename... Fields>
+class LineSchema
+{
+private:
+    const char *measurement_;
+    size_t measurementLen_;
+    const char *tag_;
+    size_t tagLen_;
+    std::tuple<Fields...> fields_;
+
+    static void value(LineBuffer &buf, unsigned long v)
+    {
+        buf.append((unsigned long long)v);
+        buf.append('i');
+    }
+    static void value(LineBuffer &buf, long v)
+    {
+        buf.append((long long)v);
+        buf.append('i');
+    }
+    static void value(LineBuffer &buf, double v)
+    {
+        buf.append(v);
+    }
+
+    template <typename F>
+    static void field(LineBuffer &buf, const T &obj, const F &f, bool &first)
+    {
+        if (!first)
+            buf.append(',');
+        first = false;
+        buf.append(f.key, f.len);
+        buf.append('=');
+        value(buf, obj.*(f.member));
+    }
+
+    template <size_t... I>
+    void fields(LineBuffer &buf, const T &obj, unsigned long mask, bool &first, std::index_sequence<I...>) const
+    {
+        ((mask & (1UL << I) ? field(buf, obj, std::get<I>(fields_), first) : void()), ...);
+    }
+
+public:
+    static_assert(sizeof...(Fields) <= sizeof(unsigned long) * 8, "too many fields for the mask");
+
+    constexpr LineSchema(const char *measurement, size_t measurementLen, const char *tag, size_t tagLen, Fields... fields)
+        : measurement_(measurement), measurementLen_(measurementLen), tag_(tag), tagLen_(tagLen), fields_(fields...) {}
+
+    /**
+     * Appends one line, without trailing newline
+     * @param tagValue Value of the tag, escaped as needed
+     * @param timestamp Timestamp in the precision the points are written with
+     * @param mask Fields to write, see mask(). Needs at least one.
+     */
+    void write(LineBuffer &buf, const T &obj, const char *tagValue, unsigned long long timestamp, unsigned long mask = ~0UL) const
+    {
+        buf.append(measurement_, measurementLen_);
+        buf.append(',');
+        buf.append(tag_, tagLen_);
+        buf.append('=');
+        buf.appendTag(tagValue);
+        buf.append(' ');
+
+        bool first = true;
+        fields(buf, obj, mask, first, std::index_sequence_for<Fields...>());
+
+        buf.append(' ');
+        buf.append(timestamp);
+    }
+
+    /**
+     * Selects fields by key, for write()
+     * @param selected Returns true for keys to write
+     * @return bit i set for the i-th field
+     */
+    template <typename Pred>
+    unsigned long mask(Pred selected) const
+    {
+        unsigned long m = 0;
+        size_t i = 0;
+        std::apply([&](const auto &...f) { ((m |= selected(f.key) ? 1UL << i : 0, i++), ...); }, fields_);
+        return m;
+    }
+};
+
+template <typename T, size_t N, size_t M, typename... Fields>
+constexpr LineSchema<T, Fields...> lineSchema(const char (&measurement)[N], const char (&tag)[M], Fields... fields)
+{
+    return lineKeyValid(measurement) && lineKeyValid(tag)
+               ? LineSchema<T, Fields...>(measurement, N - 1, tag, M - 1, fields...)
+               : throw "line protocol key needs escaping";
+}
+
+#endif
@@ -8,181 +8,726 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "modbus.h"
 #include "sma.h"
+#include "sma_map.h"
+#include "poller.h"
+#include "alloc_stats.h"
+#include "spool.h"
+#include "metrics.h"
+#include "config.h"
+#include "fleet.h"
+#include "scheduler.h"
+#include "deadband.h"
+#include "window.h"
+#include "ring.h"
+#include "archive.h"
+#include "history.h"
+#include "snapshot.h"
 #include "influx.hpp"
+#include "lineproto.hpp"
 
-int processInverter(SMA_Inverter *pinv, modbus_t *t);
-int exportToInflux(Influx &ifx, SMA_Inverter *pinv, unsigned long currentTimestamp);
+int exportToInflux(Influx &ifx, fleet_device *fd, const SMA_Inverter *inv, unsigned long regs, unsigned long long timestamp, long long now);
 void printInverter(SMA_Inverter *pinv);
+void spoolFailed(Influx &ifx, spool_t *spool);
+void replaySpool(Influx &ifx, spool_t *spool, size_t budget);
 
 /**
- * Requests everything needed from an inverter and pushes to influxDB
- * @param SMA_Inverter Inverter struct with IP already filled in
+ * Line protocol of an inverter, fixed at compile time
  */
-int processInverter(SMA_Inverter *inv, modbus_t *t)
+static constexpr auto inverterLine = lineSchema<SMA_Inverter>("measurement", "inverter",
+    lineField("Condition", &SMA_Inverter::Condition),
+
+    lineField("Temperature", &SMA_Inverter::Temperature),
+    // lineField("Heatsink", &SMA_Inverter::HeatsinkTemperature),
+    lineField("DayYield", &SMA_Inverter::DayYield),
+    lineField("TotalYield", &SMA_Inverter::TotalYield),
+
+    lineField("Pac1", &SMA_Inverter::Pac1),
+    lineField("Pdc1", &SMA_Inverter::Pdc1),
+    lineField("Pdc2", &SMA_Inverter::Pdc2),
+
+    lineField("Uac1", &SMA_Inverter::Uac1),
+    lineField("Udc1", &SMA_Inverter::Udc1),
+    lineField("Udc2", &SMA_Inverter::Udc2),
+
+    lineField("Iac1", &SMA_Inverter::Iac1),
+    lineField("Idc1", &SMA_Inverter::Idc1),
+    lineField("Idc2", &SMA_Inverter::Idc2),
+
+    lineField("GridRelay", &SMA_Inverter::GridRelay),
+    lineField("GridFreq", &SMA_Inverter::GridFreq),
+    lineField("ReactivePower", &SMA_Inverter::ReactivePower),
+    lineField("ApparentPower", &SMA_Inverter::ApparentPower));
+
+/**
+ * Fields that still make sense while the inverter is off
+ */
+static constexpr auto inverterOffLine = lineSchema<SMA_Inverter>("measurement", "inverter",
+    lineField("Condition", &SMA_Inverter::Condition),
+
+    // lineField("Heatsink", &SMA_Inverter::HeatsinkTemperature),
+    lineField("DayYield", &SMA_Inverter::DayYield),
+    lineField("TotalYield", &SMA_Inverter::TotalYield),
+
+    lineField("GridRelay", &SMA_Inverter::GridRelay),
+    lineField("GridFreq", &SMA_Inverter::GridFreq));
+
+int exportToInflux(Influx &ifx, fleet_device *fd, const SMA_Inverter *inv, unsigned long regs, unsigned long long timestamp, long long now)
 {
-    if (t == NULL) {
-        return -1;
-    }
+    static LineBuffer line;
+    line.clear();
 
-    modbus_regs regs;
+    // Fields that were read and aren't NaN, of those the ones whose deadband lets them through
+    unsigned long read = regs & sma_valid_fields(fd->cfg->regs, fd->cfg->nregs, inv);
+    unsigned long pass = deadband_filter(fd->deadband, inv, now) & read;
+    // The inverter doesn't know its temperature while it is off
+    bool off = isnan(inv->Temperature);
+    const unsigned long *bit = off ? fd->off_bit : fd->line_bit;
 
-    t->slave = 0x03; // 0 = broadcast, 3= my inverters
+    unsigned long mask = 0;
+    unsigned long written = 0;
+    for (size_t r = 0; r < fd->deadband->nregs; r++)
+    {
+        if ((pass & (1UL << r)) && bit[r])
+        {
+            mask |= bit[r];
+            written |= 1UL << r;
+        }
+    }
 
-    /**
-     * Inverter Condition
-     * 	35: Fault (Alm)
-     *  303: Off (Off)
-     *  307: Ok (Ok)
-     *  455: Warning (Wrn)
-     * */
-    regs = modbus_read_registers(t, 30201, 4);
-    if (regs == NULL)
+    if (fd->dev.metrics)
     {
-        return -1;
+        unsigned long fields = 0;
+        for (size_t r = 0; r < fd->deadband->nregs; r++)
+            if (read & (1UL << r))
+                fields |= bit[r];
+        metrics_inc(&fd->dev.metrics->fields_written, __builtin_popcountl(mask));
+        metrics_inc(&fd->dev.metrics->fields_suppressed, __builtin_popcountl(fields & ~mask));
     }
+    if (mask == 0)
+        return 0;
+    deadband_commit(fd->deadband, written, inv, now);
 
-    inv->Condition = getValue(regs, 30201, 30201);
+    if (off)
+        inverterOffLine.write(line, *inv, inv->Name, timestamp, mask);
+    else
+        inverterLine.write(line, *inv, inv->Name, timestamp, mask);
 
-    modbus_free_registers(regs);
+    return ifx.queueLine(line.data(), line.length());
+}
 
-    /**
-     * Grid Relay
-     * 	51: Closed (Cls)
-     *  311: Open (Opn)
-     *  16777213: Information not available (NaNStt)
-     */
-    regs = modbus_read_registers(t, 30211, 16);
-    if (regs == NULL)
+/**
+ * Writes the summary of a window and starts the next one
+ * @param precision_ns Length of a timestamp unit in ns
+ */
+static int exportWindow(Influx &ifx, fleet_device *fd, long long precision_ns)
+{
+    static LineBuffer line;
+    line.clear();
+
+    window_write(fd->window, line, "measurement", "inverter", fd->inv.Name, precision_ns);
+    window_reset(fd->window);
+
+    return ifx.queueLine(line.data(), line.length());
+}
+
+/**
+ * Writes the windows in progress as they are, when stopping
+ */
+static void exportWindows(Influx &ifx, fleet_t *fleet, long long precision_ns)
+{
+    for (int f = 0; f < fleet->ndevs; f++)
     {
-        return -1;
+        if (fleet->devs[f].window != NULL && fleet->devs[f].window->start != 0)
+            exportWindow(ifx, &fleet->devs[f], precision_ns);
     }
-    inv->GridRelay = getValue(regs, 30211, 30217);
+}
 
-    modbus_free_registers(regs);
+/**
+ * Swaps the windows of inverters with the same name, registers and window length,
+ * so a window in progress goes on in the fleet of a reload instead of starting
+ * again at the same time, which would overwrite its summary.
+ */
+static void swapWindows(fleet_t *from, fleet_t *to)
+{
+    for (int t = 0; t < to->ndevs; t++)
+    {
+        fleet_device *b = &to->devs[t];
+        for (int f = 0; b->window != NULL && f < from->ndevs; f++)
+        {
+            fleet_device *a = &from->devs[f];
+            if (a->window == NULL || strcmp(a->cfg->name, b->cfg->name) != 0
+                || a->window->period_ms != b->window->period_ms || a->cfg->nregs != b->cfg->nregs)
+                continue;
 
-    /** 
-     * Total Yield and Day Yield 
-     */
-    regs = modbus_read_registers(t, 30529, 54);
-    if (regs == NULL)
+            size_t r = 0;
+            while (r < a->cfg->nregs && a->cfg->regs[r].addr == b->cfg->regs[r].addr)
+                r++;
+            if (r < a->cfg->nregs)
+                continue;
+
+            window_t *w = a->window;
+            a->window = b->window;
+            b->window = w;
+            a->window->regs = a->cfg->regs;
+            b->window->regs = b->cfg->regs;
+            break;
+        }
+    }
+}
+
+/**
+ * Adds a sample to the window of an inverter, writes the window once it is over
+ * @param regs Registers read, bit per entry of cfg->regs
+ * @param now Wall clock ms of the sample
+ */
+static void aggregate(Influx &ifx, fleet_device *fd, const SMA_Inverter *inv, unsigned long regs, long long now, long long precision_ns)
+{
+    if (window_expired(fd->window, now))
+        exportWindow(ifx, fd, precision_ns);
+
+    // Same fields as a single sample would have
+    const unsigned long *bit = isnan(inv->Temperature) ? fd->off_bit : fd->line_bit;
+    unsigned long read = regs & sma_valid_fields(fd->cfg->regs, fd->cfg->nregs, inv);
+    unsigned long valid = 0;
+    for (size_t r = 0; r < fd->cfg->nregs; r++)
+        if (bit[r] && (read & (1UL << r)))
+            valid |= 1UL << r;
+
+    window_add(fd->window, inv, valid, now);
+}
+
+/**
+ * Opens the inverters of a config and works out which fields they deliver
+ */
+static fleet_t *openFleet(config_t *cfg, unsigned short max_gap, int pipeline, int nshards)
+{
+    fleet_t *fleet = fleet_open(cfg, max_gap, pipeline, nshards);
+    if (fleet == NULL)
+        return NULL;
+
+    for (int i = 0; i < fleet->ndevs; i++)
     {
-        return -1;
+        fleet_device *fd = &fleet->devs[i];
+        for (size_t r = 0; r < fd->cfg->nregs; r++)
+        {
+            const char *name = fd->cfg->regs[r].name;
+            auto is = [name](const char *key) { return strcmp(key, name) == 0; };
+            fd->line_bit[r] = inverterLine.mask(is);
+            fd->off_bit[r] = inverterOffLine.mask(is);
+            fd->fields |= fd->line_bit[r];
+            fd->off_fields |= fd->off_bit[r];
+        }
     }
 
-    inv->TotalYield = getValue(regs, 30529, 30529);
-    inv->DayYield = getValue(regs, 30529, 30535);
+    return fleet;
+}
 
-    modbus_free_registers(regs);
+static long long wallClockMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    /**
-     * DC AMP, VOLT, WATT A; AC Watt, L1-3, ACVOLTAGE L1-3
-     * Grid freq, AC_R_POWER_L1-3, AC_A_POWER_L!-3
-     */
-    regs = modbus_read_registers(t, 30769, 52);
-    if (regs == NULL)
+/**
+ * Polls are aligned to the wall clock: every 15 s is at :00, :15, :30 and :45
+ * @return first multiple of interval seconds after now
+ */
+static long long nextBoundary(long long now, int interval)
+{
+    long long period = interval * 1000LL;
+    return (now / period + 1) * period;
+}
+
+/**
+ * Every inverter of a shard is due at the next boundary of its interval
+ */
+static scheduler_t *scheduleShard(fleet_t *fleet, int shard)
+{
+    scheduler_t *sched = scheduler_create(fleet->ndevs);
+    long long now = wallClockMs();
+
+    for (int i = 0; i < fleet->ndevs; i++)
+        if (fleet->devs[i].shard == shard)
+            scheduler_push(sched, nextBoundary(now, fleet_interval(&fleet->devs[i])), i);
+
+    return sched;
+}
+
+/**
+ * A completed poll, handed from a poller thread to the exporter
+ */
+typedef struct
+{
+    int device;                 // Index in fleet->devs
+    long long timestamp;        // Wall clock ns at which the inverter replied
+    unsigned long regs;         // Registers read, bit per entry of cfg->regs
+    SMA_Inverter inv;
+} inverter_sample;
+
+/**
+ * Poller threads, one per shard of the fleet, and the exporter thread.
+ * Polling never waits for InfluxDB: samples go through one ring per shard.
+ */
+typedef struct pipeline_t pipeline_t;
+
+typedef struct
+{
+    pipeline_t *pl;
+    int shard;
+    ring_t *ring;               // Samples of this shard, to the exporter
+    pthread_t thread;
+} shard_t;
+
+struct pipeline_t
+{
+    fleet_t *fleet;
+    shard_t shards[FLEET_MAX_SHARDS];
+    pthread_t exporter;
+    int wake;                   // eventfd the exporter sleeps on
+
+    // Stopping, see stopPipeline()
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stopPolling;
+    int stopExporting;
+
+    // Settings
+    int debug;
+    size_t queueSize;
+    int queuePolicy;
+    long long precision_ns;
+    Influx *ifx;                // NULL without INFLUX_HOST
+    archive_t *archive;         // NULL when not archiving
+    history_t *history;         // NULL when not keeping recent samples
+    snapshot_t *snapshot;       // NULL when not publishing the newest samples
+    spool_t *spool;
+    size_t replayRate;
+};
+
+/**
+ * Sleeps until the wall clock reaches due, or until the pipeline stops
+ * @param due Wall clock ms
+ */
+static void sleepUntil(pipeline_t *pl, long long due)
+{
+    // Sleeping until an absolute time doesn't drift by the time spent polling
+    struct timespec ts = {(time_t)(due / 1000), (long)(due % 1000) * 1000000};
+
+    pthread_mutex_lock(&pl->lock);
+    if (!pl->stopPolling)
+        pthread_cond_timedwait(&pl->cond, &pl->lock, &ts);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/**
+ * Polls the inverters of one shard when they are due and hands the samples to the exporter
+ */
+static void *pollShard(void *arg)
+{
+    shard_t *sh = (shard_t *)arg;
+    pipeline_t *pl = sh->pl;
+    fleet_t *fleet = pl->fleet;
+
+    scheduler_t *sched = scheduleShard(fleet, sh->shard);
+    poll_device **due = (poll_device **)calloc(fleet->ndevs + 1, sizeof(poll_device *));
+    int *dueIds = (int *)calloc(fleet->ndevs + 1, sizeof(int));
+    long long *dueAt = (long long *)calloc(fleet->ndevs + 1, sizeof(long long));
+    inverter_sample sample;
+
+    while (!__atomic_load_n(&pl->stopPolling, __ATOMIC_ACQUIRE))
     {
-        return -1;
+        /**
+         * Sleep until the next inverter is due
+         */
+        long long now = wallClockMs();
+        const sched_item *next = scheduler_peek(sched);
+        if (next == NULL || next->due > now)
+        {
+            sleepUntil(pl, next ? next->due : now + 60000);
+            continue;
+        }
+
+        /**
+         * Everything that is due is polled concurrently
+         */
+        int ndue = 0;
+        int shortest = 0;
+        sched_item item;
+        while ((next = scheduler_peek(sched)) != NULL && next->due <= now)
+        {
+            scheduler_pop(sched, &item);
+            fleet_device *fd = &fleet->devs[item.id];
+            dueIds[ndue] = item.id;
+            dueAt[ndue] = item.due;
+            due[ndue++] = &fd->dev;
+            if (shortest == 0 || fleet_interval(fd) < shortest)
+                shortest = fleet_interval(fd);
+        }
+
+        long long cycleStart = metrics_now_us();
+
+        unsigned long allocations = alloc_stats_count();
+        poller_run(fleet->pollers[sh->shard], due, ndue);
+        allocations = alloc_stats_count() - allocations;
+
+        if (pl->debug){
+            // Shards print at the same time, keep each inverter together
+            flockfile(stdout);
+            for (int d = 0; d < ndue; d++)
+                printInverter(due[d]->inv);
+#ifdef ALLOC_STATS
+            printf("main: %lu heap allocations while polling\n", allocations);
+#endif
+            funlockfile(stdout);
+        }
+
+        /**
+         * Hand the samples to the exporter, stamped with the time the inverter replied,
+         * and schedule the next poll: at the interval, or the probe interval while idle
+         */
+        int pushed = 0;
+        now = wallClockMs();
+        for (int d = 0; d < ndue; d++)
+        {
+            fleet_device *fd = &fleet->devs[dueIds[d]];
+            int adapted = 0;
+
+            if (due[d]->state == POLL_DONE)
+            {
+                sample.device = dueIds[d];
+                sample.timestamp = due[d]->timestamp;
+                sample.regs = fd->probing ? fd->probe_mask : ~0UL;
+                sample.inv = *due[d]->inv;
+
+                int rc = ring_push(sh->ring, &sample);
+                if (rc != 0)
+                    metrics_inc(&metrics.queue_dropped[sh->shard], 1);
+                if (rc >= 0)
+                    pushed++;
+
+                adapted = fleet_adapt(fd, now);
+            }
+
+            // Don't try to catch up on missed polls
+            int interval = fleet_interval(fd);
+            long long again = dueAt[d] + interval * 1000LL;
+            scheduler_push(sched, !adapted && again > now ? again : nextBoundary(now, interval), dueIds[d]);
+        }
+        __atomic_store_n(&metrics.queue_depth[sh->shard], ring_depth(sh->ring), __ATOMIC_RELAXED);
+
+        if (pushed > 0)
+        {
+            uint64_t one = 1;
+            if (write(pl->wake, &one, sizeof(one)) != sizeof(one))
+                fprintf(stderr, "main: Can't wake the exporter\n");
+        }
+
+        long long cycleTime = metrics_now_us() - cycleStart;
+        metrics_observe(&metrics.cycle, cycleTime);
+        if (cycleTime > shortest * 1000000LL)
+            metrics_inc(&metrics.overruns, 1);
+
+        printf("%u OK\n", (unsigned)time(NULL));
     }
-    inv->Udc1 = ((double)getValue(regs, 30769, 30771) / 100);
-    inv->Idc1 = ((double)getValue(regs, 30769, 30769) / 1000);
-    inv->Pdc1 = getValue(regs, 30769, 30773);
 
-    inv->Uac1 = ((double)getValue(regs, 30769, 30783) / 100);
-    inv->Pac1 = getValue(regs, 30769, 30775);
+    scheduler_destroy(sched);
+    free(due);
+    free(dueIds);
+    free(dueAt);
+    return NULL;
+}
 
-    modbus_free_registers(regs);
+/**
+ * Turns samples into line protocol and writes them to InfluxDB,
+ * keeps what can't be written in the spool.
+ * Every sample also goes to the archive, the recent history and the snapshot,
+ * without deadband or windows.
+ */
+static void *exportSamples(void *arg)
+{
+    pipeline_t *pl = (pipeline_t *)arg;
+    fleet_t *fleet = pl->fleet;
+    Influx *ifx = pl->ifx;
+    time_t last_replay = time(NULL);
+    inverter_sample sample;
 
-    /**
-     * Grid Freq, Reactive Power, Apparent Power
-     */
-    regs = modbus_read_registers(t, 30803, 10);
-    if (regs == NULL)
+    // Series of every inverter in the recent history, and its slot in the snapshot
+    int *series = (int *)calloc(fleet->ndevs, sizeof(int));
+    int *slots = (int *)calloc(fleet->ndevs, sizeof(int));
+    for (int f = 0; f < fleet->ndevs; f++)
     {
-        return -1;
+        series[f] = pl->history != NULL ? history_series_of(pl->history, fleet->devs[f].inv.Name) : -1;
+        slots[f] = pl->snapshot != NULL ? snapshot_slot_of(pl->snapshot, fleet->devs[f].inv.Name) : -1;
     }
 
-    inv->GridFreq       = ((double)getValue(regs, 30803, 30803) / 100); // Hz
-    inv->ReactivePower  = getValue(regs, 30803, 30805);    // VAr
-    inv->ApparentPower  = getValue(regs, 30803, 30813);    // VA
+    for (;;)
+    {
+        // Only set once the pollers are gone, so this is the last drain
+        int stopping = __atomic_load_n(&pl->stopExporting, __ATOMIC_ACQUIRE);
 
-    modbus_free_registers(regs);
+        for (int s = 0; s < fleet->nshards; s++)
+        {
+            while (ring_pop(pl->shards[s].ring, &sample) == 0)
+            {
+                fleet_device *fd = &fleet->devs[sample.device];
+                unsigned long valid = sample.regs & sma_valid_fields(fd->cfg->regs, fd->cfg->nregs, &sample.inv);
+                if (pl->archive != NULL && archive_append(pl->archive, sample.device, sample.inv.Name, fd->cfg->regs, fd->cfg->nregs,
+                        &sample.inv, valid, sample.timestamp / 1000000) != 0)
+                    fprintf(stderr, "main: Can't archive %s\n", sample.inv.Name);
+                if (pl->history != NULL)
+                    history_append(pl->history, series[sample.device], fd->cfg->regs, fd->cfg->nregs, &sample.inv, valid, sample.timestamp / 1000000);
+                if (pl->snapshot != NULL)
+                    snapshot_publish(pl->snapshot, slots[sample.device], fd->cfg->regs, fd->cfg->nregs, &sample.inv, valid, sample.timestamp / 1000000);
 
-    /** 
-     * TEMPERATURE, DC AMP, VOLT, WATT B AMP_L1-3 
-     */
-    regs = modbus_read_registers(t, 30953, 30);
-    if (regs == NULL)
+                if (ifx == NULL)
+                    continue;
+                if (fd->window != NULL)
+                    aggregate(*ifx, fd, &sample.inv, sample.regs, sample.timestamp / 1000000, pl->precision_ns);
+                else
+                    exportToInflux(*ifx, fd, &sample.inv, sample.regs, sample.timestamp / pl->precision_ns, sample.timestamp / 1000000);
+            }
+            __atomic_store_n(&metrics.queue_depth[s], ring_depth(pl->shards[s].ring), __ATOMIC_RELAXED);
+        }
+
+        // Windows of inverters that missed the sample that would have ended them
+        long long now = wallClockMs();
+        for (int f = 0; f < fleet->ndevs && ifx != NULL; f++)
+        {
+            if (fleet->devs[f].window != NULL && window_expired(fleet->devs[f].window, now - fleet->devs[f].cfg->interval * 1000LL))
+                exportWindow(*ifx, &fleet->devs[f], pl->precision_ns);
+        }
+
+        if (stopping)
+            break;
+        if (pl->archive != NULL)
+            archive_flush_due(pl->archive, now);
+
+        /**
+         * Write due batches, spool what failed, replay older points at a limited rate
+         */
+        if (ifx != NULL)
+        {
+            ifx->flushIfDue();
+            spoolFailed(*ifx, pl->spool);
+        }
+        if (ifx != NULL && pl->spool != NULL)
+        {
+            time_t now = time(NULL);
+            replaySpool(*ifx, pl->spool, pl->replayRate * (now > last_replay ? now - last_replay : 1));
+            last_replay = now;
+            spoolFailed(*ifx, pl->spool);
+        }
+
+        // Wait for samples, wake up every second for batches and the spool
+        struct pollfd pfd = {pl->wake, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) == 1)
+        {
+            uint64_t n;
+            if (read(pl->wake, &n, sizeof(n)) != sizeof(n))
+                fprintf(stderr, "main: Can't read wakeups\n");
+        }
+    }
+
+    // Chunks in progress are written, their registers go with the fleet
+    if (pl->archive != NULL)
+        archive_flush(pl->archive);
+    free(series);
+    free(slots);
+    if (ifx == NULL)
+        return NULL;
+
+    // Windows in progress are left to the reload or to stopping, see swapWindows()
+    ifx->flush();
+    spoolFailed(*ifx, pl->spool);
+
+    return NULL;
+}
+
+/**
+ * Stops the pollers a failed startPipeline() started, their samples are dropped
+ * @param started Shards whose poller runs, the ring of the next one may have been created too
+ */
+static void abortPipeline(pipeline_t *pl, int started)
+{
+    pthread_mutex_lock(&pl->lock);
+    __atomic_store_n(&pl->stopPolling, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    // Without an exporter, pollers blocked on a full ring would wait forever
+    for (int s = 0; s < started; s++)
     {
-        return -1;
+        ring_close(pl->shards[s].ring);
+        pthread_join(pl->shards[s].thread, NULL);
     }
 
-    inv->Temperature = getValue(regs, 30953, 30953) / 10;
+    for (int s = 0; s <= started && s < pl->fleet->nshards; s++)
+    {
+        ring_destroy(pl->shards[s].ring);
+        pl->shards[s].ring = NULL;
+    }
+}
 
-    inv->Udc2 = ((double)getValue(regs, 30953, 30959) / 100);
-    inv->Idc2 = ((double)getValue(regs, 30953, 30957) / 1000);
-    inv->Pdc2 = getValue(regs, 30953, 30961);
+/**
+ * Starts a poller thread per shard of the fleet and the exporter
+ * @return 0 on success, -1 when failed
+ */
+static int startPipeline(pipeline_t *pl, fleet_t *fleet)
+{
+    pl->fleet = fleet;
+    pl->stopPolling = 0;
+    pl->stopExporting = 0;
+    metrics.nqueues = fleet->nshards;
 
-    inv->Iac1 = ((double)getValue(regs, 30953, 30977) / 1000);
+    for (int s = 0; s < fleet->nshards; s++)
+    {
+        shard_t *sh = &pl->shards[s];
+        sh->pl = pl;
+        sh->shard = s;
+        sh->ring = ring_create(pl->queueSize, sizeof(inverter_sample), pl->queuePolicy);
+        if (sh->ring == NULL)
+        {
+            fprintf(stderr, "main: Can't allocate a queue of %lu samples\n", (unsigned long)pl->queueSize);
+            abortPipeline(pl, s);
+            return -1;
+        }
+        if (pthread_create(&sh->thread, NULL, pollShard, sh) != 0)
+        {
+            fprintf(stderr, "main: Can't start poller %d\n", s);
+            abortPipeline(pl, s);
+            return -1;
+        }
+    }
 
-    modbus_free_registers(regs);
+    if (pthread_create(&pl->exporter, NULL, exportSamples, pl) != 0)
+    {
+        fprintf(stderr, "main: Can't start the exporter\n");
+        abortPipeline(pl, fleet->nshards);
+        return -1;
+    }
 
     return 0;
 }
 
-int exportToInflux(Influx &ifx, SMA_Inverter *inv, unsigned long currentTimestamp)
+/**
+ * Stops polling, then exports what was polled so far
+ */
+static void stopPipeline(pipeline_t *pl)
 {
-    ifx.clear();
-    
-    // can be a way to see if the inverter is off? 
-    if (inv->Temperature > 10000)
-    {
-        return ifx.meas("measurement")
-            .tag("inverter", inv->Name)
-            .field("Condition", inv->Condition)
+    pthread_mutex_lock(&pl->lock);
+    __atomic_store_n(&pl->stopPolling, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+
+    for (int s = 0; s < pl->fleet->nshards; s++)
+        pthread_join(pl->shards[s].thread, NULL);
 
-            // .field("Heatsink", inv->HeatsinkTemperature)
-            .field("DayYield", inv->DayYield)
-            .field("TotalYield", inv->TotalYield)
+    __atomic_store_n(&pl->stopExporting, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(pl->wake, &one, sizeof(one)) != sizeof(one))
+        fprintf(stderr, "main: Can't wake the exporter\n");
+    pthread_join(pl->exporter, NULL);
 
-            .field("GridRelay", inv->GridRelay)
-            .field("GridFreq", inv->GridFreq)
+    for (int s = 0; s < pl->fleet->nshards; s++)
+    {
+        ring_destroy(pl->shards[s].ring);
+        pl->shards[s].ring = NULL;
+    }
+}
 
-            .timestamp(currentTimestamp)
-            .post();
+/**
+ * Keeps writes that failed for a temporary reason, drops them without spool
+ */
+void spoolFailed(Influx &ifx, spool_t *spool)
+{
+    std::string body;
+    while (ifx.takeFailed(body))
+    {
+        if (spool == NULL || spool_append(spool, body.data(), body.length(), ifx.precisionNs()) != 0)
+            fprintf(stderr, "main: Dropped %lu bytes of points\n", (unsigned long)body.length());
     }
+}
+
+/**
+ * Converts the timestamps ending the lines to another precision
+ * @param lines Lines separated by newlines
+ * @param from_ns Timestamp unit of lines
+ * @param to_ns Timestamp unit of out
+ */
+static void rescaleLines(std::string &out, const char *lines, size_t len, long long from_ns, long long to_ns)
+{
+    const char *end = lines + len;
+    out.clear();
+    out.reserve(len + len / 8);
 
-    return ifx.meas("measurement")
-        .tag("inverter", inv->Name)
-        .field("Condition", inv->Condition)
+    for (const char *line = lines; line < end;)
+    {
+        const char *eol = (const char *)memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
 
-        .field("Temperature", inv->Temperature)
-        // .field("Heatsink", inv->HeatsinkTemperature)
-        .field("DayYield", inv->DayYield)
-        .field("TotalYield", inv->TotalYield)
+        const char *ts = eol;
+        while (ts > line && ts[-1] >= '0' && ts[-1] <= '9')
+            ts--;
+        if (ts > line && ts < eol && ts[-1] == ' ')
+        {
+            long long t = strtoll(ts, NULL, 10);
+            t = from_ns > to_ns ? t * (from_ns / to_ns) : t / (to_ns / from_ns);
+            out.append(line, ts - line);
+            out.append(std::to_string(t));
+        }
+        else
+        {
+            out.append(line, eol - line);
+        }
 
-        .field("Pac1", inv->Pac1)
-        .field("Pdc1", inv->Pdc1)
-        .field("Pdc2", inv->Pdc2)
+        if (eol < end)
+            out.push_back('\n');
+        line = eol + 1;
+    }
+}
 
-        .field("Uac1", inv->Uac1)
-        .field("Udc1", inv->Udc1)
-        .field("Udc2", inv->Udc2)
+/**
+ * Writes spooled points while Influx is available.
+ * Points spooled with another precision are converted to the current one.
+ * @param budget Max number of bytes to replay, keeps room for live points.
+ * A record larger than that is still replayed, one per call.
+ */
+void replaySpool(Influx &ifx, spool_t *spool, size_t budget)
+{
+    static char buf[1024 * 1024];
+    std::string lines;
 
-        .field("Iac1", inv->Iac1)
-        .field("Idc1", inv->Idc1)
-        .field("Idc2", inv->Idc2)
+    while (budget > 0 && spool_used(spool) > 0 && ifx.available())
+    {
+        uint64_t next;
+        long long precision_ns;
+        size_t len = spool_read(spool, buf, sizeof(buf), budget, &next, &precision_ns);
+        if (len == 0)
+            break;
 
-        .field("GridRelay", inv->GridRelay)
-        .field("GridFreq", inv->GridFreq)
-        .field("ReactivePower", inv->ReactivePower)
-        .field("ApparentPower", inv->ApparentPower)
+        if (precision_ns == ifx.precisionNs())
+            lines.assign(buf, len);
+        else
+            rescaleLines(lines, buf, len, precision_ns, ifx.precisionNs());
 
-        .timestamp(currentTimestamp)
-        .post();
+        // Failed lines come back through takeFailed() and are spooled again
+        spool_commit(spool, next);
+        if (ifx.writeLines(lines) != 0)
+            break;
+        budget = len < budget ? budget - len : 0;
+    }
 }
 
 void printInverter(SMA_Inverter *inv)
@@ -193,10 +738,27 @@ void printInverter(SMA_Inverter *inv)
     printf("Total yield: %luWh\n", inv->TotalYield);
     printf("Day yield: %luWh\n", inv->DayYield);
     printf("Inverter\n\tTemperature: %fC\tHeatsink: %fC\n", inv->Temperature, inv->HeatsinkTemperature);
-    printf("DC 1\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %luW\n", inv->Udc1, inv->Idc1, inv->Pdc1);
-    printf("DC 2\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %luW\n", inv->Udc2, inv->Idc2, inv->Pdc2);
-    printf("AC\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %luW\n",   inv->Uac1, inv->Iac1, inv->Pac1);
-    printf("\tGridFreq: %f\n\tReactiveP: %lu VAr\n\tApparentP: %li\n", inv->GridFreq, inv->ReactivePower, inv->ApparentPower);
+    printf("DC 1\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %ldW\n", inv->Udc1, inv->Idc1, inv->Pdc1);
+    printf("DC 2\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %ldW\n", inv->Udc2, inv->Idc2, inv->Pdc2);
+    printf("AC\n\tVolt: %fV\n\tAmp: %fA\n\tWatt: %ldW\n",   inv->Uac1, inv->Iac1, inv->Pac1);
+    printf("\tGridFreq: %f\n\tReactiveP: %ld VAr\n\tApparentP: %ld VA\n", inv->GridFreq, inv->ReactivePower, inv->ApparentPower);
+}
+
+/**
+ * Counts InfluxDB responses for /metrics
+ */
+static void observeInflux(int status, long long us, size_t bytes)
+{
+    if (status == Influx::ERR_CONNECTION)
+    {
+        metrics_inc(&metrics.influx_errors, 1);
+        return;
+    }
+
+    metrics_observe(&metrics.influx, us);
+    metrics_inc(&metrics.influx_bytes, bytes);
+    if (status >= 0 && status < METRICS_MAX_STATUS)
+        metrics_inc(&metrics.influx_status[status], 1);
 }
 
 int main(void)
@@ -205,73 +767,275 @@ int main(void)
     /**
      * Get environment variables
      */
-    const char *influx_host     = getenv("INFLUX_HOST");
-    const int influx_port       = atoi(getenv("INFLUX_PORT"));
+    const char *influx_host     = getenv("INFLUX_HOST"); // optional with ARCHIVE
+    const char *influx_port     = getenv("INFLUX_PORT");
     const char *influx_org      = getenv("INFLUX_ORGANISATION");
     const char *influx_bucket   = getenv("INFLUX_BUCKET");
     const char *influx_token    = getenv("INFLUX_TOKEN"); // jaja, I know
     const int interval          = atoi(getenv("INTERVAL")); 
     const int debug             = atoi(getenv("DEBUG"));
+    const char *max_gap         = getenv("MODBUS_MAX_GAP"); // optional
+    const char *pipeline        = getenv("MODBUS_PIPELINE"); // optional
+    const char *batch_bytes     = getenv("INFLUX_BATCH_BYTES"); // optional
+    const char *batch_age       = getenv("INFLUX_BATCH_AGE"); // optional
+    const char *gzip            = getenv("INFLUX_GZIP"); // optional
+    const char *influx_pipeline = getenv("INFLUX_PIPELINE"); // optional
+    const char *influx_timeout  = getenv("INFLUX_TIMEOUT"); // optional
+    const char *spool_path      = getenv("INFLUX_SPOOL"); // optional
+    const char *spool_bytes     = getenv("INFLUX_SPOOL_BYTES"); // optional
+    const char *spool_policy    = getenv("INFLUX_SPOOL_POLICY"); // optional
+    const char *spool_rate      = getenv("INFLUX_SPOOL_RATE"); // optional
+    const char *metrics_port    = getenv("METRICS_PORT"); // optional
+    const char *config_path     = getenv("CONFIG"); // optional
+    const char *precision       = getenv("INFLUX_PRECISION"); // optional
+    const char *poll_threads    = getenv("POLL_THREADS"); // optional
+    const char *queue_size      = getenv("QUEUE_SIZE"); // optional
+    const char *queue_policy    = getenv("QUEUE_POLICY"); // optional
+    const char *archive_dir     = getenv("ARCHIVE"); // optional
+    const char *history_size    = getenv("HISTORY"); // optional
+    const char *history_addr    = getenv("HISTORY_LISTEN"); // optional
+    const char *snapshot_name   = getenv("SNAPSHOT"); // optional
 
     /**
-     * Connect to InfluxDB
+     * Signals are taken by sigwait() at the end of main(), never by the other threads
      */
-    Influx ifx(influx_host, influx_port, influx_org, influx_bucket, influx_token);
-    if (ifx.connectNow() != 0)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /**
+     * Prometheus metrics are always counted, served only when asked for
+     */
+    metrics.interval = interval;
+    if (metrics_port != NULL && metrics_start(atoi(metrics_port)) != 0)
     {
-        fprintf(stderr, "main: InfluxDB connection failed\n");
         return -1;
     }
 
-    fprintf(stdout, "Connecting to Inverters...\n");
+    if (influx_host == NULL && archive_dir == NULL && history_size == NULL && history_addr == NULL && snapshot_name == NULL)
+    {
+        fprintf(stderr, "main: Set INFLUX_HOST, ARCHIVE, HISTORY or SNAPSHOT\n");
+        return -1;
+    }
+
+    /**
+     * Samples are kept locally in ARCHIVE, see src/archive.h
+     */
+    archive_t *archive = NULL;
+    if (archive_dir != NULL && (archive = archive_open(archive_dir)) == NULL)
+    {
+        return -1;
+    }
 
-    // Connect to clients
-    SMA_Inverter sb3000 = {
-        .Ip = strdup("172.19.30.0"),
-        .Port = 502,
-        .Name = strdup("SB3000TL-21"),
-    };
-    modbus_t *sb3000_conn = modbus_connect_tcp(sb3000.Ip, sb3000.Port);
-    puts("Connected to SB3000TL");
-
-    SMA_Inverter sb4000 = {
-        .Ip = strdup("172.19.40.0"),
-        .Port = 502,
-        .Name = strdup("SB4000TL-21"),
-    };
-    modbus_t *sb4000_conn = modbus_connect_tcp(sb4000.Ip, sb4000.Port);
-    puts("Connected to SB4000TL");
-
-    // TODO  HANDLE UNIX SIGNALS
-    for (unsigned long long i = 0;; i++)
-    {
-        unsigned long currentTimestamp = time(NULL);
-
-        processInverter(&sb3000, sb3000_conn);
-        processInverter(&sb4000, sb4000_conn);
-
-        if (debug){
-            printInverter(&sb3000);
-            printInverter(&sb4000);
+    /**
+     * The last HISTORY samples of every inverter are kept in memory and
+     * can be queried on HISTORY_LISTEN, see src/history.h
+     */
+    history_t *history = NULL;
+    if (history_size != NULL || history_addr != NULL)
+    {
+        long capacity = history_size ? atol(history_size) : HISTORY_DEFAULT_CAPACITY;
+        if (capacity <= 0)
+        {
+            fprintf(stderr, "main: HISTORY must be a number of samples above 0\n");
+            return -1;
         }
+        history = history_create(capacity);
+        if (history == NULL || (history_addr != NULL && history_listen(history, history_addr) != 0))
+        {
+            return -1;
+        }
+    }
 
-        /**
-         * Export to InfluxDB using the same timestamp
-         */
-        int ret = exportToInflux(ifx, &sb3000, currentTimestamp);
-        ret = exportToInflux(ifx, &sb4000, currentTimestamp);
-        if (ret != 0) {
+    /**
+     * The newest sample of every inverter goes to shared memory SNAPSHOT,
+     * see src/snapshot_reader.h
+     */
+    snapshot_t *snapshot = NULL;
+    if (snapshot_name != NULL && (snapshot = snapshot_open(snapshot_name)) == NULL)
+    {
+        return -1;
+    }
+
+    /**
+     * Connect to InfluxDB, unless only kept locally
+     */
+    Influx *ifx = NULL;
+    if (influx_host != NULL)
+    {
+        ifx = new Influx(influx_host, influx_port ? atoi(influx_port) : 8086, influx_org, influx_bucket, influx_token);
+        ifx->observe(observeInflux);
+        ifx->timeout(influx_timeout ? atoi(influx_timeout) : 5000);
+        if (ifx->connectNow() != 0)
+        {
+            // Reconnects on the next write
+            fprintf(stderr, "main: InfluxDB connection failed\n");
+        }
+    }
+
+    /**
+     * Points that can't be written are kept on disk while Influx is down
+     */
+    spool_t *spool = NULL;
+    size_t replay_rate = spool_rate ? atol(spool_rate) : 256 * 1024; // bytes per second
+    if (spool_path != NULL && ifx != NULL)
+    {
+        spool = spool_open(spool_path, spool_bytes ? atol(spool_bytes) : 64 * 1024 * 1024,
+            spool_policy && strcmp(spool_policy, "newest") == 0 ? SPOOL_DROP_NEWEST : SPOOL_DROP_OLDEST);
+        if (spool == NULL)
+        {
+            return -1;
+        }
+    }
+
+    /**
+     * All inverters polled together are written in one request,
+     * or less often when INFLUX_BATCH_AGE is set
+     */
+    if (ifx != NULL)
+    {
+        ifx->batch(batch_bytes ? atoi(batch_bytes) : 64 * 1024,
+            batch_age ? atoi(batch_age) : 0,
+            gzip ? atoi(gzip) != 0 : false);
+        ifx->pipeline(influx_pipeline ? atoi(influx_pipeline) : 1);
+    }
+
+    /**
+     * Timestamps are taken in ns and written in INFLUX_PRECISION,
+     * spooled points are converted when it changed
+     */
+    const long long precision_ns = linePrecisionNs(precision ? precision : "ms");
+    if (precision_ns == 0 || (ifx != NULL && !ifx->precision(precision ? precision : "ms")))
+    {
+        fprintf(stderr, "main: INFLUX_PRECISION must be s, ms, us or ns\n");
+        return -1;
+    }
+
+    /**
+     * Inverters come from CONFIG, or are the two this was written for
+     */
+    config_t *cfg = config_path ? config_load(config_path, interval) : config_default(interval);
+    if (cfg == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(stdout, "Connecting to Inverters...\n");
+    int nshards = poll_threads ? atoi(poll_threads) : 1;
+    fleet_t *fleet = openFleet(cfg, max_gap ? atoi(max_gap) : SMA_DEFAULT_MAX_GAP, pipeline ? atoi(pipeline) : 0, nshards);
+    if (fleet == NULL)
+    {
+        return -1;
+    }
+
+    /**
+     * Poller threads hand their samples to the exporter thread
+     */
+    pipeline_t pl = {};
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.cond, NULL);
+    pl.wake = eventfd(0, EFD_NONBLOCK);
+    pl.debug = debug;
+    long queue = queue_size ? atol(queue_size) : 1024;
+    if (queue <= 0)
+    {
+        fprintf(stderr, "main: QUEUE_SIZE must be a number of samples above 0\n");
+        return -1;
+    }
+    pl.queueSize = queue;
+    pl.queuePolicy = !queue_policy || strcmp(queue_policy, "oldest") == 0 ? RING_DROP_OLDEST
+        : strcmp(queue_policy, "newest") == 0 ? RING_DROP_NEWEST
+        : strcmp(queue_policy, "block") == 0 ? RING_BLOCK : -1;
+    if (pl.queuePolicy < 0)
+    {
+        fprintf(stderr, "main: QUEUE_POLICY must be oldest, newest or block\n");
+        return -1;
+    }
+    pl.precision_ns = precision_ns;
+    pl.ifx = ifx;
+    pl.archive = archive;
+    pl.history = history;
+    pl.snapshot = snapshot;
+    pl.spool = spool;
+    pl.replayRate = replay_rate;
+
+    if (startPipeline(&pl, fleet) != 0)
+    {
+        return -1;
+    }
+    int running = 1;
+
+    /**
+     * This thread only handles signals from here on:
+     * SIGHUP reads the config again, SIGINT and SIGTERM stop
+     */
+    for (;;)
+    {
+        int sig;
+        if (sigwait(&signals, &sig) != 0 || sig != SIGHUP)
             break;
-            // Abort if connection with Influx lost
+
+        config_t *next = config_path ? config_load(config_path, interval) : NULL;
+        if (next == NULL)
+        {
+            fprintf(stderr, "main: Keeping the current inverters\n");
+            continue;
         }
 
-        printf("%u OK\n", (unsigned)time(NULL));
+        // The current inverters are polled until the new ones are ready, and again when they fail to start
+        fprintf(stdout, "main: Reloading %s\n", config_path);
+        fleet_t *reloaded = openFleet(next, max_gap ? atoi(max_gap) : SMA_DEFAULT_MAX_GAP, pipeline ? atoi(pipeline) : 0, nshards);
+        if (reloaded == NULL)
+        {
+            fprintf(stderr, "main: Keeping the current inverters\n");
+            continue;
+        }
+
+        // Windows of inverters that are gone or changed end here
+        stopPipeline(&pl);
+        swapWindows(fleet, reloaded);
+        if (ifx != NULL)
+            exportWindows(*ifx, fleet, precision_ns);
+        if (startPipeline(&pl, reloaded) == 0)
+        {
+            fleet_close(fleet);
+            fleet = reloaded;
+            continue;
+        }
 
-        sleep(interval);
+        fprintf(stderr, "main: Keeping the current inverters\n");
+        swapWindows(reloaded, fleet);
+        fleet_close(reloaded);
+        if (startPipeline(&pl, fleet) != 0)
+        {
+            fprintf(stderr, "main: Can't restart polling\n");
+            running = 0;
+            break;
+        }
     }
 
-    modbus_close(sb3000_conn);
-    modbus_close(sb4000_conn);
+    fprintf(stdout, "main: Stopping\n");
+    if (running)
+        stopPipeline(&pl);
+    if (ifx != NULL)
+    {
+        exportWindows(*ifx, fleet, precision_ns);
+        ifx->flush();
+        ifx->sync();
+        spoolFailed(*ifx, spool);
+        delete ifx;
+    }
+    if (spool != NULL)
+        spool_close(spool);
+    if (archive != NULL)
+        archive_close(archive);
+    if (snapshot != NULL)
+        snapshot_close(snapshot);
+    fleet_close(fleet);
+    close(pl.wake);
 
     return 0;
 }
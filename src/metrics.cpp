@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+
+metrics_t metrics;
+
+// Upper bounds of the histogram buckets in seconds
+static const double metrics_bounds[METRICS_BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30,
+};
+
+/**
+ * Monotonic clock in microseconds
+ */
+long long metrics_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Escapes backslashes, double quotes and newlines of a label value
+ * @param dst At least twice the size of src
+ */
+static void metrics_escape(char *dst, const char *src)
+{
+    for (; *src; src++)
+    {
+        if (*src == '\\' || *src == '"')
+            *dst++ = '\\';
+        if (*src == '\n')
+        {
+            *dst++ = '\\';
+            *dst++ = 'n';
+        }
+        else
+            *dst++ = *src;
+    }
+    *dst = '\0';
+}
+
+/**
+ * Reserves the counters of an inverter. An inverter that was added before,
+ * e.g. before the config was reloaded, keeps its counters.
+ * @param name Inverter name, used as label
+ * @param plan Register blocks read from the inverter
+ * @return counters, NULL when there are too many inverters
+ */
+metrics_device *metrics_add_device(const char *name, const sma_plan *plan)
+{
+    for (int i = 0; i < metrics.ndevices; i++)
+    {
+        metrics_device *dev = &metrics.devices[i];
+        if (strcmp(dev->name, name) != 0)
+            continue;
+
+        // Blocks that moved start over
+        for (int b = 0; b < plan->nblocks; b++)
+        {
+            if (b >= dev->nblocks || dev->block_addr[b] != plan->blocks[b].addr)
+            {
+                memset(&dev->block[b], 0, sizeof(metrics_histogram));
+                dev->block_addr[b] = plan->blocks[b].addr;
+            }
+        }
+        dev->nblocks = plan->nblocks;
+        return dev;
+    }
+
+    if (metrics.ndevices >= METRICS_MAX_DEVICES)
+        return NULL;
+
+    metrics_device *dev = &metrics.devices[metrics.ndevices];
+    memset(dev, 0, sizeof(metrics_device));
+    snprintf(dev->name, sizeof(dev->name), "%s", name);
+    metrics_escape(dev->label, dev->name);
+
+    dev->nblocks = plan->nblocks;
+    for (int b = 0; b < plan->nblocks; b++)
+        dev->block_addr[b] = plan->blocks[b].addr;
+
+    // Publish only once initialized, the metrics thread may be reading
+    __atomic_store_n(&metrics.ndevices, metrics.ndevices + 1, __ATOMIC_RELEASE);
+    return dev;
+}
+
+void metrics_inc(unsigned long *counter, unsigned long n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a duration to a histogram
+ * @param us Duration in microseconds
+ */
+void metrics_observe(metrics_histogram *h, long long us)
+{
+    int b = 0;
+    while (b < METRICS_BUCKETS && us > metrics_bounds[b] * 1000000)
+        b++;
+
+    __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long load(const unsigned long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void print_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Prints a histogram in the Prometheus text format
+ * @param labels Label pairs without braces, may be empty
+ */
+static void print_histogram(FILE *out, const char *name, const char *labels, const metrics_histogram *h)
+{
+    const char *sep = labels[0] ? "," : "";
+    unsigned long cumulative = 0;
+
+    for (int b = 0; b <= METRICS_BUCKETS; b++)
+    {
+        cumulative += load(&h->buckets[b]);
+        if (b < METRICS_BUCKETS)
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep, metrics_bounds[b], cumulative);
+        else
+            fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, cumulative);
+    }
+    const char *open = labels[0] ? "{" : "";
+    const char *close = labels[0] ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %f\n", name, open, labels, close, __atomic_load_n(&h->sum_us, __ATOMIC_RELAXED) / 1e6);
+    fprintf(out, "%s_count%s%s%s %lu\n", name, open, labels, close, load(&h->count));
+}
+
+/**
+ * Renders all metrics
+ * @return malloc'd text, free after use
+ */
+static char *metrics_render(size_t *len)
+{
+    char *text = NULL;
+    FILE *out = open_memstream(&text, len);
+
+    int ndevices = __atomic_load_n(&metrics.ndevices, __ATOMIC_ACQUIRE);
+    char labels[192];
+
+    print_header(out, "sma_modbus_request_seconds", "histogram", "Round-trip time of a Modbus request");
+    for (int i = 0; i < ndevices; i++)
+    {
+        snprintf(labels, sizeof(labels), "inverter=\"%s\"", metrics.devices[i].label);
+        print_histogram(out, "sma_modbus_request_seconds", labels, &metrics.devices[i].request);
+    }
+
+    print_header(out, "sma_modbus_block_seconds", "histogram", "Round-trip time per register block");
+    for (int i = 0; i < ndevices; i++)
+    {
+        for (int b = 0; b < metrics.devices[i].nblocks; b++)
+        {
+            snprintf(labels, sizeof(labels), "inverter=\"%s\",block=\"%u\"", metrics.devices[i].label, metrics.devices[i].block_addr[b]);
+            print_histogram(out, "sma_modbus_block_seconds", labels, &metrics.devices[i].block[b]);
+        }
+    }
+
+    print_header(out, "sma_poll_seconds", "histogram", "Time to read all blocks of an inverter");
+    for (int i = 0; i < ndevices; i++)
+    {
+        snprintf(labels, sizeof(labels), "inverter=\"%s\"", metrics.devices[i].label);
+        print_histogram(out, "sma_poll_seconds", labels, &metrics.devices[i].poll);
+    }
+
+    print_header(out, "sma_polls_total", "counter", "Polls of an inverter by result");
+    for (int i = 0; i < ndevices; i++)
+    {
+        fprintf(out, "sma_polls_total{inverter=\"%s\",result=\"ok\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].polls_ok));
+        fprintf(out, "sma_polls_total{inverter=\"%s\",result=\"failed\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].polls_failed));
+    }
+
+    print_header(out, "sma_modbus_retries_total", "counter", "Requests resent after a timeout");
+    for (int i = 0; i < ndevices; i++)
+        fprintf(out, "sma_modbus_retries_total{inverter=\"%s\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].retries));
+
+    print_header(out, "sma_modbus_stray_bytes_total", "counter", "Bytes dropped while resyncing, like SMA's lone 0xFF");
+    for (int i = 0; i < ndevices; i++)
+        fprintf(out, "sma_modbus_stray_bytes_total{inverter=\"%s\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].stray));
+
+    print_header(out, "sma_modbus_exceptions_total", "counter", "Modbus exception responses by exception code");
+    for (int i = 0; i < ndevices; i++)
+    {
+        for (int c = 0; c < METRICS_MAX_EXCEPTION; c++)
+        {
+            unsigned long n = load(&metrics.devices[i].exceptions[c]);
+            if (n)
+                fprintf(out, "sma_modbus_exceptions_total{inverter=\"%s\",code=\"%d\"} %lu\n", metrics.devices[i].label, c, n);
+        }
+    }
+
+    print_header(out, "sma_modbus_received_bytes_total", "counter", "Bytes received from an inverter");
+    for (int i = 0; i < ndevices; i++)
+        fprintf(out, "sma_modbus_received_bytes_total{inverter=\"%s\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].bytes_in));
+
+    print_header(out, "sma_modbus_sent_bytes_total", "counter", "Bytes sent to an inverter");
+    for (int i = 0; i < ndevices; i++)
+        fprintf(out, "sma_modbus_sent_bytes_total{inverter=\"%s\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].bytes_out));
+
+    static const char *const links[] = {"up", "connecting", "backoff", "down"};
+    print_header(out, "sma_modbus_link", "gauge", "State of the connection to an inverter, 1 for the current one");
+    for (int i = 0; i < ndevices; i++)
+    {
+        int link = __atomic_load_n(&metrics.devices[i].link, __ATOMIC_RELAXED);
+        for (int l = 0; l < (int)(sizeof(links) / sizeof(links[0])); l++)
+            fprintf(out, "sma_modbus_link{inverter=\"%s\",state=\"%s\"} %d\n", metrics.devices[i].label, links[l], l == link);
+    }
+
+    print_header(out, "sma_probing", "gauge", "1 while an idle inverter is only probed for Condition, GridRelay and Pac1");
+    for (int i = 0; i < ndevices; i++)
+        fprintf(out, "sma_probing{inverter=\"%s\"} %d\n", metrics.devices[i].label, __atomic_load_n(&metrics.devices[i].probing, __ATOMIC_RELAXED));
+
+    print_header(out, "sma_modbus_connects_total", "counter", "Connects to an inverter by result");
+    for (int i = 0; i < ndevices; i++)
+    {
+        fprintf(out, "sma_modbus_connects_total{inverter=\"%s\",result=\"ok\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].connects));
+        fprintf(out, "sma_modbus_connects_total{inverter=\"%s\",result=\"failed\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].connect_failures));
+    }
+
+    print_header(out, "sma_fields_total", "counter", "Line protocol fields by whether their deadband let them through");
+    for (int i = 0; i < ndevices; i++)
+    {
+        fprintf(out, "sma_fields_total{inverter=\"%s\",result=\"written\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].fields_written));
+        fprintf(out, "sma_fields_total{inverter=\"%s\",result=\"suppressed\"} %lu\n", metrics.devices[i].label, load(&metrics.devices[i].fields_suppressed));
+    }
+
+    print_header(out, "sma_cycle_seconds", "histogram", "Time to poll the inverters that were due together");
+    print_histogram(out, "sma_cycle_seconds", "", &metrics.cycle);
+
+    print_header(out, "sma_cycle_interval_seconds", "gauge", "Configured INTERVAL");
+    fprintf(out, "sma_cycle_interval_seconds %lu\n", load(&metrics.interval));
+
+    print_header(out, "sma_cycle_overruns_total", "counter", "Cycles that took longer than INTERVAL");
+    fprintf(out, "sma_cycle_overruns_total %lu\n", load(&metrics.overruns));
+
+    int nqueues = __atomic_load_n(&metrics.nqueues, __ATOMIC_RELAXED);
+    print_header(out, "sma_queue_depth", "gauge", "Samples waiting for the exporter, per poller thread");
+    for (int q = 0; q < nqueues; q++)
+        fprintf(out, "sma_queue_depth{shard=\"%d\"} %lu\n", q, load(&metrics.queue_depth[q]));
+
+    print_header(out, "sma_queue_dropped_total", "counter", "Samples dropped because the queue to the exporter was full");
+    for (int q = 0; q < nqueues; q++)
+        fprintf(out, "sma_queue_dropped_total{shard=\"%d\"} %lu\n", q, load(&metrics.queue_dropped[q]));
+
+    print_header(out, "sma_influx_request_seconds", "histogram", "InfluxDB write request until its response");
+    print_histogram(out, "sma_influx_request_seconds", "", &metrics.influx);
+
+    print_header(out, "sma_influx_responses_total", "counter", "InfluxDB responses by HTTP status");
+    for (int c = 0; c < METRICS_MAX_STATUS; c++)
+    {
+        unsigned long n = load(&metrics.influx_status[c]);
+        if (n)
+            fprintf(out, "sma_influx_responses_total{code=\"%d\"} %lu\n", c, n);
+    }
+
+    print_header(out, "sma_influx_sent_bytes_total", "counter", "Bytes of line protocol sent to InfluxDB");
+    fprintf(out, "sma_influx_sent_bytes_total %lu\n", load(&metrics.influx_bytes));
+
+    print_header(out, "sma_influx_connection_errors_total", "counter", "Failed connections to InfluxDB");
+    fprintf(out, "sma_influx_connection_errors_total %lu\n", load(&metrics.influx_errors));
+
+    fclose(out);
+    return text;
+}
+
+/**
+ * Answers every request with the metrics, one connection at a time
+ */
+static void *metrics_serve(void *arg)
+{
+    int s = (int)(long)arg;
+
+    for (;;)
+    {
+        int c = accept(s, NULL, NULL);
+        if (c == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // Out of descriptors or memory for now, wait for some to be freed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                usleep(100000);
+                continue;
+            }
+
+            fprintf(stderr, "metrics: accept failed, no longer serving\n");
+            break;
+        }
+
+        // Don't let a silent client hold up the others
+        struct timeval tv = {1, 0};
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        // We don't care about the request, there is only /metrics
+        char req[1024];
+        if (recv(c, req, sizeof(req), 0) <= 0)
+        {
+            close(c);
+            continue;
+        }
+
+        size_t len;
+        char *body = metrics_render(&len);
+
+        char header[256];
+        int hlen = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long)len);
+        send(c, header, hlen, MSG_NOSIGNAL);
+        send(c, body, len, MSG_NOSIGNAL);
+
+        free(body);
+        close(c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Serves /metrics on a background thread
+ * @param port TCP port to listen on
+ * @return 0 on success, -1 when failed
+ */
+int metrics_start(int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+
+    if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(s, 8) == -1)
+    {
+        fprintf(stderr, "metrics: Can't listen on %d\n", port);
+        close(s);
+        return -1;
+    }
+
+    // Signals like SIGHUP are for the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, metrics_serve, (void *)(long)s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0)
+    {
+        close(s);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    printf("metrics: Serving on port %d\n", port);
+    return 0;
+}
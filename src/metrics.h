@@ -0,0 +1,82 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "sma_map.h"
+
+#define METRICS_BUCKETS 15
+#define METRICS_MAX_DEVICES 256
+#define METRICS_MAX_EXCEPTION 16
+#define METRICS_MAX_STATUS 600
+#define METRICS_MAX_QUEUES 64
+
+/**
+ * Histogram with fixed buckets, see metrics_bounds.
+ * All fields are updated with atomic builtins, no locks.
+ */
+typedef struct
+{
+    unsigned long buckets[METRICS_BUCKETS + 1]; // Not cumulative, last one is +Inf
+    unsigned long count;
+    unsigned long long sum_us;
+} metrics_histogram;
+
+/**
+ * Everything we count per inverter
+ */
+typedef struct
+{
+    char name[64];
+    char label[128];                            // name escaped for a label value
+
+    metrics_histogram request;                  // Round-trip of a single request
+    metrics_histogram block[SMA_MAX_BLOCKS];    // Round-trip per register block
+    unsigned short block_addr[SMA_MAX_BLOCKS];
+    int nblocks;
+    metrics_histogram poll;                     // All blocks of one cycle
+
+    unsigned long polls_ok;
+    unsigned long polls_failed;
+    unsigned long retries;
+    unsigned long stray;                        // Bytes dropped while resyncing, SMA's lone 0xFF
+    unsigned long exceptions[METRICS_MAX_EXCEPTION];
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long fields_written;
+    unsigned long fields_suppressed;            // Left out by their deadband
+    unsigned long connects;                     // Connections established
+    unsigned long connect_failures;
+    int link;                                   // LINK_UP etc., see poller.h
+    int probing;                                // Idle, only probed, see fleet_adapt
+} metrics_device;
+
+typedef struct
+{
+    metrics_device devices[METRICS_MAX_DEVICES];
+    int ndevices;
+
+    metrics_histogram cycle;                    // Polling the inverters that were due together
+    unsigned long interval;                     // Configured INTERVAL in seconds
+    unsigned long overruns;                     // Cycles that took longer than interval
+
+    metrics_histogram influx;                   // POST until response
+    unsigned long influx_status[METRICS_MAX_STATUS];
+    unsigned long influx_bytes;
+    unsigned long influx_errors;                // Connection failures
+
+    unsigned long queue_depth[METRICS_MAX_QUEUES];      // Samples waiting for the exporter, per poller thread
+    unsigned long queue_dropped[METRICS_MAX_QUEUES];    // Samples lost because the queue was full
+    int nqueues;
+} metrics_t;
+
+extern metrics_t metrics;
+
+/**
+ * Function predefinitions
+ */
+long long metrics_now_us(void);
+metrics_device *metrics_add_device(const char *name, const sma_plan *plan);
+void metrics_inc(unsigned long *counter, unsigned long n);
+void metrics_observe(metrics_histogram *h, long long us);
+int metrics_start(int port);
+
+#endif
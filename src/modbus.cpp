@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -11,63 +12,188 @@
 #include <sys/select.h>
 #include <poll.h>
 #include <netinet/tcp.h>
+#include <time.h>
 
 #include "modbus.h"
 
-int _modbus_receive(modbus_t *mb, uint8_t *rsp, int rsp_length);
+int _modbus_receive(modbus_t *mb, unsigned short tid, long long deadline);
 
 void printBuffer(uint8_t *rsp, size_t size)
 {
+    // One line, even while other threads print
+    flockfile(stdout);
     for (size_t i = 0; i < size; i++)
     {
         printf("[%.2X]", rsp[i]);
     }
     printf("\n");
+    funlockfile(stdout);
 }
 
 /**
- * Prepares modbus type, connects to target
- * @return modbus_type
+ * Prepares modbus type without connecting, see modbus_connect_start
+ * @return modbus_type, NULL when ip is no IPv4 address
  */
-modbus_t *modbus_connect_tcp(const char *ip, unsigned short port)
+modbus_t *modbus_new_tcp(const char *ip, unsigned short port)
 {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) != 1)
+    {
+        fprintf(stderr, "modbus: Invalid address %s\n", ip);
+        return NULL;
+    }
+
     modbus_t *mb = (modbus_t *)malloc(sizeof(modbus_t));
     memset(mb, 0, sizeof(modbus_t));
 
+    mb->s = -1;
     mb->ip = strdup(ip);
     mb->port = port; // INET6_ADDRSTRLEN
     mb->transaction_id = -1;
+    mb->depth = 1;
 
+    return mb;
+}
+
+/**
+ * Starts connecting without blocking. The socket is non-blocking from here on.
+ * @param mb modbus_type, not connected
+ * @return 0 when connected, 1 when in progress (wait until writable, then
+ *         modbus_connect_finish) or -1 when failed
+ */
+int modbus_connect_start(modbus_t *mb)
+{
     /**
      * TCP socket
      */
     struct sockaddr_in sa;
-    inet_pton(AF_INET, ip, &(sa.sin_addr));
+    memset(&sa, 0, sizeof(sa));
+    inet_pton(AF_INET, mb->ip, &(sa.sin_addr));
     sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
+    sa.sin_port = htons(mb->port);
 
-    printf("DEBUG: Connecting to %s %d\n", ip, port);
+#if DEBUG
+    printf("DEBUG: Connecting to %s %d\n", mb->ip, mb->port);
+#endif
 
-    if ((mb->s = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+    if ((mb->s = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
     {
         fprintf(stderr, "socket: socket\n");
+        return -1;
+    }
+
+    // Set TCP_NODELAY so we don't have to flush
+    int flag = 1;
+    setsockopt(mb->s, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+    /**
+     * Inverters vanish at night without closing their connections.
+     * Keepalive finds idle connections that went half-open, the user timeout
+     * those with a request that is never acknowledged.
+     */
+    int idle = MODBUS_KEEPALIVE_IDLE, interval = MODBUS_KEEPALIVE_INTERVAL, count = MODBUS_KEEPALIVE_COUNT;
+    unsigned int user_timeout = (MODBUS_KEEPALIVE_IDLE + MODBUS_KEEPALIVE_INTERVAL * MODBUS_KEEPALIVE_COUNT) * 1000;
+    setsockopt(mb->s, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+    setsockopt(mb->s, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(mb->s, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(mb->s, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(mb->s, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+
+    if (connect(mb->s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == 0)
+        return 0;
+    if (errno == EINPROGRESS)
+        return 1;
+
+    modbus_disconnect(mb);
+    return -1;
+}
+
+/**
+ * Checks how a connect that was in progress ended
+ * @return 0 when connected, -1 when failed, the socket is closed then
+ */
+int modbus_connect_finish(modbus_t *mb)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(mb->s, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+
+    if (err != 0)
+    {
+        modbus_disconnect(mb);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Prepares modbus type, connects to target.
+ * Waits at most MODBUS_CONNECT_TIMEOUT_MS, the socket is blocking afterwards.
+ * @return modbus_type, NULL when failed
+ */
+modbus_t *modbus_connect_tcp(const char *ip, unsigned short port)
+{
+    modbus_t *mb = modbus_new_tcp(ip, port);
+    if (mb == NULL)
         return NULL;
+
+    int rc = modbus_connect_start(mb);
+    if (rc == 1)
+    {
+        struct pollfd pfd = {mb->s, POLLOUT, 0};
+        long long deadline = modbus_now_ms() + MODBUS_CONNECT_TIMEOUT_MS;
+        int n;
+        do
+        {
+            long long remaining = deadline - modbus_now_ms();
+            n = poll(&pfd, 1, remaining > 0 ? (int)remaining : 0);
+        } while (n < 0 && errno == EINTR);
+
+        rc = n == 1 ? modbus_connect_finish(mb) : -1;
     }
 
-    if (connect(mb->s, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) == -1)
+    if (rc != 0)
     {
-        close(mb->s);
         fprintf(stderr, "socket: connect\n");
+        modbus_close(mb);
         return NULL;
     }
 
-    // Set TCP_NODELAY so we don't have to flush
-    int flag = 1;
-    setsockopt(mb->s, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+    int flags = fcntl(mb->s, F_GETFL, 0);
+    fcntl(mb->s, F_SETFL, flags & ~O_NONBLOCK);
 
     return mb;
 }
 
+/**
+ * Closes the connection, mb can connect again with modbus_connect_start
+ */
+void modbus_disconnect(modbus_t *mb)
+{
+    if (mb->s >= 0)
+        close(mb->s);
+    mb->s = -1;
+    mb->rx_len = 0;
+}
+
+/**
+ * Sets how many requests the poller may keep in flight on this connection.
+ * Only the poller pipelines, modbus_read_registers always waits for its reply.
+ * @param mb modbus_type
+ * @param depth 1 to MODBUS_MAX_PIPELINE
+ */
+void modbus_set_pipeline(modbus_t *mb, int depth)
+{
+    if (depth < 1)
+        depth = 1;
+    if (depth > MODBUS_MAX_PIPELINE)
+        depth = MODBUS_MAX_PIPELINE;
+    mb->depth = depth;
+}
+
 /**
  * Builds MODBUS holding register request header
  * ADU = Additional Address + PDU + error check = Modbus frame = MAX 260 b
@@ -137,7 +263,7 @@ unsigned long getValue(modbus_regs rsp, unsigned short begin, unsigned short ind
     printBuffer(rsp, len);
 #endif
 
-    unsigned char offset = (indexAddress - begin) / 2 * 4;
+    unsigned int offset = (indexAddress - begin) * 2;
     modbus_regs copy_rsp = rsp;
     copy_rsp += MODBUS_DATA_OFFSET;
 
@@ -149,54 +275,156 @@ unsigned long getValue(modbus_regs rsp, unsigned short begin, unsigned short ind
     printBuffer(copy_rsp, len-MODBUS_DATA_OFFSET);
 #endif
 
-    return (copy_rsp[offset] << 24) | (copy_rsp[offset + 1] << 16) | (copy_rsp[offset + 2] << 8) | (copy_rsp[offset + 3]);
+    return ((unsigned long)copy_rsp[offset] << 24) | (copy_rsp[offset + 1] << 16) | (copy_rsp[offset + 2] << 8) | (copy_rsp[offset + 3]);
 }
 
 /**
- * Requests read register
- * @param *mb modbus_type
- * @param function function code, most of the times MODBUS_READ_HOLDING_REGISTERS
- * @param addr Address of the register
- * @param nb number of registers?
- * @return pointer to start of registers
+ * Monotonic clock in milliseconds
  */
-modbus_regs modbus_read_registers(modbus_t *mb, int addr, int qoc)
+long long modbus_now_ms(void)
 {
-    int rc, req_length;
-    uint8_t req[MODBUS_TCP_REQ_LENGTH];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    uint8_t *rsp = (uint8_t *)malloc(sizeof(uint8_t) * MODBUS_MAX_FRAME_LENGTH);
-    memset((void *)rsp, 0, sizeof(uint8_t) * MODBUS_MAX_FRAME_LENGTH);
+/**
+ * Timeout of a request attempt, doubled on every retry
+ * @param timeout_ms Timeout of the first attempt
+ * @param retry Number of the retry, 0 for the first attempt
+ */
+int modbus_retry_timeout(int timeout_ms, int retry)
+{
+    long long timeout = (long long)timeout_ms << (retry < 8 ? retry : 8);
+    return timeout > MODBUS_TIMEOUT_MS ? MODBUS_TIMEOUT_MS : (int)timeout;
+}
 
-    req_length = modbus_build_request_header(mb, MODBUS_READ_HOLDING_REGISTERS, addr, qoc, req);
+/**
+ * Delay before connecting again, doubled on every failure up to MODBUS_BACKOFF_MAX_MS.
+ * Half of it is random, so inverters that went away together don't all come back at once.
+ * @param failures Connects that failed in a row, 1 for the first
+ * @param random Any random number
+ */
+int modbus_backoff(int failures, unsigned int random)
+{
+    int shift = failures < 1 ? 0 : failures - 1;
+    long long delay = (long long)MODBUS_BACKOFF_MIN_MS << (shift < 16 ? shift : 16);
+    if (delay > MODBUS_BACKOFF_MAX_MS)
+        delay = MODBUS_BACKOFF_MAX_MS;
+    return (int)(delay / 2 + random % (delay / 2 + 1));
+}
+
+/**
+ * Checks whether a buffer starts with a complete Modbus TCP read response
+ * @param rsp Received bytes
+ * @param len Number of received bytes
+ * @return length of the frame, 0 when incomplete or -1 when it is no valid frame
+ */
+int modbus_frame_length(const uint8_t *rsp, int len)
+{
+    // Protocol identifier is always 0 for Modbus
+    if ((len > 2 && rsp[2] != 0) || (len > 3 && rsp[3] != 0))
+        return -1;
+
+    if (len < MODBUS_MBAP_LENGTH)
+        return 0;
+
+    // Length counts the unit identifier and the PDU
+    int length = (rsp[4] << 8) | rsp[5];
+    if (length < 3 || MODBUS_MBAP_LENGTH + length > MODBUS_MAX_FRAME_LENGTH)
+        return -1;
+
+    if (len > 7)
+    {
+        unsigned char func_code = rsp[7];
+        if ((func_code & 0x7F) != MODBUS_READ_HOLDING_REGISTERS && (func_code & 0x7F) != MODBUS_READ_INPUT_REGISTERS)
+            return -1;
+        // Exception: unit ID, function code, exception code
+        if ((func_code & 0x80) && length != 3)
+            return -1;
+        // Registers: unit ID, function code, byte count, data
+        if (!(func_code & 0x80) && len > 8 && length != 3 + rsp[8])
+            return -1;
+    }
+
+    if (len < MODBUS_MBAP_LENGTH + length)
+        return 0;
+
+    return MODBUS_MBAP_LENGTH + length;
+}
+
+/**
+ * Reads what is available on the socket into the receive buffer
+ * @return like recv(): bytes received, 0 when closed, -1 on error
+ */
+int modbus_recv(modbus_t *mb)
+{
+    // A full buffer must contain garbage, frames are consumed as they complete
+    if (mb->rx_len == MODBUS_RX_BUFFER)
+        modbus_consume(mb, MODBUS_MAX_FRAME_LENGTH);
+
+    int rc = recv(mb->s, (char *)mb->rx + mb->rx_len, MODBUS_RX_BUFFER - mb->rx_len, 0);
+    if (rc > 0)
+        mb->rx_len += rc;
+
+    return rc;
+}
+
+/**
+ * Finds the next complete frame in the receive buffer.
+ * Bytes that can't be the start of a frame (like SMA's lone 0xFF) are dropped
+ * until the stream is in sync again.
+ * @return length of the frame at mb->rx, 0 when no complete frame yet
+ */
+int modbus_next_frame(modbus_t *mb)
+{
+    for (;;)
+    {
+        int len = modbus_frame_length(mb->rx, mb->rx_len);
+        if (len >= 0)
+            return len;
 
 #if DEBUG
-    printf("Sending\t\t");
-    printBuffer(rsp, req_length);
+        fprintf(stderr, "modbus: %s dropping stray byte 0x%.2X\n", mb->ip, mb->rx[0]);
 #endif
+        modbus_consume(mb, 1);
+        mb->stray++;
+    }
+}
 
-    /**
-     * Send Modbus packet
-     */
-    rc = send(mb->s, req, req_length, 0);
-    if (rc <= 0)
+/**
+ * Removes bytes from the start of the receive buffer
+ */
+void modbus_consume(modbus_t *mb, int len)
+{
+    if (len > mb->rx_len)
+        len = mb->rx_len;
+    memmove(mb->rx, mb->rx + len, mb->rx_len - len);
+    mb->rx_len -= len;
+}
+
+/**
+ * Validates a read response: transaction ID and Modbus exceptions
+ * @param mb modbus_type
+ * @param rsp Complete response frame
+ * @param len Length of the frame
+ * @param tid Transaction ID of the request
+ * @return 0 when the response holds registers, -1 otherwise
+ */
+int modbus_check_response(modbus_t *mb, const uint8_t *rsp, int len, unsigned short tid)
+{
+    if (len < MODBUS_DATA_OFFSET)
     {
-        // An error occured on the socket level
-        fprintf(stderr, "modbus: send failed\n");
-        return NULL;
+        fprintf(stderr, "read_registers: Short response from %s\n", mb->ip);
+        return -1;
     }
 
-    /**
-     * Receive packet
-     */
-    int rb = _modbus_receive(mb, rsp, MODBUS_MAX_FRAME_LENGTH);
-    if (rb <= 0)
+    unsigned short rsp_tid = (rsp[0] << 8) | rsp[1];
+    if (rsp_tid != tid)
     {
-        fprintf(stderr, "modbus: read abort\n");
-        return NULL;
+        fprintf(stderr, "read_registers: Unexpected transaction %d from %s, expected %d\n", rsp_tid, mb->ip, tid);
+        return -1;
     }
-    // Little hack:  Set first byte to number of received bytes
-    rsp[0] = rb & 0x000000FF;
 
     /**
      * Decode Function code
@@ -204,12 +432,12 @@ modbus_regs modbus_read_registers(modbus_t *mb, int addr, int qoc)
     unsigned char func_code = rsp[7];
 
 #if DEBUG
-    printf("read_registers: Received %d bytes: function code: %d\n", rb, func_code);
+    printf("read_registers: Received %d bytes: function code: %d\n", len, func_code);
 #endif
     // Exception Function code MSB bit = 1 = 0x80 higher
     if ((func_code >> 7) == 0x01)
     {
-        switch (func_code & 0x0F)
+        switch (rsp[8])
         {
         case MODBUS_EXCEPTION_ILLEGAL_FUNCTION:
             printf("read_registers: Illegal function\n");
@@ -220,91 +448,211 @@ modbus_regs modbus_read_registers(modbus_t *mb, int addr, int qoc)
         case MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE:
             printf("read_registers: Illegal Data Value\n");
             break;
+        case MODBUS_EXCEPTION_GATEWAY_PATH:
+            printf("read_registers: Gateway path unavailable for unit %d\n", rsp[6]);
+            break;
+        case MODBUS_EXCEPTION_GATEWAY_TARGET:
+            printf("read_registers: Unit %d behind the gateway did not respond\n", rsp[6]);
+            break;
         default:
-            printf("read_registers: Illegal error : %d\n", func_code);
+            printf("read_registers: Illegal error : %d\n", rsp[8]);
         }
-        return NULL;
+        return -1;
     }
 
+    return 0;
+}
+
+/**
+ * Requests read register into a buffer owned by the caller
+ * @param *mb modbus_type
+ * @param addr Address of the register
+ * @param qoc number of registers
+ * @param rsp Buffer the response frame is copied into
+ * @param rsp_length Size of rsp, MODBUS_MAX_FRAME_LENGTH is always enough
+ * @return length of the response frame, -1 when failed
+ */
+int modbus_read_registers_into(modbus_t *mb, int addr, int qoc, uint8_t *rsp, int rsp_length)
+{
+    int rc, req_length;
+    uint8_t req[MODBUS_TCP_REQ_LENGTH];
+
+    for (int retry = 0; retry <= RETRIES; retry++)
+    {
+        req_length = modbus_build_request_header(mb, MODBUS_READ_HOLDING_REGISTERS, addr, qoc, req);
+
+#if DEBUG
+        flockfile(stdout);
+        printf("Sending\t\t");
+        printBuffer(req, req_length);
+        funlockfile(stdout);
+#endif
+
+        /**
+         * Send Modbus packet
+         */
+        rc = send(mb->s, req, req_length, MSG_NOSIGNAL);
+        if (rc <= 0)
+        {
+            // An error occured on the socket level
+            fprintf(stderr, "modbus: send failed\n");
+            return -1;
+        }
+
+        /**
+         * Receive packet, resend with a longer timeout when none arrives
+         */
+        long long deadline = modbus_now_ms() + modbus_retry_timeout(MODBUS_RETRY_TIMEOUT_MS, retry);
+        int rb = _modbus_receive(mb, mb->transaction_id, deadline);
+        if (rb == 0)
+        {
+            fprintf(stderr, "modbus: read abort\n");
+            return -1;
+        }
+        if (rb < 0)
+        {
+#if DEBUG
+            fprintf(stderr, "modbus: read register failed. Retrying %d\n", retry);
+#endif
+            continue;
+        }
+
+        if (rb > rsp_length || modbus_check_response(mb, mb->rx, rb, mb->transaction_id) != 0)
+        {
+            modbus_consume(mb, rb);
+            return -1;
+        }
+
+        memcpy(rsp, mb->rx, rb);
+        modbus_consume(mb, rb);
+
 #if DEBUG
-    printf("Received\t");
-    printBuffer(rsp, rb);
+        flockfile(stdout);
+        printf("Received\t");
+        printBuffer(rsp, rb);
+        funlockfile(stdout);
 #endif
+        return rb;
+    }
+
+    fprintf(stderr, "modbus: read abort\n");
+    return -1;
+}
+
+/**
+ * Requests read register
+ * The response lives in a buffer borrowed from the connection,
+ * hand it back with modbus_free_registers.
+ * @param *mb modbus_type
+ * @param addr Address of the register
+ * @param qoc number of registers
+ * @return pointer to start of registers, NULL when failed or all buffers are lent out
+ */
+modbus_regs modbus_read_registers(modbus_t *mb, int addr, int qoc)
+{
+    int slot = 0;
+    while (slot < MODBUS_POOL_SIZE && (mb->pool_used & (1 << slot)))
+        slot++;
+
+    if (slot == MODBUS_POOL_SIZE)
+    {
+        fprintf(stderr, "modbus: all response buffers of %s in use\n", mb->ip);
+        return NULL;
+    }
+
+    uint8_t *rsp = mb->pool[slot];
+    int rb = modbus_read_registers_into(mb, addr, qoc, rsp, MODBUS_MAX_FRAME_LENGTH);
+    if (rb < 0)
+    {
+        return NULL;
+    }
+
+    // Little hack:  Set first byte to number of received bytes
+    rsp[0] = rb & 0x000000FF;
+
+    mb->pool_used |= 1 << slot;
     return rsp;
 }
 
 /**
- * Handles receiving and retries.
- * Modifies the rsp parameter with the response.
+ * Waits for the response to a request.
+ * The frame is left at the start of mb->rx, responses to older requests are dropped.
  * @param mb modbus_type
- * @param *rsp Reponse buffer
- * @param rsp_length Length of the buffer
- * @return number of received bytes, -1 when failed or 0 when connection closed
+ * @param tid Transaction ID of the request
+ * @param deadline Monotonic ms at which to give up
+ * @return length of the frame, -1 when timed out or failed or 0 when connection closed
  */
-int _modbus_receive(modbus_t *mb, uint8_t *rsp, int rsp_length)
+int _modbus_receive(modbus_t *mb, unsigned short tid, long long deadline)
 {
-    int rc = 0;
-
     struct pollfd pfds[1];
     pfds[0].fd = mb->s;
     pfds[0].events = POLLIN;
 
-    /**
-     * Retry algorithm
-     */
-    int retry = 0;
-    for (; retry <= RETRIES; retry++)
+    for (;;)
     {
-
-        int num_events = poll(pfds, 1, 5000);
-        if (num_events == 0)
+        int len = modbus_next_frame(mb);
+        if (len > 0)
         {
-            printf("read_registers: write poll timed out!\n");
-            // Consider as fail, retry
+            if (((mb->rx[0] << 8) | mb->rx[1]) == tid)
+                return len;
+
+            // Late response to an earlier attempt
+            modbus_consume(mb, len);
             continue;
         }
 
-        if (!(pfds[0].revents & POLLIN))
+        long long remaining = deadline - modbus_now_ms();
+        if (remaining <= 0)
         {
-            fprintf(stderr, "read_registers: poll failed!\n");
+            printf("read_registers: poll timed out!\n");
+            return -1;
+        }
+
+        int num_events = poll(pfds, 1, (int)remaining);
+        if (num_events == 0)
             continue;
+
+        if (num_events < 0 || !(pfds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            if (num_events < 0 && errno == EINTR)
+                continue;
+            fprintf(stderr, "read_registers: poll failed!\n");
+            return -1;
         }
 
-        rc = recv(mb->s, (char *)rsp, rsp_length, 0);
+        int rc = modbus_recv(mb);
         if (rc == 0)
         {
             fprintf(stderr, "modbus: Connection was closed\n");
             return 0;
         }
-
-        //! WARN: IDK why, but I continously receive only 1 byte 0xFF, so consider as fail
-        if (rc <= 1)
+        if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
         {
-#if DEBUG
-            // Error or timeout
-            fprintf(stderr, "modbus: read register failed. Retrying %d\n", retry);
-#endif
-            // SMA's bullshit implementation
-            sleep(MODBUS_SMA_WAIT);
-            continue;
+            fprintf(stderr, "modbus: recv failed\n");
+            return -1;
         }
-        // Reaching here means that we successfully received data
-        break;
     }
-
-    if (retry >= RETRIES)
-        return -1;
-        
-    // Return number of received bytes
-    return rc;
 }
 
-void modbus_free_registers(modbus_regs regs)
+/**
+ * Hands a buffer from modbus_read_registers back to the connection
+ */
+void modbus_free_registers(modbus_t *mb, modbus_regs regs)
 {
-    free(regs);
+    if (regs == NULL)
+        return;
+
+    int slot = (regs - &mb->pool[0][0]) / MODBUS_MAX_FRAME_LENGTH;
+    if (slot >= 0 && slot < MODBUS_POOL_SIZE)
+        mb->pool_used &= ~(1 << slot);
 }
 
+/**
+ * Closes the connection and frees the modbus type
+ */
 void modbus_close(modbus_t *t)
 {
-    close(t->s);
+    modbus_disconnect(t);
+    free(t->ip);
+    free(t);
 }
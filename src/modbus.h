@@ -13,15 +13,45 @@ typedef unsigned short uint16_t;
 #define MODBUS_MAX_FRAME_LENGTH 260
 #define MODBUS_TCP_REQ_LENGTH 12
 #define MODBUS_DATA_OFFSET 9
+#define MODBUS_MBAP_LENGTH 6
 
-// How many seconds to wait before attemping again 
-#define MODBUS_SMA_WAIT 1
+// Max number of requests in flight on one connection
+#define MODBUS_MAX_PIPELINE 8
+
+// Receive buffer per connection, room for a few pipelined responses
+#define MODBUS_RX_BUFFER (MODBUS_MAX_FRAME_LENGTH * 4)
+
+// Number of response buffers modbus_read_registers can lend out per connection
+#define MODBUS_POOL_SIZE 4
+
+// How long to wait for the first attempt of a request in milliseconds,
+// doubled on every retry up to MODBUS_TIMEOUT_MS
+#define MODBUS_RETRY_TIMEOUT_MS 1000
+#define MODBUS_TIMEOUT_MS 5000
+
+// How long a non-blocking connect may take in milliseconds
+#define MODBUS_CONNECT_TIMEOUT_MS 3000
+
+// Delay before connecting again after a failed connect in milliseconds,
+// doubled on every failure in a row up to MODBUS_BACKOFF_MAX_MS
+#define MODBUS_BACKOFF_MIN_MS 1000
+#define MODBUS_BACKOFF_MAX_MS 60000
+
+// Failed connects in a row after which an inverter is reported down
+#define MODBUS_DOWN_AFTER 5
+
+// TCP keepalive: probe an idle connection after IDLE s, every INTERVAL s, COUNT times
+#define MODBUS_KEEPALIVE_IDLE 30
+#define MODBUS_KEEPALIVE_INTERVAL 10
+#define MODBUS_KEEPALIVE_COUNT 3
 
 enum
 {
     MODBUS_EXCEPTION_ILLEGAL_FUNCTION       = 0x01,
     MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS   = 0x02,
     MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE     = 0x03,
+    MODBUS_EXCEPTION_GATEWAY_PATH           = 0x0A,
+    MODBUS_EXCEPTION_GATEWAY_TARGET         = 0x0B,
 };
 
 typedef struct
@@ -30,9 +60,19 @@ typedef struct
 
     unsigned char slave;
     unsigned short transaction_id;
+    unsigned char depth;    // Requests kept in flight, 1 = no pipelining
 
     char *ip;
     unsigned short port;
+
+    // Received bytes not yet consumed as a frame
+    uint8_t rx[MODBUS_RX_BUFFER];
+    int rx_len;
+    unsigned long stray;    // Bytes dropped while resyncing
+
+    // Response buffers lent out by modbus_read_registers
+    uint8_t pool[MODBUS_POOL_SIZE][MODBUS_MAX_FRAME_LENGTH];
+    unsigned char pool_used;    // Bit per buffer
 } modbus_t;
 
 typedef uint8_t *modbus_regs;
@@ -40,11 +80,25 @@ typedef uint8_t *modbus_regs;
 /**
  * Function predefinitions
  */
+modbus_t *modbus_new_tcp(const char *ip, unsigned short port);
+int modbus_connect_start(modbus_t *mb);
+int modbus_connect_finish(modbus_t *mb);
 modbus_t *modbus_connect_tcp(const char *ip, unsigned short port);
+void modbus_disconnect(modbus_t *mb);
 int modbus_build_request_header(modbus_t *mb, unsigned char function, unsigned short addr, unsigned short qoc, uint8_t *pkg);
 unsigned long getValue(modbus_regs regs, unsigned short begin, unsigned short indexAddress);
+void modbus_set_pipeline(modbus_t *mb, int depth);
+long long modbus_now_ms(void);
+int modbus_retry_timeout(int timeout_ms, int retry);
+int modbus_backoff(int failures, unsigned int random);
+int modbus_frame_length(const uint8_t *rsp, int len);
+int modbus_recv(modbus_t *mb);
+int modbus_next_frame(modbus_t *mb);
+void modbus_consume(modbus_t *mb, int len);
+int modbus_check_response(modbus_t *mb, const uint8_t *rsp, int len, unsigned short tid);
+int modbus_read_registers_into(modbus_t *mb, int addr, int qoc, uint8_t *rsp, int rsp_length);
 modbus_regs modbus_read_registers(modbus_t *mb, int addr, int qoc);
-void modbus_free_registers(modbus_regs regs);
+void modbus_free_registers(modbus_t *mb, modbus_regs regs);
 void modbus_close(modbus_t *t);
 
 #endif
@@ -0,0 +1,470 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "modbus_async.h"
+
+#define MB_REACTOR_MAX_EVENTS 64
+
+/**
+ * A connection as seen by the reactor, shared by all clients with the same modbus_t
+ */
+struct mb_conn
+{
+    modbus_t *mb;
+    int s;                      // Socket registered with epoll, -1 when none
+    int connecting;             // Connect in progress, reads queue up behind it
+    int inflight;               // Reads sent and not answered, at most mb->depth
+};
+
+struct mb_reactor
+{
+    int epfd;
+    mb_conn **conns;
+    int nconns;
+
+    // Everything coroutines wait for, in the order they started waiting
+    mb_await **waits;
+    int nwaits;
+    int size;
+
+    // Coroutines resumed at the end of a round, room for size
+    std::coroutine_handle<> *ready;
+};
+
+/**
+ * Creates the epoll instance the coroutines are driven from
+ */
+mb_reactor *mb_reactor_create(void)
+{
+    mb_reactor *r = (mb_reactor *)calloc(1, sizeof(mb_reactor));
+    r->epfd = epoll_create1(0);
+    if (r->epfd == -1)
+    {
+        fprintf(stderr, "modbus_async: epoll_create1 failed\n");
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+/**
+ * Finds the connection of a modbus_t
+ * @return connection, NULL when out of memory
+ */
+static mb_conn *mb_reactor_conn(mb_reactor *r, modbus_t *mb)
+{
+    for (int i = 0; i < r->nconns; i++)
+        if (r->conns[i]->mb == mb)
+            return r->conns[i];
+
+    mb_conn **conns = (mb_conn **)realloc(r->conns, sizeof(mb_conn *) * (r->nconns + 1));
+    if (conns == NULL)
+        return NULL;
+    r->conns = conns;
+
+    mb_conn *c = (mb_conn *)calloc(1, sizeof(mb_conn));
+    if (c == NULL)
+        return NULL;
+    c->mb = mb;
+    c->s = -1;
+    r->conns[r->nconns++] = c;
+    return c;
+}
+
+/**
+ * Watches the socket of a connection, registering it when it is new.
+ * Sockets connected elsewhere are switched to non-blocking mode.
+ * @param events EPOLLIN, or EPOLLOUT while connecting
+ */
+static int mb_reactor_watch(mb_reactor *r, mb_conn *c, unsigned int events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+
+    int op = EPOLL_CTL_MOD;
+    if (c->s != c->mb->s)
+    {
+        int flags = fcntl(c->mb->s, F_GETFL, 0);
+        fcntl(c->mb->s, F_SETFL, flags | O_NONBLOCK);
+        op = EPOLL_CTL_ADD;
+    }
+
+    if (epoll_ctl(r->epfd, op, c->mb->s, &ev) == -1 &&
+        (op != EPOLL_CTL_ADD || errno != EEXIST || epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->mb->s, &ev) == -1))
+    {
+        fprintf(stderr, "modbus_async: epoll_ctl failed for %s\n", c->mb->ip);
+        return -1;
+    }
+
+    c->s = c->mb->s;
+    return 0;
+}
+
+/**
+ * Adds a suspended coroutine to the waits
+ * @return true, false when out of memory and the coroutine goes on right away
+ */
+static bool mb_reactor_wait(mb_reactor *r, mb_await *w)
+{
+    if (r->nwaits == r->size)
+    {
+        int size = r->size ? r->size * 2 : 64;
+        mb_await **waits = (mb_await **)realloc(r->waits, sizeof(mb_await *) * size);
+        if (waits == NULL)
+        {
+            w->result = -1;
+            return false;
+        }
+        r->waits = waits;
+
+        std::coroutine_handle<> *ready = (std::coroutine_handle<> *)realloc((void *)r->ready, sizeof(std::coroutine_handle<>) * size);
+        if (ready == NULL)
+        {
+            w->result = -1;
+            return false;
+        }
+        r->ready = ready;
+        r->size = size;
+    }
+
+    r->waits[r->nwaits++] = w;
+    return true;
+}
+
+/**
+ * Ends a wait, the coroutine is resumed with result at the end of the round
+ */
+static void mb_reactor_finish(mb_await *w, int result)
+{
+    if (w->kind == MB_AWAIT_READ && w->sent)
+        w->conn->inflight--;
+    w->sent = 0;
+    w->finished = 1;
+    w->result = result;
+}
+
+/**
+ * Sends a read request, or resends it with a new transaction ID after a timeout
+ * @return 0, -1 when the connection failed
+ */
+static int mb_reactor_send(mb_await *w)
+{
+    modbus_t *mb = w->mb;
+    uint8_t req[MODBUS_TCP_REQ_LENGTH];
+
+    mb->slave = w->unit;
+    int req_length = modbus_build_request_header(mb, MODBUS_READ_HOLDING_REGISTERS, w->addr, w->qoc, req);
+    if (send(mb->s, req, req_length, MSG_NOSIGNAL) != req_length)
+    {
+        fprintf(stderr, "modbus: send failed\n");
+        return -1;
+    }
+
+    if (!w->sent)
+        w->conn->inflight++;
+    w->sent = 1;
+    w->tid = mb->transaction_id;
+    w->deadline = modbus_now_ms() + modbus_retry_timeout(MODBUS_RETRY_TIMEOUT_MS, w->retry);
+    return 0;
+}
+
+/**
+ * Drops a connection, everything waiting on it fails
+ */
+static void mb_reactor_lost(mb_reactor *r, mb_conn *c)
+{
+    modbus_disconnect(c->mb);
+    c->s = -1;
+    c->connecting = 0;
+
+    for (int i = 0; i < r->nwaits; i++)
+        if (r->waits[i]->conn == c && !r->waits[i]->finished)
+            mb_reactor_finish(r->waits[i], -1);
+}
+
+static bool mb_reactor_connect(mb_reactor *r, mb_await *w)
+{
+    // Ends with the connect already in progress
+    if (w->conn->connecting)
+    {
+        w->deadline = LLONG_MAX;
+        return mb_reactor_wait(r, w);
+    }
+
+    w->result = 0;
+    if (w->mb->s >= 0)
+        return false;
+
+    int rc = modbus_connect_start(w->mb);
+    if (rc == 0 && mb_reactor_watch(r, w->conn, EPOLLIN) == 0)
+        return false;
+    if (rc != 1 || mb_reactor_watch(r, w->conn, EPOLLOUT) != 0)
+    {
+        mb_reactor_lost(r, w->conn);
+        w->result = -1;
+        return false;
+    }
+
+    w->conn->connecting = 1;
+    w->deadline = modbus_now_ms() + MODBUS_CONNECT_TIMEOUT_MS;
+    return mb_reactor_wait(r, w);
+}
+
+static bool mb_reactor_read(mb_reactor *r, mb_await *w)
+{
+    w->result = -1;
+    if (w->mb->s < 0)
+        return false;
+    if (!w->conn->connecting && w->conn->s != w->mb->s && mb_reactor_watch(r, w->conn, EPOLLIN) != 0)
+        return false;
+
+    // Queued until the connection takes another request, see mb_reactor_send_queued
+    w->deadline = LLONG_MAX;
+    if (!w->conn->connecting && w->conn->inflight < w->mb->depth && mb_reactor_send(w) != 0)
+    {
+        mb_reactor_lost(r, w->conn);
+        return false;
+    }
+
+    return mb_reactor_wait(r, w);
+}
+
+/**
+ * Starts waiting, called by co_await
+ * @return true when suspended, false when the result is known right away
+ */
+bool mb_await::await_suspend(std::coroutine_handle<> handle)
+{
+    h = handle;
+    conn = NULL;
+    finished = 0;
+
+    if (kind == MB_AWAIT_SLEEP)
+    {
+        result = 0;
+        return deadline > modbus_now_ms() && mb_reactor_wait(r, this);
+    }
+
+    conn = mb_reactor_conn(r, mb);
+    if (conn == NULL)
+    {
+        result = -1;
+        return false;
+    }
+
+    return kind == MB_AWAIT_CONNECT ? mb_reactor_connect(r, this) : mb_reactor_read(r, this);
+}
+
+/**
+ * Waits until a monotonic time, see modbus_now_ms
+ */
+mb_await mb_sleep_until(mb_reactor *r, long long due_ms)
+{
+    return {r, MB_AWAIT_SLEEP, NULL, NULL, {}, 0, 0, 0, NULL, 0, 0, 0, due_ms, 0, 0};
+}
+
+/**
+ * Finishes a connect that was in progress, reads queued behind it go out next
+ */
+static void mb_reactor_connected(mb_reactor *r, mb_conn *c)
+{
+    c->connecting = 0;
+    if (modbus_connect_finish(c->mb) != 0 || mb_reactor_watch(r, c, EPOLLIN) != 0)
+    {
+        fprintf(stderr, "modbus_async: connect to %s failed\n", c->mb->ip);
+        mb_reactor_lost(r, c);
+        return;
+    }
+
+    for (int i = 0; i < r->nwaits; i++)
+        if (r->waits[i]->conn == c && r->waits[i]->kind == MB_AWAIT_CONNECT && !r->waits[i]->finished)
+            mb_reactor_finish(r->waits[i], 0);
+}
+
+/**
+ * Reads what arrived on a connection and hands the responses to their reads
+ */
+static void mb_reactor_receive(mb_reactor *r, mb_conn *c)
+{
+    modbus_t *mb = c->mb;
+
+    int rc = modbus_recv(mb);
+    if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        fprintf(stderr, rc == 0 ? "modbus: Connection was closed\n" : "modbus: recv failed\n");
+        mb_reactor_lost(r, c);
+        return;
+    }
+
+    int len;
+    while ((len = modbus_next_frame(mb)) > 0)
+    {
+        unsigned short tid = (mb->rx[0] << 8) | mb->rx[1];
+        for (int i = 0; i < r->nwaits; i++)
+        {
+            mb_await *w = r->waits[i];
+            if (w->conn != c || !w->sent || w->tid != tid)
+                continue;
+
+            // Late responses to earlier attempts match no read and are dropped
+            if (len > MODBUS_MAX_FRAME_LENGTH || modbus_check_response(mb, mb->rx, len, tid) != 0)
+                mb_reactor_finish(w, -1);
+            else
+            {
+                memcpy(w->rsp, mb->rx, len);
+                mb_reactor_finish(w, len);
+            }
+            break;
+        }
+
+        modbus_consume(mb, len);
+    }
+}
+
+/**
+ * Resends reads that timed out, gives up on them after RETRIES and ends
+ * connects and sleeps that are due
+ */
+static void mb_reactor_check_timers(mb_reactor *r)
+{
+    long long now = modbus_now_ms();
+
+    for (int i = 0; i < r->nwaits; i++)
+    {
+        mb_await *w = r->waits[i];
+        if (w->finished || w->deadline > now)
+            continue;
+
+        if (w->kind == MB_AWAIT_SLEEP)
+            mb_reactor_finish(w, 0);
+        else if (w->kind == MB_AWAIT_CONNECT)
+        {
+            fprintf(stderr, "modbus_async: connect to %s timed out\n", w->mb->ip);
+            mb_reactor_lost(r, w->conn);
+        }
+        else if (w->retry >= RETRIES)
+        {
+            fprintf(stderr, "modbus: read abort\n");
+            mb_reactor_finish(w, -1);
+        }
+        else
+        {
+            w->retry++;
+            if (mb_reactor_send(w) != 0)
+                mb_reactor_lost(r, w->conn);
+        }
+    }
+}
+
+/**
+ * Sends queued reads of connections that take another request, oldest first
+ */
+static void mb_reactor_send_queued(mb_reactor *r)
+{
+    for (int i = 0; i < r->nwaits; i++)
+    {
+        mb_await *w = r->waits[i];
+        if (w->kind != MB_AWAIT_READ || w->sent || w->finished)
+            continue;
+        if (w->conn->connecting || w->conn->inflight >= w->mb->depth)
+            continue;
+        if (mb_reactor_send(w) != 0)
+            mb_reactor_lost(r, w->conn);
+    }
+}
+
+/**
+ * How long epoll may wait until the next deadline
+ */
+static int mb_reactor_timeout(mb_reactor *r)
+{
+    long long next = LLONG_MAX;
+    for (int i = 0; i < r->nwaits; i++)
+        if (r->waits[i]->deadline < next)
+            next = r->waits[i]->deadline;
+
+    if (next == LLONG_MAX)
+        return -1;
+    long long remaining = next - modbus_now_ms();
+    return remaining < 0 ? 0 : (int)remaining;
+}
+
+/**
+ * Drives the coroutines until none of them waits anymore
+ * @return 0, -1 when epoll failed
+ */
+int mb_reactor_run(mb_reactor *r)
+{
+    struct epoll_event events[MB_REACTOR_MAX_EVENTS];
+
+    while (r->nwaits > 0)
+    {
+        int n = epoll_wait(r->epfd, events, MB_REACTOR_MAX_EVENTS, mb_reactor_timeout(r));
+        if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "modbus_async: epoll_wait failed\n");
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            mb_conn *c = (mb_conn *)events[i].data.ptr;
+            if (c->s < 0)
+                continue;
+            if (c->connecting)
+                mb_reactor_connected(r, c);
+            else
+                mb_reactor_receive(r, c);
+        }
+
+        mb_reactor_check_timers(r);
+        mb_reactor_send_queued(r);
+
+        // Resumed coroutines may start waiting again, so take the finished out first
+        int nready = 0, kept = 0;
+        for (int i = 0; i < r->nwaits; i++)
+        {
+            if (r->waits[i]->finished)
+                r->ready[nready++] = r->waits[i]->h;
+            else
+                r->waits[kept++] = r->waits[i];
+        }
+        r->nwaits = kept;
+
+        for (int i = 0; i < nready; i++)
+        {
+            std::coroutine_handle<> h = r->ready[i];
+            h.resume();
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the reactor, coroutines still waiting are destroyed.
+ * Connections stay open, they belong to the caller.
+ */
+void mb_reactor_destroy(mb_reactor *r)
+{
+    for (int i = 0; i < r->nwaits; i++)
+        r->waits[i]->h.destroy();
+    for (int i = 0; i < r->nconns; i++)
+        free(r->conns[i]);
+
+    close(r->epfd);
+    free(r->conns);
+    free(r->waits);
+    free((void *)r->ready);
+    free(r);
+}
@@ -0,0 +1,105 @@
+#ifndef MODBUS_ASYNC_H
+#define MODBUS_ASYNC_H
+
+#include <coroutine>
+#include <exception>
+
+#include "modbus.h"
+
+/**
+ * Coroutine API on top of the Modbus framing in modbus.cpp.
+ * A reactor drives any number of coroutines on one thread, each written as
+ * straight-line code:
+ *
+ *   mb_task pollInverter(mb_client *c)
+ *   {
+ *       if (co_await c->connect() != 0)
+ *           co_return;
+ *       int len = co_await c->read(30201, 2);
+ *       ...
+ *   }
+ *
+ *   mb_reactor *r = mb_reactor_create();
+ *   pollInverter(&client);    // Runs until its first co_await
+ *   mb_reactor_run(r);        // Until no coroutine is waiting anymore
+ */
+
+typedef struct mb_reactor mb_reactor;
+typedef struct mb_conn mb_conn;
+
+/**
+ * A coroutine run by the reactor. It starts right away and frees itself when
+ * it returns, it can only wait for mb_await.
+ */
+struct mb_task
+{
+    struct promise_type
+    {
+        mb_task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+enum
+{
+    MB_AWAIT_CONNECT,
+    MB_AWAIT_READ,
+    MB_AWAIT_SLEEP,
+};
+
+/**
+ * Something a coroutine waits for, co_await gives its result:
+ * connect 0 or -1, read the length of the response frame or -1, sleep 0.
+ * Lives in the frame of the waiting coroutine, the reactor only points to it.
+ */
+struct mb_await
+{
+    mb_reactor *r;
+    int kind;
+    modbus_t *mb;
+    mb_conn *conn;
+    std::coroutine_handle<> h;
+
+    unsigned char unit;
+    int addr;
+    int qoc;
+    uint8_t *rsp;               // MODBUS_MAX_FRAME_LENGTH bytes for the response
+
+    int sent;                   // Request is on the wire, else queued behind mb->depth others
+    int retry;
+    unsigned short tid;
+    long long deadline;         // Monotonic ms at which waiting ends
+    int finished;               // Resumed with result in the next round of the reactor
+    int result;
+
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle);
+    int await_resume() const noexcept { return result; }
+};
+
+/**
+ * An inverter polled from a coroutine, several may share one modbus_t
+ */
+struct mb_client
+{
+    mb_reactor *r;
+    modbus_t *mb;
+    unsigned char unit;         // Modbus unit ID of the inverter
+    uint8_t rsp[MODBUS_MAX_FRAME_LENGTH]; // Response to the last read
+
+    mb_await connect() { return {r, MB_AWAIT_CONNECT, mb, NULL, {}, unit, 0, 0, NULL, 0, 0, 0, 0, 0, 0}; }
+    mb_await read(int addr, int qoc) { return {r, MB_AWAIT_READ, mb, NULL, {}, unit, addr, qoc, rsp, 0, 0, 0, 0, 0, 0}; }
+};
+
+/**
+ * Function predefinitions
+ */
+mb_reactor *mb_reactor_create(void);
+mb_await mb_sleep_until(mb_reactor *r, long long due_ms);
+int mb_reactor_run(mb_reactor *r);
+void mb_reactor_destroy(mb_reactor *r);
+
+#endif
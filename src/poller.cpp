@@ -0,0 +1,995 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef IO_URING
+#include <poll.h>
+#endif
+
+#include "poller.h"
+
+#ifdef IO_URING
+enum
+{
+    POLLER_OP_RECV,
+    POLLER_OP_SEND,
+    POLLER_OP_CONNECT,
+    POLLER_OP_CANCEL,
+};
+
+// user_data of a ring operation: connection, operation and the connect it belongs to
+#define POLLER_TAG(c, op) ((unsigned long long)(c)->index | (unsigned long long)(op) << 32 | (unsigned long long)((c)->gen & 0xFFFFFF) << 40)
+#endif
+
+/**
+ * Creates the epoll instance all inverters are driven from
+ * @param timeout_ms How long to wait for the first attempt of a request,
+ *                   doubled on every retry up to MODBUS_TIMEOUT_MS
+ */
+poller_t *poller_create(int timeout_ms)
+{
+    poller_t *p = (poller_t *)malloc(sizeof(poller_t));
+    memset(p, 0, sizeof(poller_t));
+
+    p->timeout_ms = timeout_ms;
+    p->seed = (unsigned int)time(NULL) ^ (unsigned int)(long)p;
+    p->epfd = epoll_create1(0);
+    if (p->epfd == -1)
+    {
+        fprintf(stderr, "poller: epoll_create1 failed\n");
+        free(p);
+        return NULL;
+    }
+
+#ifdef IO_URING
+    // Docker's default seccomp profile filters io_uring out, epoll works everywhere
+    p->uring = uring_init(&p->ring, URING_ENTRIES) == 0;
+    if (!p->uring)
+        fprintf(stderr, "poller: io_uring unavailable (%s), using epoll\n", strerror(errno));
+#endif
+
+    return p;
+}
+
+#ifdef IO_URING
+/**
+ * Receives into the free end of the receive buffer, one receive per connection
+ * @return 0, -1 when the ring is full
+ */
+static int poller_arm_recv(poller_t *p, poll_conn *c)
+{
+    modbus_t *mb = c->mb;
+
+    // A full buffer must contain garbage, frames are consumed as they complete
+    if (mb->rx_len == MODBUS_RX_BUFFER)
+        modbus_consume(mb, MODBUS_MAX_FRAME_LENGTH);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&p->ring, POLLER_TAG(c, POLLER_OP_RECV));
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "poller: io_uring full, can't receive from %s\n", mb->ip);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = mb->s;
+    sqe->addr = (unsigned long long)(mb->rx + mb->rx_len);
+    sqe->len = MODBUS_RX_BUFFER - mb->rx_len;
+    c->recv_off = mb->rx_len;
+    return 0;
+}
+
+/**
+ * Waits until a connect in progress finished, like EPOLLOUT
+ * @return 0, -1 when the ring is full
+ */
+static int poller_arm_connect(poller_t *p, poll_conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&p->ring, POLLER_TAG(c, POLLER_OP_CONNECT));
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "poller: io_uring full, can't connect to %s\n", c->mb->ip);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->mb->s;
+    sqe->poll32_events = POLLOUT;
+    return 0;
+}
+#endif
+
+/**
+ * Watches the socket of a connection
+ * @param op EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ * @param events EPOLLIN, or EPOLLOUT while connecting
+ */
+static int poller_watch(poller_t *p, poll_conn *c, int op, unsigned int events)
+{
+#ifdef IO_URING
+    if (p->uring)
+        return events == EPOLLOUT ? poller_arm_connect(p, c) : poller_arm_recv(p, c);
+#endif
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(p->epfd, op, c->mb->s, &ev) == -1)
+    {
+        fprintf(stderr, "poller: epoll_ctl failed for %s\n", c->mb->ip);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the link state of a connection, the metrics of its devices follow it
+ */
+static void poller_link(poll_conn *c, int link)
+{
+    c->link = link;
+    for (int i = 0; i < c->ndevs; i++)
+        if (c->devs[i]->metrics)
+            __atomic_store_n(&c->devs[i]->metrics->link, link, __ATOMIC_RELAXED);
+}
+
+/**
+ * Finds the connection of a device, devices with the same modbus_t share one
+ * @return connection, NULL when out of memory
+ */
+static poll_conn *poller_conn(poller_t *p, poll_device *dev)
+{
+    for (int i = 0; dev->mb != NULL && i < p->nconns; i++)
+        if (p->conns[i]->mb == dev->mb)
+            return p->conns[i];
+
+    poll_conn **conns = (poll_conn **)realloc(p->conns, sizeof(poll_conn *) * (p->nconns + 1));
+    if (conns == NULL)
+        return NULL;
+    p->conns = conns;
+
+    poll_conn *c = (poll_conn *)calloc(1, sizeof(poll_conn));
+    c->mb = dev->mb;
+    c->link = LINK_BACKOFF;
+#ifdef IO_URING
+    c->index = p->nconns;
+#endif
+    p->conns[p->nconns++] = c;
+
+    // Connected by the caller, only for the first device of a connection
+    if (c->mb != NULL && c->mb->s >= 0)
+    {
+        int flags = fcntl(c->mb->s, F_GETFL, 0);
+        fcntl(c->mb->s, F_SETFL, flags | O_NONBLOCK);
+
+        c->link = LINK_UP;
+        c->received = modbus_now_ms();
+        if (poller_watch(p, c, EPOLL_CTL_ADD, EPOLLIN) != 0)
+            return NULL;
+    }
+
+    return c;
+}
+
+/**
+ * Registers an inverter. Its socket is switched to non-blocking mode.
+ * Inverters with the same mb are polled over one connection, each with its own unit.
+ * An inverter that isn't connected is connected by the first cycle it is polled in.
+ * @param dev Device, must outlive the poller
+ * @return 0 on success, -1 when failed
+ */
+int poller_add(poller_t *p, poll_device *dev)
+{
+    poll_device **devs = (poll_device **)realloc(p->devs, sizeof(poll_device *) * (p->ndevs + 1));
+    if (devs == NULL)
+        return -1;
+    p->devs = devs;
+
+    poll_conn *c = poller_conn(p, dev);
+    if (c == NULL)
+        return -1;
+
+    devs = (poll_device **)realloc(c->devs, sizeof(poll_device *) * (c->ndevs + 1));
+    if (devs == NULL)
+        return -1;
+    c->devs = devs;
+    c->devs[c->ndevs++] = dev;
+
+    p->devs[p->ndevs++] = dev;
+    dev->conn = c;
+    if (c->mb != NULL)
+        c->depth = c->mb->depth;
+    dev->state = POLL_IDLE;
+    poller_link(c, c->link);
+
+    // No connection at all, will be reported as failed every cycle
+    return 0;
+}
+
+static void poller_finish(poll_device *dev, int state)
+{
+    dev->state = state;
+    dev->finished = modbus_now_ms();
+
+    if (state == POLL_DONE)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        dev->timestamp = (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    if (dev->metrics)
+    {
+        metrics_inc(state == POLL_DONE ? &dev->metrics->polls_ok : &dev->metrics->polls_failed, 1);
+        if (state == POLL_DONE)
+            metrics_observe(&dev->metrics->poll, (dev->finished - dev->started) * 1000);
+    }
+}
+
+/**
+ * Gives up on the cycle of a device.
+ * Its requests in flight stay until answered or timed out, so the connection
+ * doesn't take more requests than it can handle.
+ */
+static void poller_fail(poll_device *dev)
+{
+    memset(dev->pending, 0, sizeof(dev->pending));
+    if (dev->state == POLL_BUSY)
+        poller_finish(dev, POLL_FAILED);
+}
+
+/**
+ * Frees the slot of a request that was answered or given up on
+ */
+static void poller_release(poll_device *dev, poll_request *req)
+{
+    req->active = 0;
+    dev->ninflight--;
+    dev->conn->ninflight--;
+}
+
+/**
+ * Schedules the next connect of a connection that isn't connected
+ * @param failed 1 when connecting failed, 0 when a working connection was lost
+ */
+static void poller_backoff(poller_t *p, poll_conn *c, int failed)
+{
+    long long now = modbus_now_ms();
+
+    // The inverter was there a moment ago, try again in the next cycle
+    if (!failed)
+    {
+        c->failures = 0;
+        c->retry_at = now;
+        poller_link(c, LINK_BACKOFF);
+        return;
+    }
+
+    for (int i = 0; i < c->ndevs; i++)
+        if (c->devs[i]->metrics)
+            metrics_inc(&c->devs[i]->metrics->connect_failures, 1);
+
+    int delay = modbus_backoff(++c->failures, rand_r(&p->seed));
+    c->retry_at = now + delay;
+
+    if (c->failures == 1)
+        fprintf(stderr, "poller: Can't connect to %s:%d: %s, retrying in %d ms\n", c->mb->ip, c->mb->port, strerror(errno), delay);
+
+    if (c->failures >= MODBUS_DOWN_AFTER)
+    {
+        if (c->link != LINK_DOWN)
+            fprintf(stderr, "poller: %s:%d is down, retrying every %d s at most\n", c->mb->ip, c->mb->port, MODBUS_BACKOFF_MAX_MS / 1000);
+        poller_link(c, LINK_DOWN);
+    }
+    else
+        poller_link(c, LINK_BACKOFF);
+}
+
+/**
+ * Closes a connection that failed or was never established,
+ * all devices polled over it fail this cycle
+ * @param failed 1 when connecting failed, 0 when a working connection was lost
+ */
+static void poller_lost(poller_t *p, poll_conn *c, int failed)
+{
+    int err = errno;
+
+#ifdef IO_URING
+    // Cancels its receive or connect, what completes for it from now on is stale
+    if (p->uring && c->mb->s >= 0)
+    {
+        struct io_uring_sqe *sqe = uring_get_sqe(&p->ring, POLLER_TAG(c, POLLER_OP_CANCEL));
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = POLLER_TAG(c, c->link == LINK_CONNECTING ? POLLER_OP_CONNECT : POLLER_OP_RECV);
+        }
+        c->gen++;
+    }
+    else
+#endif
+    if (c->mb->s >= 0)
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, c->mb->s, NULL);
+    modbus_disconnect(c->mb);
+
+    for (int i = 0; i < c->ndevs; i++)
+    {
+        poll_device *dev = c->devs[i];
+        memset(dev->inflight, 0, sizeof(dev->inflight));
+        dev->ninflight = 0;
+        poller_fail(dev);
+    }
+    c->ninflight = 0;
+
+    errno = err;
+    poller_backoff(p, c, failed);
+}
+
+/**
+ * Falls back to one request at a time for connections that can't handle pipelining,
+ * until the next connect. All requests in flight but keep are cancelled and requested again later.
+ * @param keep Request to keep in flight, may be NULL
+ */
+static void poller_no_pipeline(poll_conn *c, poll_request *keep)
+{
+    if (c->mb->depth <= 1)
+        return;
+
+    fprintf(stderr, "poller: %s does not handle pipelined requests, falling back to depth 1\n", c->mb->ip);
+    c->mb->depth = 1;
+
+    for (int d = 0; d < c->ndevs; d++)
+    {
+        poll_device *dev = c->devs[d];
+        for (int i = 0; i < MODBUS_MAX_PIPELINE; i++)
+        {
+            poll_request *req = &dev->inflight[i];
+            if (req->active && req != keep)
+            {
+                if (dev->state == POLL_BUSY)
+                    dev->pending[req->block] = 1;
+                poller_release(dev, req);
+            }
+        }
+    }
+}
+
+/**
+ * Sends (or resends) a request with a new transaction ID
+ * @return 0 on success, -1 when the connection failed
+ */
+static int poller_send(poller_t *p, poll_device *dev, poll_request *req)
+{
+    uint8_t buf[MODBUS_TCP_REQ_LENGTH];
+    uint8_t *pkg = buf;
+    poll_conn *c = dev->conn;
+    const sma_block *b = &dev->plan->blocks[req->block];
+#ifdef IO_URING
+    pkg = req->pkg;
+#endif
+
+    c->mb->slave = dev->unit;
+    int req_length = modbus_build_request_header(c->mb, MODBUS_READ_HOLDING_REGISTERS, b->addr, b->qoc, pkg);
+    req->tid = c->mb->transaction_id;
+    req->deadline = modbus_now_ms() + modbus_retry_timeout(p->timeout_ms, req->retry);
+    req->sent_us = metrics_now_us();
+    if (dev->metrics)
+        metrics_inc(&dev->metrics->bytes_out, req_length);
+
+#ifdef IO_URING
+    // Goes out with everything else of this tick, a failure shows in its completion
+    struct io_uring_sqe *sqe = p->uring ? uring_get_sqe(&p->ring, POLLER_TAG(c, POLLER_OP_SEND)) : NULL;
+    if (sqe != NULL)
+    {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->mb->s;
+        sqe->addr = (unsigned long long)pkg;
+        sqe->len = req_length;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+#endif
+
+    if (send(c->mb->s, pkg, req_length, MSG_NOSIGNAL) != req_length)
+    {
+        fprintf(stderr, "poller: %s send failed\n", c->mb->ip);
+        poller_lost(p, c, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * First block of a device that wasn't requested yet this cycle
+ * @return index of the block, -1 when all are requested
+ */
+static int poller_next_block(const poll_device *dev)
+{
+    for (int block = 0; block < dev->plan->nblocks; block++)
+        if (dev->pending[block])
+            return block;
+    return -1;
+}
+
+/**
+ * Keeps up to depth requests in flight on a connection.
+ * Its devices take turns, so one inverter behind a gateway can't hold up the others.
+ */
+static void poller_fill(poller_t *p, poll_conn *c)
+{
+    int idle = 0;
+    while (c->link == LINK_UP && c->ninflight < c->mb->depth && idle < c->ndevs)
+    {
+        poll_device *dev = c->devs[c->next];
+        c->next = (c->next + 1) % c->ndevs;
+
+        int block = dev->state == POLL_BUSY ? poller_next_block(dev) : -1;
+        if (block < 0)
+        {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        poll_request *req = NULL;
+        for (int i = 0; i < MODBUS_MAX_PIPELINE; i++)
+        {
+            if (!dev->inflight[i].active)
+            {
+                req = &dev->inflight[i];
+                break;
+            }
+        }
+
+        req->active = 1;
+        req->block = block;
+        dev->pending[block] = 0;
+        req->retry = 0;
+        dev->ninflight++;
+        c->ninflight++;
+
+        if (poller_send(p, dev, req) != 0)
+            return;
+    }
+}
+
+/**
+ * Starts the cycles of the devices of a connection that just came up
+ */
+static void poller_up(poller_t *p, poll_conn *c)
+{
+    if (c->failures > 0 || c->link == LINK_DOWN)
+        printf("poller: %s:%d is back after %d failed connects\n", c->mb->ip, c->mb->port, c->failures);
+
+    c->failures = 0;
+    c->received = modbus_now_ms();
+    c->mb->depth = c->depth;
+    poller_link(c, LINK_UP);
+
+    for (int i = 0; i < c->ndevs; i++)
+    {
+        poll_device *dev = c->devs[i];
+        if (dev->metrics)
+            metrics_inc(&dev->metrics->connects, 1);
+        if (dev->state == POLL_BUSY && dev->plan->nblocks == 0)
+            poller_finish(dev, POLL_DONE);
+    }
+
+    poller_fill(p, c);
+}
+
+/**
+ * Starts connecting, the cycles of the devices begin once connected
+ */
+static void poller_connect(poller_t *p, poll_conn *c)
+{
+    int rc = modbus_connect_start(c->mb);
+    if (rc >= 0 && poller_watch(p, c, EPOLL_CTL_ADD, rc == 0 ? EPOLLIN : EPOLLOUT) != 0)
+    {
+        modbus_disconnect(c->mb);
+        rc = -1;
+    }
+
+    if (rc < 0)
+    {
+        poller_lost(p, c, 1);
+        return;
+    }
+
+    if (rc == 0)
+    {
+        poller_up(p, c);
+        return;
+    }
+
+    poller_link(c, LINK_CONNECTING);
+    c->connect_deadline = modbus_now_ms() + MODBUS_CONNECT_TIMEOUT_MS;
+}
+
+/**
+ * Finishes a connect once the socket is writable
+ */
+static void poller_connected(poller_t *p, poll_conn *c)
+{
+    if (modbus_connect_finish(c->mb) != 0 || poller_watch(p, c, EPOLL_CTL_MOD, EPOLLIN) != 0)
+    {
+        poller_lost(p, c, 1);
+        return;
+    }
+
+    poller_up(p, c);
+}
+
+/**
+ * Handles a complete response frame, whichever device it is for
+ * @param frame Start of the frame
+ * @param len Length of the frame
+ */
+static void poller_complete(poller_t *p, poll_conn *c, const uint8_t *frame, int len)
+{
+    unsigned short tid = (frame[0] << 8) | frame[1];
+
+    poll_device *dev = NULL;
+    poll_request *req = NULL;
+    for (int d = 0; d < c->ndevs && req == NULL; d++)
+    {
+        for (int i = 0; i < MODBUS_MAX_PIPELINE; i++)
+        {
+            if (c->devs[d]->inflight[i].active && c->devs[d]->inflight[i].tid == tid)
+            {
+                dev = c->devs[d];
+                req = &dev->inflight[i];
+                break;
+            }
+        }
+    }
+
+    // Late reply to a request we already resent
+    if (req == NULL)
+    {
+#if DEBUG
+        fprintf(stderr, "poller: %s unexpected transaction %d\n", c->mb->ip, tid);
+#endif
+        return;
+    }
+
+    if (dev->metrics)
+        metrics_inc(&dev->metrics->bytes_in, len);
+    dev->answered_us = metrics_now_us();
+
+    // Left over from a cycle that failed
+    if (dev->state != POLL_BUSY)
+    {
+        poller_release(dev, req);
+        poller_fill(p, c);
+        return;
+    }
+
+    if (modbus_check_response(c->mb, frame, len, tid) != 0)
+    {
+        if (dev->metrics && (frame[7] & 0x80) && frame[8] < METRICS_MAX_EXCEPTION)
+            metrics_inc(&dev->metrics->exceptions[frame[8]], 1);
+        poller_release(dev, req);
+        poller_fail(dev);
+        poller_fill(p, c);
+        return;
+    }
+
+    if (dev->metrics)
+    {
+        long long rtt = metrics_now_us() - req->sent_us;
+        metrics_observe(&dev->metrics->request, rtt);
+        // Blocks are counted for the plan the metrics were made for, not for probes
+        if (dev->plan->nblocks == dev->metrics->nblocks && dev->metrics->block_addr[req->block] == dev->plan->blocks[req->block].addr)
+            metrics_observe(&dev->metrics->block[req->block], rtt);
+    }
+
+    if (sma_decode_block(dev->plan, req->block, (modbus_regs)frame, dev->inv) != 0)
+    {
+        fprintf(stderr, "poller: %s unit %d sent a short response\n", c->mb->ip, dev->unit);
+        poller_release(dev, req);
+        poller_fail(dev);
+        poller_fill(p, c);
+        return;
+    }
+
+    poller_release(dev, req);
+    if (++dev->done_blocks >= dev->plan->nblocks)
+        poller_finish(dev, POLL_DONE);
+
+    poller_fill(p, c);
+}
+
+/**
+ * Handles the frames that completed in the receive buffer of a connection
+ */
+static void poller_frames(poller_t *p, poll_conn *c)
+{
+    modbus_t *mb = c->mb;
+
+    c->received = modbus_now_ms();
+    unsigned long stray = mb->stray;
+
+    /**
+     * Several pipelined responses may arrive at once, for different devices
+     */
+    int len;
+    while (mb->s >= 0 && (len = modbus_next_frame(mb)) > 0)
+    {
+        poller_complete(p, c, mb->rx, len);
+        modbus_consume(mb, len);
+    }
+
+    if (c->devs[0]->metrics)
+        metrics_inc(&c->devs[0]->metrics->stray, mb->stray - stray);
+}
+
+/**
+ * Drops a connection that was closed (rc 0) or failed (rc -1) while receiving
+ */
+static void poller_recv_failed(poller_t *p, poll_conn *c, int rc)
+{
+    if (rc == 0)
+    {
+        fprintf(stderr, "poller: %s connection was closed\n", c->mb->ip);
+    }
+    else
+        fprintf(stderr, "poller: %s recv failed\n", c->mb->ip);
+
+    poller_lost(p, c, 0);
+}
+
+/**
+ * Reads whatever is available on a connection's socket
+ */
+static void poller_receive(poller_t *p, poll_conn *c)
+{
+    modbus_t *mb = c->mb;
+
+    while (mb->s >= 0)
+    {
+        int rc = modbus_recv(mb);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (rc <= 0)
+        {
+            poller_recv_failed(p, c, rc);
+            return;
+        }
+
+        poller_frames(p, c);
+    }
+}
+
+#ifdef IO_URING
+/**
+ * Takes what a ring receive brought into the receive buffer, then receives again
+ * @param res Bytes received or -errno
+ */
+static void poller_received(poller_t *p, poll_conn *c, int res)
+{
+    modbus_t *mb = c->mb;
+
+    // Nothing after all, receive again
+    if (res == -EAGAIN || res == -EINTR)
+    {
+        if (poller_watch(p, c, EPOLL_CTL_MOD, EPOLLIN) != 0)
+            poller_lost(p, c, 0);
+        return;
+    }
+    if (res <= 0)
+    {
+        errno = -res;
+        poller_recv_failed(p, c, res < 0 ? -1 : 0);
+        return;
+    }
+
+    // The buffer was emptied by poller_run while the receive was pending
+    if (mb->rx_len < c->recv_off)
+        memmove(mb->rx + mb->rx_len, mb->rx + c->recv_off, res);
+    mb->rx_len += res;
+
+    poller_frames(p, c);
+    if (mb->s >= 0 && poller_watch(p, c, EPOLL_CTL_MOD, EPOLLIN) != 0)
+        poller_lost(p, c, 0);
+}
+
+/**
+ * Submits what was queued this tick in one system call and handles what completed
+ * @param timeout ms to wait for a completion
+ * @return 0, -1 when the ring failed
+ */
+static int poller_wait_ring(poller_t *p, int timeout)
+{
+    if (uring_submit_wait(&p->ring, timeout) != 0 && errno != ETIME && errno != EINTR)
+    {
+        fprintf(stderr, "poller: io_uring_enter failed\n");
+        return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&p->ring)) != NULL)
+    {
+        unsigned long long tag = cqe->user_data;
+        int res = cqe->res;
+        uring_cqe_seen(&p->ring);
+
+        poll_conn *c = p->conns[tag & 0xFFFFFFFF];
+        int op = (tag >> 32) & 0xFF;
+
+        // Belongs to a connection that was lost since
+        if (op == POLLER_OP_CANCEL || tag != POLLER_TAG(c, op))
+            continue;
+
+        if (op == POLLER_OP_CONNECT)
+            poller_connected(p, c);
+        else if (op == POLLER_OP_RECV)
+            poller_received(p, c, res);
+        else if (res != MODBUS_TCP_REQ_LENGTH)
+        {
+            errno = res < 0 ? -res : EIO;
+            fprintf(stderr, "poller: %s send failed\n", c->mb->ip);
+            poller_lost(p, c, 0);
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/**
+ * Resends or gives up on requests whose deadline passed
+ * @return ms until the next deadline, -1 when nothing is in flight
+ */
+static int poller_check_timers(poller_t *p)
+{
+    long long now = modbus_now_ms();
+    long long next = -1;
+
+    for (int i = 0; i < p->nconns; i++)
+    {
+        poll_conn *c = p->conns[i];
+
+        if (c->link == LINK_CONNECTING)
+        {
+            if (c->connect_deadline <= now)
+            {
+                errno = ETIMEDOUT;
+                poller_lost(p, c, 1);
+            }
+            else if (next == -1 || c->connect_deadline - now < next)
+                next = c->connect_deadline - now;
+            continue;
+        }
+
+        int busy = 0;
+        for (int d = 0; d < c->ndevs; d++)
+            busy |= c->devs[d]->state == POLL_BUSY;
+
+        for (int d = 0; d < c->ndevs && c->link == LINK_UP; d++)
+        {
+            poll_device *dev = c->devs[d];
+
+            for (int r = 0; r < MODBUS_MAX_PIPELINE && c->link == LINK_UP; r++)
+            {
+                poll_request *req = &dev->inflight[r];
+                if (!req->active)
+                    continue;
+
+                // Left over from a failed cycle, only holds a slot of the connection
+                if (dev->state != POLL_BUSY)
+                {
+                    if (req->deadline <= now)
+                    {
+                        poller_release(dev, req);
+                        poller_fill(p, c);
+                    }
+                    else if (busy && (next == -1 || req->deadline - now < next))
+                        next = req->deadline - now;
+                    continue;
+                }
+
+                if (req->deadline <= now)
+                {
+                    // The unit answered another request while this one was in flight, so it
+                    // drops pipelined requests. A unit that doesn't answer at all is an outage,
+                    // or a unit behind the gateway that is down, and keeps the depth.
+                    if (dev->answered_us > req->sent_us)
+                        poller_no_pipeline(c, req);
+
+                    if (req->retry++ >= RETRIES)
+                    {
+                        // Nothing came back at all, the connection may be half-open
+                        if (c->received * 1000 < req->sent_us)
+                        {
+                            fprintf(stderr, "poller: %s timed out, reconnecting\n", c->mb->ip);
+                            poller_lost(p, c, 0);
+                            break;
+                        }
+
+                        // Only this unit doesn't answer, the others behind the connection do
+                        fprintf(stderr, "poller: %s unit %d timed out\n", c->mb->ip, dev->unit);
+                        poller_release(dev, req);
+                        poller_fail(dev);
+                        poller_fill(p, c);
+                        continue;
+                    }
+#if DEBUG
+                    fprintf(stderr, "poller: %s timed out, retrying %d\n", c->mb->ip, req->retry);
+#endif
+                    if (dev->metrics)
+                        metrics_inc(&dev->metrics->retries, 1);
+                    if (poller_send(p, dev, req) != 0)
+                        break;
+                }
+
+                if (next == -1 || req->deadline - now < next)
+                    next = req->deadline - now;
+            }
+        }
+    }
+
+    return (int)next;
+}
+
+/**
+ * Reads all blocks from some of the inverters concurrently.
+ * Returns once every one of them either completed or failed.
+ * @param devs Devices to poll, all registered with poller_add
+ * @param ndevs Number of devices
+ * @return number of devices that failed
+ */
+int poller_run(poller_t *p, poll_device **devs, int ndevs)
+{
+    struct epoll_event events[POLLER_MAX_EVENTS];
+    long long now = modbus_now_ms();
+
+    for (int i = 0; i < ndevs; i++)
+    {
+        poll_device *dev = devs[i];
+        poll_conn *c = dev->conn;
+        memset(dev->pending, 1, sizeof(dev->pending));
+        dev->done_blocks = 0;
+        dev->started = now;
+
+        // Requests left over from a failed cycle are answered by now or never will be
+        for (int r = 0; r < MODBUS_MAX_PIPELINE; r++)
+            if (dev->inflight[r].active)
+                poller_release(dev, &dev->inflight[r]);
+
+        // Not connected and not due to connect again yet
+        if (c->mb == NULL || (c->mb->s < 0 && c->retry_at > now))
+        {
+            poller_finish(dev, POLL_FAILED);
+            continue;
+        }
+
+        // Nothing in flight, what's left in the buffer is garbage
+        if (c->ninflight == 0)
+            c->mb->rx_len = 0;
+
+        if (c->link == LINK_UP && dev->plan->nblocks == 0)
+        {
+            poller_finish(dev, POLL_DONE);
+            continue;
+        }
+        dev->state = POLL_BUSY;
+    }
+
+    /**
+     * Connect what isn't connected, fill what is
+     */
+    for (int i = 0; i < ndevs; i++)
+    {
+        poll_conn *c = devs[i]->conn;
+        if (devs[i]->state != POLL_BUSY)
+            continue;
+
+        if (c->mb->s < 0)
+            poller_connect(p, c);
+        else if (c->link == LINK_UP)
+            poller_fill(p, c);
+    }
+
+    int timeout;
+    while ((timeout = poller_check_timers(p)) >= 0)
+    {
+#ifdef IO_URING
+        if (p->uring)
+        {
+            if (poller_wait_ring(p, timeout) != 0)
+                break;
+            continue;
+        }
+#endif
+
+        int n = epoll_wait(p->epfd, events, POLLER_MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "poller: epoll_wait failed\n");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            poll_conn *c = (poll_conn *)events[i].data.ptr;
+            if (c->link == LINK_CONNECTING)
+                poller_connected(p, c);
+            else
+                poller_receive(p, c);
+        }
+    }
+
+    for (int i = 0; i < p->nconns; i++)
+    {
+        if (p->conns[i]->link == LINK_CONNECTING)
+        {
+            errno = ETIMEDOUT;
+            poller_lost(p, p->conns[i], 1);
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < ndevs; i++)
+    {
+        if (devs[i]->state == POLL_BUSY)
+            poller_fail(devs[i]);
+        if (devs[i]->state == POLL_FAILED)
+            failed++;
+    }
+
+    return failed;
+}
+
+/**
+ * Reads all blocks from all inverters concurrently
+ * @return number of devices that failed
+ */
+int poller_run_cycle(poller_t *p)
+{
+    return poller_run(p, p->devs, p->ndevs);
+}
+
+/**
+ * How the poller waits for its sockets, "io_uring" or "epoll"
+ */
+const char *poller_backend(const poller_t *p)
+{
+#ifdef IO_URING
+    if (p->uring)
+        return "io_uring";
+#else
+    (void)p;
+#endif
+    return "epoll";
+}
+
+void poller_destroy(poller_t *p)
+{
+#ifdef IO_URING
+    // The kernel must be done with the receive buffers before their connections are freed
+    if (p->uring)
+    {
+        uring_cancel_all(&p->ring);
+        uring_exit(&p->ring);
+    }
+#endif
+
+    for (int i = 0; i < p->nconns; i++)
+    {
+        free(p->conns[i]->devs);
+        free(p->conns[i]);
+    }
+    close(p->epfd);
+    free(p->conns);
+    free(p->devs);
+    free(p);
+}
@@ -0,0 +1,121 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "modbus.h"
+#include "sma.h"
+#include "sma_map.h"
+#include "metrics.h"
+#include "uring.h"
+
+#define POLLER_MAX_EVENTS 64
+
+enum
+{
+    POLL_IDLE,      // Waiting for the next cycle
+    POLL_BUSY,      // Request in flight
+    POLL_DONE,      // All blocks read this cycle
+    POLL_FAILED,    // Gave up this cycle
+};
+
+enum
+{
+    LINK_UP,        // Connected
+    LINK_CONNECTING,// Connect in progress
+    LINK_BACKOFF,   // Not connected, waiting until retry_at to connect again
+    LINK_DOWN,      // Like LINK_BACKOFF, but connecting failed MODBUS_DOWN_AFTER times in a row
+};
+
+/**
+ * A request in flight, matched to its response by transaction ID
+ */
+typedef struct
+{
+    int active;
+    int block;                  // Block this request reads
+    int retry;
+    unsigned short tid;
+    long long deadline;         // Monotonic ms at which the request times out
+    long long sent_us;          // Monotonic us at which the request was (re)sent
+#ifdef IO_URING
+    uint8_t pkg[MODBUS_TCP_REQ_LENGTH]; // Sent from here once the ring is submitted
+#endif
+} poll_request;
+
+typedef struct poll_conn poll_conn;
+
+/**
+ * One inverter driven by the poller
+ */
+typedef struct
+{
+    SMA_Inverter *inv;
+    modbus_t *mb;               // Devices with the same mb share its connection
+    const sma_plan *plan;
+    unsigned char unit;         // Modbus unit ID of the inverter
+    metrics_device *metrics;    // Counters of the inverter, may be NULL
+    poll_conn *conn;            // Set by poller_add
+
+    int state;
+    unsigned char pending[SMA_MAX_BLOCKS]; // Blocks not requested yet this cycle
+    int done_blocks;            // Blocks decoded this cycle
+    poll_request inflight[MODBUS_MAX_PIPELINE];
+    int ninflight;
+
+    long long started;          // Monotonic ms at which the cycle started
+    long long finished;         // Monotonic ms at which the cycle ended
+    long long timestamp;        // Wall clock ns at which the last reply of the cycle arrived
+    long long answered_us;      // Monotonic us at which the unit last answered
+} poll_device;
+
+/**
+ * A connection and the devices polled over it, like the inverters behind
+ * a gateway or Cluster Controller that differ only in their unit ID.
+ * Their requests take turns and are told apart by transaction ID.
+ */
+struct poll_conn
+{
+    modbus_t *mb;
+    poll_device **devs;
+    int ndevs;
+    int next;                   // Device whose request goes out next
+    int ninflight;              // Requests in flight for all devices, at most mb->depth
+    int depth;                  // Configured pipeline depth, mb->depth again on every connect
+
+    int link;                   // State of the connection
+    int failures;               // Connects that failed in a row
+    long long retry_at;         // Monotonic ms from which to connect again
+    long long connect_deadline; // Monotonic ms at which connecting gives up
+    long long received;         // Monotonic ms at which bytes last arrived
+#ifdef IO_URING
+    int index;                  // Position in poller_t.conns, tags its operations
+    unsigned int gen;           // Counts connects, completions of older ones are stale
+    int recv_off;               // Where in mb->rx the pending receive writes
+#endif
+};
+
+typedef struct
+{
+    int epfd;
+    int timeout_ms;
+    poll_device **devs;
+    int ndevs;
+    poll_conn **conns;
+    int nconns;
+    unsigned int seed;          // Jitter of the reconnect backoff
+#ifdef IO_URING
+    uring_t ring;
+    int uring;                  // 1 when the ring works, else epoll
+#endif
+} poller_t;
+
+/**
+ * Function predefinitions
+ */
+poller_t *poller_create(int timeout_ms);
+int poller_add(poller_t *p, poll_device *dev);
+int poller_run(poller_t *p, poll_device **devs, int ndevs);
+int poller_run_cycle(poller_t *p);
+const char *poller_backend(const poller_t *p);
+void poller_destroy(poller_t *p);
+
+#endif
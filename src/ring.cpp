@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+static void ring_futex_wait(uint32_t *word, uint32_t seen)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void ring_futex_wake(uint32_t *word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/**
+ * Tells a producer waiting for room that it has some. It is only woken once
+ * half of the ring is free, not for every element.
+ * @param all Wake it regardless
+ */
+static void ring_wake(ring_t *r, int all)
+{
+    __atomic_fetch_add(&r->popped, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST) && (all || ring_depth(r) <= r->capacity / 2))
+        ring_futex_wake(&r->popped, INT_MAX);
+}
+
+/**
+ * @param capacity Max number of elements
+ * @param size Size of an element in bytes
+ * @param policy What ring_push does while full, RING_DROP_OLDEST, RING_DROP_NEWEST or RING_BLOCK
+ * @return ring, NULL when out of memory
+ */
+ring_t *ring_create(size_t capacity, size_t size, int policy)
+{
+    if (capacity > SIZE_MAX / (size ? size : 1))
+        return NULL;
+
+    ring_t *r = (ring_t *)aligned_alloc(64, (sizeof(ring_t) + 63) / 64 * 64);
+    if (r == NULL)
+        return NULL;
+    memset(r, 0, sizeof(ring_t));
+    r->capacity = capacity > 0 ? capacity : 1;
+    r->size = size;
+    r->policy = policy;
+    r->slots = (uint8_t *)malloc(r->capacity * size);
+    if (r->slots == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/**
+ * Adds an element, producer only
+ * @return 0 on success, -1 when the element was dropped
+ */
+int ring_push(ring_t *r, const void *elem)
+{
+    uint64_t tail = r->tail;
+
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail - head < r->capacity)
+            break;
+
+        if (r->policy == RING_DROP_NEWEST || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+        {
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (r->policy == RING_BLOCK)
+        {
+            // Sleeps until the consumer makes room, a pop before the check ends the wait right away
+            uint32_t seen = __atomic_load_n(&r->popped, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+            if (tail - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) >= r->capacity)
+                ring_futex_wait(&r->popped, seen);
+            __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Races with the consumer for the oldest element, whoever moves head owns it
+        if (__atomic_compare_exchange_n(&r->head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    memcpy(r->slots + (tail % r->capacity) * r->size, elem, r->size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Takes the oldest element, consumer only
+ * @return 0 on success, -1 when empty
+ */
+int ring_pop(ring_t *r, void *elem)
+{
+    for (;;)
+    {
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+            return -1;
+
+        memcpy(elem, r->slots + (head % r->capacity) * r->size, r->size);
+
+        // The producer may have dropped it meanwhile, the copy is garbage then
+        if (__atomic_compare_exchange_n(&r->head, &head, head + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+        {
+            if (r->policy == RING_BLOCK)
+                ring_wake(r, 0);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Number of elements waiting, safe from any thread
+ */
+size_t ring_depth(const ring_t *r)
+{
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return tail > head ? tail - head : 0;
+}
+
+/**
+ * Lets a producer waiting for room go once the consumer is gone,
+ * ring_push drops the elements that don't fit from then on
+ */
+void ring_close(ring_t *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    ring_wake(r, 1);
+}
+
+void ring_destroy(ring_t *r)
+{
+    if (r == NULL)
+        return;
+
+    free(r->slots);
+    free(r);
+}
@@ -0,0 +1,43 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum
+{
+    RING_DROP_OLDEST,   // Make room by dropping the oldest element
+    RING_DROP_NEWEST,   // Refuse new elements while full
+    RING_BLOCK,         // Wait for room
+};
+
+/**
+ * Bounded lock-free queue of fixed size elements, one producer and one consumer.
+ * head and tail only ever grow, the slot is offset % capacity.
+ */
+typedef struct
+{
+    alignas(64) uint64_t head;      // Next element to pop, written by the consumer
+                                    // and by the producer when dropping the oldest
+    alignas(64) uint64_t tail;      // Next slot to push into, written by the producer
+    alignas(64) unsigned long dropped;
+    uint32_t popped;                // Futex a RING_BLOCK producer waits on, bumped by every pop
+    uint32_t waiting;               // 1 while the producer waits for room
+    size_t capacity;
+    size_t size;                    // Of an element
+    int policy;
+    int closed;                     // Set by ring_close
+    uint8_t *slots;
+} ring_t;
+
+/**
+ * Function predefinitions
+ */
+ring_t *ring_create(size_t capacity, size_t size, int policy);
+int ring_push(ring_t *r, const void *elem);
+int ring_pop(ring_t *r, void *elem);
+size_t ring_depth(const ring_t *r);
+void ring_close(ring_t *r);
+void ring_destroy(ring_t *r);
+
+#endif
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+
+#include "scheduler.h"
+
+/**
+ * @param cap Max number of items
+ */
+scheduler_t *scheduler_create(int cap)
+{
+    scheduler_t *s = (scheduler_t *)calloc(1, sizeof(scheduler_t));
+    s->items = (sched_item *)calloc(cap > 0 ? cap : 1, sizeof(sched_item));
+    s->cap = cap;
+    return s;
+}
+
+static void swap(sched_item *a, sched_item *b)
+{
+    sched_item t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/**
+ * @return 0 on success, -1 when full
+ */
+int scheduler_push(scheduler_t *s, long long due, int id)
+{
+    if (s->n >= s->cap)
+        return -1;
+
+    int i = s->n++;
+    s->items[i].due = due;
+    s->items[i].id = id;
+
+    // Sift up
+    while (i > 0 && s->items[(i - 1) / 2].due > s->items[i].due)
+    {
+        swap(&s->items[(i - 1) / 2], &s->items[i]);
+        i = (i - 1) / 2;
+    }
+
+    return 0;
+}
+
+/**
+ * @return the item due first, NULL when empty
+ */
+const sched_item *scheduler_peek(const scheduler_t *s)
+{
+    return s->n > 0 ? &s->items[0] : NULL;
+}
+
+/**
+ * Removes the item due first
+ * @return 0 on success, -1 when empty
+ */
+int scheduler_pop(scheduler_t *s, sched_item *item)
+{
+    if (s->n == 0)
+        return -1;
+
+    *item = s->items[0];
+    s->items[0] = s->items[--s->n];
+
+    // Sift down
+    int i = 0;
+    for (;;)
+    {
+        int min = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < s->n && s->items[l].due < s->items[min].due)
+            min = l;
+        if (r < s->n && s->items[r].due < s->items[min].due)
+            min = r;
+        if (min == i)
+            break;
+        swap(&s->items[i], &s->items[min]);
+        i = min;
+    }
+
+    return 0;
+}
+
+void scheduler_destroy(scheduler_t *s)
+{
+    free(s->items);
+    free(s);
+}
@@ -0,0 +1,32 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/**
+ * Something to do at a point in time, id is up to the caller
+ */
+typedef struct
+{
+    long long due;      // Wall clock ms
+    int id;
+} sched_item;
+
+/**
+ * Min-heap of items keyed on their due time
+ */
+typedef struct
+{
+    sched_item *items;
+    int n;
+    int cap;
+} scheduler_t;
+
+/**
+ * Function predefinitions
+ */
+scheduler_t *scheduler_create(int cap);
+int scheduler_push(scheduler_t *s, long long due, int id);
+const sched_item *scheduler_peek(const scheduler_t *s);
+int scheduler_pop(scheduler_t *s, sched_item *item);
+void scheduler_destroy(scheduler_t *s);
+
+#endif
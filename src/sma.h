@@ -18,18 +18,18 @@ typedef struct {
 
     double Udc1;
     double Idc1;
-    long unsigned Pdc1;
+    long Pdc1;
     
     double Udc2;
     double Idc2;
-    long unsigned Pdc2;
+    long Pdc2;
 
     double Uac1;
     double Iac1;
-    long unsigned Pac1;
+    long Pac1;
     double GridFreq;            // 30803
-    long unsigned ReactivePower;// 30805
-    long unsigned ApparentPower;// 30813
+    long ReactivePower;         // 30805
+    long ApparentPower;         // 30813
 } SMA_Inverter;
 
 #endif
\ No newline at end of file
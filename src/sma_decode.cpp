@@ -0,0 +1,100 @@
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "sma_decode.h"
+
+/**
+ * Converts the big-endian registers of a response to host order, 8 at a time
+ * with SSE2 or NEON. The vector paths assume a little-endian host.
+ * @param src First data byte of the response
+ * @param dst nwords registers
+ * @param nwords Number of registers
+ */
+void sma_swap_words(const uint8_t *src, uint16_t *dst, int nwords)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 8 <= nwords; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= nwords; i += 8)
+        vst1q_u8((uint8_t *)(dst + i), vrev16q_u8(vld1q_u8(src + i * 2)));
+#endif
+
+    for (; i < nwords; i++)
+        dst[i] = (src[i * 2] << 8) | src[i * 2 + 1];
+}
+
+/**
+ * Decodes one value without scaling
+ * @param type SMA data type
+ * @param words Registers of the value in host order, see sma_swap_words
+ * @param raw Value, sign extended for signed types
+ * @return 0, or -1 when the inverter sent NaN
+ */
+static inline int sma_decode_raw(sma_type type, const uint16_t *words, long long *raw)
+{
+    unsigned long u32 = ((unsigned long)words[0] << 16) | words[1];
+
+    switch (type)
+    {
+    case SMA_U32:
+        *raw = u32;
+        return u32 == SMA_NAN_U32 ? -1 : 0;
+
+    case SMA_ENUM:
+        *raw = u32;
+        return u32 == SMA_NAN_ENUM || u32 == SMA_NAN_U32 ? -1 : 0;
+
+    case SMA_U64:
+    case SMA_S64:
+    {
+        unsigned long long u64 = ((unsigned long long)u32 << 32) | ((unsigned long)words[2] << 16) | words[3];
+        *raw = (long long)u64;
+        if (type == SMA_U64)
+            return u64 == SMA_NAN_U64 ? -1 : 0;
+        return u64 == SMA_NAN_S64 ? -1 : 0;
+    }
+
+    // Signed measurements, 0xFFFFFFFF is -1
+    default:
+        *raw = (int)u32;
+        return u32 == SMA_NAN_S32 ? -1 : 0;
+    }
+}
+
+/**
+ * Decodes registers into their members of the inverter struct.
+ * NaN becomes NAN, SMA_FIELD_NAN or SMA_FIELD_NAN_LONG, so it can be left out.
+ * @param regs Registers to decode, all within words
+ * @param nregs Number of registers
+ * @param addr Address of words[0]
+ * @param words Registers in host order, see sma_swap_words
+ */
+void sma_decode_registers(const sma_register *regs, int nregs, unsigned short addr, const uint16_t *words, SMA_Inverter *inv)
+{
+    for (int i = 0; i < nregs; i++)
+    {
+        const sma_register *reg = &regs[i];
+        char *dst = (char *)inv + reg->offset;
+        long long raw;
+        int nan = sma_decode_raw(reg->type, words + (reg->addr - addr), &raw) != 0;
+
+        if (reg->kind == SMA_FIELD_DOUBLE)
+            *(double *)dst = nan ? NAN : raw / reg->scale;
+        else if (reg->kind == SMA_FIELD_LONG)
+            *(long *)dst = nan ? SMA_FIELD_NAN_LONG : (long)raw;
+        else
+            *(unsigned long *)dst = nan ? SMA_FIELD_NAN : (unsigned long)raw;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef SMA_DECODE_H
+#define SMA_DECODE_H
+
+#include <limits.h>
+
+#include "sma_map.h"
+
+// Raw values SMA sends for values that are not available, like Pac1 at night
+#define SMA_NAN_S32 0x80000000UL
+#define SMA_NAN_U32 0xFFFFFFFFUL
+#define SMA_NAN_ENUM 0x00FFFFFDUL
+#define SMA_NAN_S64 0x8000000000000000ULL
+#define SMA_NAN_U64 0xFFFFFFFFFFFFFFFFULL
+
+// Stored in unsigned long members of SMA_Inverter for values that are not available,
+// SMA_FIELD_NAN_LONG in long members, double members get NAN
+#define SMA_FIELD_NAN (~0UL)
+#define SMA_FIELD_NAN_LONG LONG_MIN
+
+/**
+ * Function predefinitions
+ */
+void sma_swap_words(const uint8_t *src, uint16_t *dst, int nwords);
+void sma_decode_registers(const sma_register *regs, int nregs, unsigned short addr, const uint16_t *words, SMA_Inverter *inv);
+
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "sma_map.h"
+#include "sma_decode.h"
+
+#define SMA_REG(addr, type, scale, member, kind) \
+    {addr, type, scale, #member, offsetof(SMA_Inverter, member), kind}
+
+/**
+ * Registers read from every inverter, sorted by address.
+ * Condition
+ * 	35: Fault (Alm)
+ *  303: Off (Off)
+ *  307: Ok (Ok)
+ *  455: Warning (Wrn)
+ * Grid Relay
+ * 	51: Closed (Cls)
+ *  311: Open (Opn)
+ *  16777213: Information not available (NaNStt)
+ */
+const sma_register sma_inverter_registers[] = {
+    SMA_REG(30201, SMA_ENUM, 1,    Condition,     SMA_FIELD_ULONG),
+    SMA_REG(30217, SMA_ENUM, 1,    GridRelay,     SMA_FIELD_ULONG),
+    SMA_REG(30529, SMA_U32,  1,    TotalYield,    SMA_FIELD_ULONG),  // Wh
+    SMA_REG(30535, SMA_U32,  1,    DayYield,      SMA_FIELD_ULONG),  // Wh
+    SMA_REG(30769, SMA_FIX3, 1000, Idc1,          SMA_FIELD_DOUBLE), // A
+    SMA_REG(30771, SMA_FIX2, 100,  Udc1,          SMA_FIELD_DOUBLE), // V
+    SMA_REG(30773, SMA_FIX0, 1,    Pdc1,          SMA_FIELD_LONG),   // W
+    SMA_REG(30775, SMA_FIX0, 1,    Pac1,          SMA_FIELD_LONG),   // W
+    SMA_REG(30783, SMA_FIX2, 100,  Uac1,          SMA_FIELD_DOUBLE), // V
+    SMA_REG(30803, SMA_FIX2, 100,  GridFreq,      SMA_FIELD_DOUBLE), // Hz
+    SMA_REG(30805, SMA_FIX0, 1,    ReactivePower, SMA_FIELD_LONG),   // VAr
+    SMA_REG(30813, SMA_FIX0, 1,    ApparentPower, SMA_FIELD_LONG),   // VA
+    SMA_REG(30953, SMA_TEMP, 10,   Temperature,   SMA_FIELD_DOUBLE), // C
+    SMA_REG(30957, SMA_FIX3, 1000, Idc2,          SMA_FIELD_DOUBLE), // A
+    SMA_REG(30959, SMA_FIX2, 100,  Udc2,          SMA_FIELD_DOUBLE), // V
+    SMA_REG(30961, SMA_FIX0, 1,    Pdc2,          SMA_FIELD_LONG),   // W
+    SMA_REG(30977, SMA_FIX3, 1000, Iac1,          SMA_FIELD_DOUBLE), // A
+};
+const size_t sma_inverter_registers_count = sizeof(sma_inverter_registers) / sizeof(sma_inverter_registers[0]);
+
+/**
+ * Number of Modbus registers (16 bit words) occupied by an SMA data type
+ */
+unsigned short sma_type_size(sma_type type)
+{
+    switch (type)
+    {
+    case SMA_U64:
+    case SMA_S64:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+/**
+ * Merges registers into as few Modbus reads as possible.
+ * Two neighbouring registers end up in the same block when the number of
+ * unused registers between them is at most max_gap and the resulting block
+ * does not exceed SMA_MAX_BLOCK_REGS.
+ * @param plan Plan to fill in
+ * @param regs Registers to read, must be sorted by address
+ * @param nregs Number of registers
+ * @param max_gap Max number of unused registers read to merge two blocks
+ * @return number of blocks, -1 when regs is unsorted or does not fit
+ */
+int sma_plan_blocks(sma_plan *plan, const sma_register *regs, size_t nregs, unsigned short max_gap)
+{
+    memset(plan, 0, sizeof(sma_plan));
+    plan->regs = regs;
+    plan->nregs = nregs;
+
+    sma_block *cur = NULL;
+    for (size_t i = 0; i < nregs; i++)
+    {
+        unsigned int start = regs[i].addr;
+        unsigned int end = start + sma_type_size(regs[i].type); // exclusive
+
+        if (i > 0 && start < regs[i - 1].addr)
+        {
+            fprintf(stderr, "sma_map: registers not sorted at %u\n", start);
+            return -1;
+        }
+
+        if (cur != NULL)
+        {
+            unsigned int cur_end = cur->addr + cur->qoc;
+            unsigned int gap = start > cur_end ? start - cur_end : 0;
+
+            if (gap <= max_gap && end - cur->addr <= SMA_MAX_BLOCK_REGS)
+            {
+                if (end > cur_end)
+                    cur->qoc = end - cur->addr;
+                cur->count++;
+                continue;
+            }
+        }
+
+        if (plan->nblocks >= SMA_MAX_BLOCKS)
+        {
+            fprintf(stderr, "sma_map: too many blocks\n");
+            return -1;
+        }
+
+        cur = &plan->blocks[plan->nblocks++];
+        cur->addr = start;
+        cur->qoc = end - start;
+        cur->first = i;
+        cur->count = 1;
+    }
+
+    return plan->nblocks;
+}
+
+/**
+ * Decodes all registers of a block into the inverter struct.
+ * The block is converted to host order in one pass, then each register is decoded.
+ * @param plan Plan the block belongs to
+ * @param block Index of the block
+ * @param rsp Response to the read of this block
+ * @param inv Inverter to store the values in
+ * @return 0, or -1 when the response is shorter than the block
+ */
+int sma_decode_block(const sma_plan *plan, int block, modbus_regs rsp, SMA_Inverter *inv)
+{
+    const sma_block *b = &plan->blocks[block];
+    uint16_t words[SMA_MAX_BLOCK_REGS];
+
+    // Byte count of the response
+    if (rsp[MODBUS_DATA_OFFSET - 1] < b->qoc * 2)
+        return -1;
+
+    sma_swap_words(rsp + MODBUS_DATA_OFFSET, words, b->qoc);
+    sma_decode_registers(&plan->regs[b->first], b->count, b->addr, words, inv);
+
+    return 0;
+}
+
+/**
+ * Reads back the value a register was decoded into
+ * @return value, NAN when the inverter didn't have one
+ */
+double sma_field_value(const sma_register *reg, const SMA_Inverter *inv)
+{
+    const char *src = (const char *)inv + reg->offset;
+
+    if (reg->kind == SMA_FIELD_DOUBLE)
+        return *(const double *)src;
+
+    if (reg->kind == SMA_FIELD_LONG)
+    {
+        long value = *(const long *)src;
+        return value == SMA_FIELD_NAN_LONG ? NAN : (double)value;
+    }
+
+    unsigned long value = *(const unsigned long *)src;
+    return value == SMA_FIELD_NAN ? NAN : (double)value;
+}
+
+/**
+ * Registers that hold a value, NaN from the inverter is left out
+ * @return bit r set for register r
+ */
+unsigned long sma_valid_fields(const sma_register *regs, size_t nregs, const SMA_Inverter *inv)
+{
+    unsigned long valid = 0;
+    for (size_t r = 0; r < nregs && r < sizeof(valid) * 8; r++)
+        if (!isnan(sma_field_value(&regs[r], inv)))
+            valid |= 1UL << r;
+    return valid;
+}
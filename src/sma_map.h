@@ -0,0 +1,92 @@
+#ifndef SMA_MAP_H
+#define SMA_MAP_H
+
+#include <stddef.h>
+
+#include "modbus.h"
+#include "sma.h"
+
+// A single Modbus read may not return more than 125 registers (PDU = 253 bytes)
+#define SMA_MAX_BLOCK_REGS 125
+// Max number of unused registers we are willing to read to save a round-trip
+#define SMA_DEFAULT_MAX_GAP 32
+#define SMA_MAX_BLOCKS 32
+
+// Codes of Condition (30201) and GridRelay (30217)
+#define SMA_CONDITION_FAULT 35
+#define SMA_CONDITION_OFF 303
+#define SMA_CONDITION_OK 307
+#define SMA_CONDITION_WARNING 455
+#define SMA_RELAY_CLOSED 51
+#define SMA_RELAY_OPEN 311
+
+/**
+ * SMA data types as documented in the SMA Modbus interface description
+ */
+typedef enum
+{
+    SMA_U32,    // Unsigned 32 bit
+    SMA_S32,    // Signed 32 bit
+    SMA_U64,    // Unsigned 64 bit, 4 registers
+    SMA_S64,    // Signed 64 bit, 4 registers
+    SMA_ENUM,   // Coded status value
+    SMA_FIX0,   // Decimal, no decimal places
+    SMA_FIX1,   // Decimal, 1 decimal place
+    SMA_FIX2,   // Decimal, 2 decimal places
+    SMA_FIX3,   // Decimal, 3 decimal places
+    SMA_FIX4,   // Decimal, 4 decimal places
+    SMA_TEMP,   // Temperature, 1 decimal place
+} sma_type;
+
+/**
+ * Type of the SMA_Inverter member a register is stored into
+ */
+typedef enum
+{
+    SMA_FIELD_ULONG,
+    SMA_FIELD_DOUBLE,
+    SMA_FIELD_LONG,     // Signed, e.g. Pac1 while the inverter draws power
+} sma_field_kind;
+
+typedef struct
+{
+    unsigned short addr;    // Register address
+    sma_type type;          // SMA data type
+    double scale;           // Raw value is divided by this
+    const char *name;       // Field name
+    size_t offset;          // offsetof() the target member in SMA_Inverter
+    sma_field_kind kind;    // Type of the target member
+} sma_register;
+
+/**
+ * A contiguous range of registers fetched with one Modbus request
+ */
+typedef struct
+{
+    unsigned short addr;    // First register to read
+    unsigned short qoc;     // Number of registers to read
+    unsigned short first;   // Index of the first sma_register in this block
+    unsigned short count;   // Number of sma_registers in this block
+} sma_block;
+
+typedef struct
+{
+    const sma_register *regs;
+    size_t nregs;
+    sma_block blocks[SMA_MAX_BLOCKS];
+    int nblocks;
+} sma_plan;
+
+extern const sma_register sma_inverter_registers[];
+extern const size_t sma_inverter_registers_count;
+
+/**
+ * Function predefinitions
+ */
+unsigned short sma_type_size(sma_type type);
+int sma_plan_blocks(sma_plan *plan, const sma_register *regs, size_t nregs, unsigned short max_gap);
+int sma_decode_block(const sma_plan *plan, int block, modbus_regs rsp, SMA_Inverter *inv);
+double sma_field_value(const sma_register *reg, const SMA_Inverter *inv);
+unsigned long sma_valid_fields(const sma_register *regs, size_t nregs, const SMA_Inverter *inv);
+
+#endif
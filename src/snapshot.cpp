@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/**
+ * Maps the segment for writing, creating it when needed. A segment left by an
+ * earlier run is kept with its slots, so readers don't have to attach again.
+ * @param name POSIX shared memory name, e.g. "/msd"
+ * @return snapshot, NULL when failed
+ */
+snapshot_t *snapshot_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "snapshot: Can't open %s\n", name);
+        return NULL;
+    }
+
+    struct stat st;
+    int fresh = fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(snapshot_segment);
+    if (fresh && ftruncate(fd, sizeof(snapshot_segment)) == -1)
+    {
+        fprintf(stderr, "snapshot: Can't size %s\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, sizeof(snapshot_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        fprintf(stderr, "snapshot: Can't map %s\n", name);
+        return NULL;
+    }
+
+    snapshot_t *sn = (snapshot_t *)malloc(sizeof(snapshot_t));
+    sn->name = strdup(name);
+    sn->seg = (snapshot_segment *)p;
+    sn->nfields = (int)(sma_inverter_registers_count < SNAPSHOT_MAX_FIELDS ? sma_inverter_registers_count : SNAPSHOT_MAX_FIELDS);
+    memset(sn->field_of, -1, sizeof(sn->field_of));
+    for (int f = 0; f < sn->nfields; f++)
+        sn->field_of[sma_inverter_registers[f].offset] = (signed char)f;
+
+    snapshot_segment *seg = sn->seg;
+    if (fresh || seg->magic != SNAPSHOT_MAGIC || seg->version != SNAPSHOT_VERSION || seg->nfields != (uint32_t)sn->nfields)
+    {
+        __atomic_store_n(&seg->magic, 0, __ATOMIC_RELAXED);
+        memset(seg, 0, sizeof(snapshot_segment));
+        seg->version = SNAPSHOT_VERSION;
+        seg->nfields = sn->nfields;
+        for (int f = 0; f < sn->nfields; f++)
+        {
+            snprintf(seg->fields[f], SNAPSHOT_MAX_NAME, "%s", sma_inverter_registers[f].name);
+            sma_field_kind kind = sma_inverter_registers[f].kind;
+            seg->kinds[f] = kind == SMA_FIELD_DOUBLE ? SNAPSHOT_FIELD_DOUBLE
+                : kind == SMA_FIELD_LONG ? SNAPSHOT_FIELD_LONG : SNAPSHOT_FIELD_ULONG;
+        }
+        __atomic_store_n(&seg->magic, SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        // Slots an earlier run stopped writing in the middle of
+        for (int i = 0; i < SNAPSHOT_MAX_INVERTERS; i++)
+            if (seg->slots[i].seq & 1)
+                __atomic_store_n(&seg->slots[i].seq, seg->slots[i].seq + 1, __ATOMIC_RELEASE);
+    }
+
+    return sn;
+}
+
+/**
+ * Slot of an inverter, taken on first use and kept across reloads and restarts
+ * @return slot, -1 when there are too many inverters
+ */
+int snapshot_slot_of(snapshot_t *sn, const char *inverter)
+{
+    snapshot_segment *seg = sn->seg;
+    uint32_t n = seg->ninverters;
+    for (uint32_t i = 0; i < n; i++)
+        if (strncmp(seg->slots[i].name, inverter, SNAPSHOT_MAX_NAME) == 0)
+            return (int)i;
+
+    if (n == SNAPSHOT_MAX_INVERTERS)
+    {
+        fprintf(stderr, "snapshot: No slot left for %s\n", inverter);
+        return -1;
+    }
+
+    // Readers only look at the slot once it is counted
+    strncpy(seg->slots[n].name, inverter, SNAPSHOT_MAX_NAME - 1);
+    __atomic_store_n(&seg->ninverters, n + 1, __ATOMIC_RELEASE);
+    return (int)n;
+}
+
+/**
+ * Replaces the sample of an inverter
+ * @param slot See snapshot_slot_of, nothing is published for -1
+ * @param valid Registers the sample has, bit per entry of regs
+ * @param ts_ms Wall clock ms of the sample
+ */
+void snapshot_publish(snapshot_t *sn, int slot, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms)
+{
+    if (slot < 0)
+        return;
+    snapshot_slot *s = &sn->seg->slots[slot];
+
+    uint32_t seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    uint64_t fields = 0;
+    for (int f = 0; f < sn->nfields; f++)
+        s->sample.values[f] = NAN;
+    for (size_t r = 0; r < nregs; r++)
+    {
+        int f = sn->field_of[regs[r].offset];
+        if (!(valid & (1UL << r)) || f < 0)
+            continue;
+
+        s->sample.values[f] = sma_field_value(&regs[r], inv);
+        fields |= 1ULL << f;
+    }
+    s->sample.valid = fields;
+    s->sample.ts_ms = ts_ms;
+
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Unmaps the segment. It stays, with the last samples, for the next run;
+ * `rm /dev/shm/<name>` removes it.
+ */
+void snapshot_close(snapshot_t *sn)
+{
+    munmap(sn->seg, sizeof(snapshot_segment));
+    free(sn->name);
+    free(sn);
+}
@@ -0,0 +1,32 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+
+#include "sma.h"
+#include "sma_map.h"
+#include "snapshot_reader.h"
+
+/**
+ * Publishes the newest sample of every inverter into a shared memory segment,
+ * see snapshot_reader.h for the layout and the readers.
+ * Only the exporter thread writes it.
+ */
+typedef struct
+{
+    char *name;
+    snapshot_segment *seg;
+    int nfields;                // The first of sma_inverter_registers
+    signed char field_of[sizeof(SMA_Inverter)]; // Field by offset of its member, -1 when none
+} snapshot_t;
+
+/**
+ * Function predefinitions
+ */
+snapshot_t *snapshot_open(const char *name);
+int snapshot_slot_of(snapshot_t *sn, const char *inverter);
+void snapshot_publish(snapshot_t *sn, int slot, const sma_register *regs, size_t nregs,
+    const SMA_Inverter *inv, unsigned long valid, long long ts_ms);
+void snapshot_close(snapshot_t *sn);
+
+#endif
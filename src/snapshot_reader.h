@@ -0,0 +1,182 @@
+#ifndef SNAPSHOT_READER_H
+#define SNAPSHOT_READER_H
+
+/**
+ * Newest sample of every inverter in POSIX shared memory, published by the
+ * collector with SNAPSHOT set. Header only, for local readers in C or C++:
+ *
+ *   const snapshot_segment *seg = snapshot_attach("/msd");
+ *   int inv = snapshot_find(seg, "SB3000TL-21");
+ *   int pac = snapshot_field(seg, "Pac1");
+ *   double w;
+ *   if (snapshot_read_value(seg, inv, pac, &w, NULL) == 0) ...
+ *
+ * Every slot is guarded by a seqlock: its sequence is odd while the collector
+ * writes it, a reader copies the slot and retries when the sequence moved.
+ * Reads are plain loads from the mapping, without system calls or locks,
+ * and give up after SNAPSHOT_READ_TRIES instead of waiting for the writer.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC 0x534D4153U // "SMAS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_INVERTERS 256
+#define SNAPSHOT_MAX_FIELDS 64
+#define SNAPSHOT_MAX_NAME 64
+#define SNAPSHOT_READ_TRIES 64
+
+// Kind of a field, the collector keeps integers like TotalYield as doubles too
+#define SNAPSHOT_FIELD_ULONG 0
+#define SNAPSHOT_FIELD_DOUBLE 1
+#define SNAPSHOT_FIELD_LONG 2
+
+/**
+ * Newest sample of one inverter, a cache line aligned slot
+ */
+typedef struct
+{
+    int64_t ts_ms;                          // Wall clock ms of the sample, 0 before the first
+    uint64_t valid;                         // Fields the sample has, bit per field
+    double values[SNAPSHOT_MAX_FIELDS];
+} snapshot_sample;
+
+typedef struct
+{
+    uint32_t seq;                           // Odd while being written
+    uint32_t reserved;
+    char name[SNAPSHOT_MAX_NAME];           // Set once, before ninverters counts the slot
+    snapshot_sample sample;
+} __attribute__((aligned(64))) snapshot_slot;
+
+typedef struct
+{
+    uint32_t magic;                         // Set last, once the segment is ready
+    uint32_t version;
+    uint32_t ninverters;                    // Slots in use, only grows
+    uint32_t nfields;
+    char fields[SNAPSHOT_MAX_FIELDS][SNAPSHOT_MAX_NAME];
+    uint8_t kinds[SNAPSHOT_MAX_FIELDS];     // SNAPSHOT_FIELD_*
+    snapshot_slot slots[SNAPSHOT_MAX_INVERTERS];
+} snapshot_segment;
+
+/**
+ * Maps the segment read only. The collector keeps it across restarts,
+ * so the mapping stays valid.
+ * @param name Name of the segment, SNAPSHOT of the collector
+ * @return segment, NULL when there is none or it has another version
+ */
+static inline const snapshot_segment *snapshot_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(snapshot_segment))
+        p = mmap(NULL, sizeof(snapshot_segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    const snapshot_segment *seg = (const snapshot_segment *)p;
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != SNAPSHOT_MAGIC || seg->version != SNAPSHOT_VERSION)
+    {
+        munmap(p, sizeof(snapshot_segment));
+        return NULL;
+    }
+    return seg;
+}
+
+static inline void snapshot_detach(const snapshot_segment *seg)
+{
+    munmap((void *)seg, sizeof(snapshot_segment));
+}
+
+/**
+ * @return slot of an inverter, -1 when it has none (yet)
+ */
+static inline int snapshot_find(const snapshot_segment *seg, const char *inverter)
+{
+    uint32_t n = __atomic_load_n(&seg->ninverters, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n && i < SNAPSHOT_MAX_INVERTERS; i++)
+        if (strncmp(seg->slots[i].name, inverter, SNAPSHOT_MAX_NAME) == 0)
+            return (int)i;
+    return -1;
+}
+
+/**
+ * @return index of a field like "Pac1" in values, -1 when unknown
+ */
+static inline int snapshot_field(const snapshot_segment *seg, const char *field)
+{
+    for (uint32_t f = 0; f < seg->nfields && f < SNAPSHOT_MAX_FIELDS; f++)
+        if (strncmp(seg->fields[f], field, SNAPSHOT_MAX_NAME) == 0)
+            return (int)f;
+    return -1;
+}
+
+/**
+ * Copies the newest sample of an inverter
+ * @return 0, -1 when the slot kept changing or doesn't exist
+ */
+static inline int snapshot_read(const snapshot_segment *seg, int slot, snapshot_sample *out)
+{
+    if (slot < 0 || slot >= SNAPSHOT_MAX_INVERTERS)
+        return -1;
+    const snapshot_slot *s = &seg->slots[slot];
+
+    for (int i = 0; i < SNAPSHOT_READ_TRIES; i++)
+    {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        memcpy(out, (const void *)&s->sample, sizeof(snapshot_sample));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * Reads a single field of the newest sample, without copying the slot
+ * @param ts_ms Timestamp of the sample, may be NULL
+ * @return 0, 1 when the sample doesn't have the field, -1 like snapshot_read
+ */
+static inline int snapshot_read_value(const snapshot_segment *seg, int slot, int field, double *value, int64_t *ts_ms)
+{
+    if (slot < 0 || slot >= SNAPSHOT_MAX_INVERTERS || field < 0 || field >= SNAPSHOT_MAX_FIELDS)
+        return -1;
+    const snapshot_slot *s = &seg->slots[slot];
+
+    for (int i = 0; i < SNAPSHOT_READ_TRIES; i++)
+    {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        uint64_t valid = __atomic_load_n(&s->sample.valid, __ATOMIC_RELAXED);
+        double v;
+        __atomic_load(&s->sample.values[field], &v, __ATOMIC_RELAXED);
+        int64_t ts = __atomic_load_n(&s->sample.ts_ms, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (ts_ms != NULL)
+            *ts_ms = ts;
+        if (!(valid & (1ULL << field)))
+            return 1;
+        *value = v;
+        return 0;
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+
+/**
+ * Start of every record, followed by its lines
+ */
+typedef struct
+{
+    uint32_t len;           // Of the lines
+    uint32_t precision_ns;  // Timestamp unit of the lines, in ns
+} spool_record;
+
+#define SPOOL_RECORD_HEADER sizeof(spool_record)
+
+/**
+ * Copies into the ring at a monotonic offset, wrapping around the end
+ */
+static void spool_copy_in(spool_t *sp, uint64_t off, const void *src, size_t len)
+{
+    size_t pos = off % sp->hdr->capacity;
+    size_t first = len < sp->hdr->capacity - pos ? len : sp->hdr->capacity - pos;
+
+    memcpy(sp->data + pos, src, first);
+    memcpy(sp->data, (const uint8_t *)src + first, len - first);
+}
+
+/**
+ * Copies out of the ring at a monotonic offset, wrapping around the end
+ */
+static void spool_copy_out(spool_t *sp, uint64_t off, void *dst, size_t len)
+{
+    size_t pos = off % sp->hdr->capacity;
+    size_t first = len < sp->hdr->capacity - pos ? len : sp->hdr->capacity - pos;
+
+    memcpy(dst, sp->data + pos, first);
+    memcpy((uint8_t *)dst + first, sp->data, len - first);
+}
+
+/**
+ * Checks the length of the record at off against the records published
+ * before tail, a torn or corrupted length would otherwise run past them.
+ * Empties the spool when the length can't be right.
+ * @return 0, -1 when the spool was emptied
+ */
+static int spool_check(spool_t *sp, uint64_t off, uint64_t tail, uint32_t len)
+{
+    if (tail - off >= SPOOL_RECORD_HEADER && len <= tail - off - SPOOL_RECORD_HEADER && len <= sp->hdr->capacity)
+        return 0;
+
+    fprintf(stderr, "spool: Record at %llu has a bad length of %u bytes, discarding the spool\n", (unsigned long long)off, len);
+    sp->hdr->head = tail;
+    return -1;
+}
+
+/**
+ * Opens or creates a spool file. Records of an existing spool with the same
+ * capacity are kept, otherwise the spool starts empty.
+ * @param path File to map
+ * @param capacity Max number of bytes the spool may hold
+ * @param policy SPOOL_DROP_OLDEST or SPOOL_DROP_NEWEST
+ * @return spool, NULL when failed
+ */
+spool_t *spool_open(const char *path, size_t capacity, int policy)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1)
+    {
+        fprintf(stderr, "spool: Can't open %s\n", path);
+        return NULL;
+    }
+
+    size_t map_size = sizeof(spool_header) + capacity;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || ((size_t)st.st_size != map_size && ftruncate(fd, map_size) == -1))
+    {
+        fprintf(stderr, "spool: Can't size %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "spool: mmap failed\n");
+        close(fd);
+        return NULL;
+    }
+
+    spool_t *sp = (spool_t *)malloc(sizeof(spool_t));
+    sp->fd = fd;
+    sp->policy = policy;
+    sp->map_size = map_size;
+    sp->hdr = (spool_header *)map;
+    sp->data = (uint8_t *)map + sizeof(spool_header);
+
+    spool_header *hdr = sp->hdr;
+    if (hdr->magic != SPOOL_MAGIC || hdr->capacity != capacity || hdr->tail - hdr->head > capacity)
+    {
+        if (hdr->magic == SPOOL_MAGIC)
+            fprintf(stderr, "spool: %s has a different size, discarding it\n", path);
+        else if ((hdr->magic & 0xFFFFFFFFFFULL) == (SPOOL_MAGIC & 0xFFFFFFFFFFULL))
+            fprintf(stderr, "spool: %s has an older format, discarding it\n", path);
+        memset(hdr, 0, sizeof(spool_header));
+        hdr->capacity = capacity;
+        hdr->magic = SPOOL_MAGIC;
+    }
+    else if (hdr->tail != hdr->head)
+    {
+        printf("spool: %s holds %lu bytes to replay\n", path, (unsigned long)(hdr->tail - hdr->head));
+    }
+
+    return sp;
+}
+
+/**
+ * Stores a record, making room according to the drop policy
+ * @param record Line protocol, one or more lines
+ * @param len Length of the record
+ * @param precision_ns Timestamp unit of the lines, see linePrecisionNs
+ * @return 0 when stored, -1 when dropped
+ */
+int spool_append(spool_t *sp, const char *record, size_t len, long long precision_ns)
+{
+    spool_header *hdr = sp->hdr;
+    size_t needed = SPOOL_RECORD_HEADER + len;
+
+    if (needed > hdr->capacity)
+    {
+        hdr->dropped++;
+        return -1;
+    }
+
+    while (hdr->head < hdr->tail && hdr->capacity - (hdr->tail - hdr->head) < needed)
+    {
+        if (sp->policy == SPOOL_DROP_NEWEST)
+        {
+            hdr->dropped++;
+            return -1;
+        }
+
+        spool_record oldest;
+        spool_copy_out(sp, hdr->head, &oldest, SPOOL_RECORD_HEADER);
+        if (spool_check(sp, hdr->head, hdr->tail, oldest.len) != 0)
+            break;
+        hdr->head += SPOOL_RECORD_HEADER + oldest.len;
+        hdr->dropped++;
+    }
+
+    spool_record rec = {(uint32_t)len, (uint32_t)precision_ns};
+    spool_copy_in(sp, hdr->tail, &rec, SPOOL_RECORD_HEADER);
+    spool_copy_in(sp, hdr->tail + SPOOL_RECORD_HEADER, record, len);
+
+    // Publish the record only once its bytes are in place
+    __atomic_store_n(&hdr->tail, hdr->tail + needed, __ATOMIC_RELEASE);
+    msync(sp->hdr, sp->map_size, MS_ASYNC);
+
+    return 0;
+}
+
+/**
+ * Number of bytes waiting to be replayed
+ */
+size_t spool_used(spool_t *sp)
+{
+    return sp->hdr->tail - sp->hdr->head;
+}
+
+/**
+ * Copies the oldest records of the same precision into buf, separated by newlines.
+ * Records stay in the spool until spool_commit(next) is called.
+ * @param buf Destination
+ * @param size Size of buf, records that don't fit in an empty buf are dropped
+ * @param budget Bytes to copy at most, the first record is copied even when larger
+ * @param next Set to the offset to commit once the records are written
+ * @param precision_ns Set to the timestamp unit of the lines in buf
+ * @return number of bytes in buf, 0 when empty
+ */
+size_t spool_read(spool_t *sp, char *buf, size_t size, size_t budget, uint64_t *next, long long *precision_ns)
+{
+    uint64_t off = sp->hdr->head;
+    uint64_t tail = __atomic_load_n(&sp->hdr->tail, __ATOMIC_ACQUIRE);
+    size_t used = 0;
+
+    while (off < tail)
+    {
+        spool_record rec;
+        spool_copy_out(sp, off, &rec, SPOOL_RECORD_HEADER);
+        uint32_t len = rec.len;
+        if (spool_check(sp, off, tail, len) != 0)
+        {
+            // What is in buf was checked already
+            off = tail;
+            break;
+        }
+
+        size_t sep = used ? 1 : 0;
+        if (used == 0 && len > size)
+        {
+            // Would never fit, don't let it block the spool
+            fprintf(stderr, "spool: Dropping record of %u bytes\n", len);
+            off += SPOOL_RECORD_HEADER + len;
+            sp->hdr->head = off;
+            sp->hdr->dropped++;
+            continue;
+        }
+        if (used + sep + len > size || (used > 0 && (used + sep + len > budget || rec.precision_ns != *precision_ns)))
+            break;
+
+        if (sep)
+            buf[used++] = '\n';
+        *precision_ns = rec.precision_ns;
+        spool_copy_out(sp, off + SPOOL_RECORD_HEADER, buf + used, len);
+        used += len;
+        off += SPOOL_RECORD_HEADER + len;
+    }
+
+    *next = off;
+    return used;
+}
+
+/**
+ * Removes records returned by spool_read
+ */
+void spool_commit(spool_t *sp, uint64_t next)
+{
+    // Records may have been dropped meanwhile
+    if (next > sp->hdr->head)
+        sp->hdr->head = next;
+    msync(sp->hdr, sp->map_size, MS_ASYNC);
+}
+
+void spool_close(spool_t *sp)
+{
+    msync(sp->hdr, sp->map_size, MS_SYNC);
+    munmap(sp->hdr, sp->map_size);
+    close(sp->fd);
+    free(sp);
+}
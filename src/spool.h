@@ -0,0 +1,50 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPOOL_MAGIC 0x324C4F4F5053ULL // "SPOOL2", records carry their precision
+
+enum
+{
+    SPOOL_DROP_OLDEST,  // Make room by dropping the oldest records
+    SPOOL_DROP_NEWEST,  // Refuse new records while full
+};
+
+/**
+ * Start of the spool file, followed by the data ring.
+ * head and tail only ever grow, the position in the ring is offset % capacity.
+ */
+typedef struct
+{
+    uint64_t magic;
+    uint64_t capacity;  // Size of the data ring in bytes
+    uint64_t head;      // Offset of the oldest record
+    uint64_t tail;      // Offset at which the next record is written
+    uint64_t dropped;   // Records lost because the spool was full
+} spool_header;
+
+/**
+ * Memory mapped ring of line protocol records that could not be written
+ */
+typedef struct
+{
+    int fd;
+    int policy;
+    size_t map_size;
+    spool_header *hdr;
+    uint8_t *data;
+} spool_t;
+
+/**
+ * Function predefinitions
+ */
+spool_t *spool_open(const char *path, size_t capacity, int policy);
+int spool_append(spool_t *sp, const char *record, size_t len, long long precision_ns);
+size_t spool_used(spool_t *sp);
+size_t spool_read(spool_t *sp, char *buf, size_t size, size_t budget, uint64_t *next, long long *precision_ns);
+void spool_commit(spool_t *sp, uint64_t next);
+void spool_close(spool_t *sp);
+
+#endif
@@ -0,0 +1,170 @@
+#ifdef IO_URING
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uring_enter(uring_t *u, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/**
+ * Sets up a ring. Fails where io_uring is missing or forbidden,
+ * e.g. kernels before 5.11 or containers that filter it out.
+ * @param entries Submission queue entries, a power of 2
+ * @return 0, -1 when failed
+ */
+int uring_init(uring_t *u, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(u, 0, sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0)
+        return -1;
+
+    // Timeouts are passed to io_uring_enter, which needs 5.11
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        uring_exit(u);
+        return -1;
+    }
+
+    char *sq = (char *)u->sq_ring;
+    u->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    u->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    u->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->sq_array = (unsigned int *)(sq + params.sq_off.array);
+
+    char *cq = (char *)u->cq_ring;
+    u->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Queues an operation, it goes to the kernel with the next uring_submit_wait.
+ * Submits what is queued first when the submission queue is full.
+ * @param user_data Given back with the completion
+ * @return zeroed entry to fill in, NULL when the ring is full
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *u, unsigned long long user_data)
+{
+    unsigned int tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    {
+        uring_enter(u, u->sq_entries, 0, 0, NULL, 0);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+
+    unsigned int index = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->inflight++;
+    return sqe;
+}
+
+/**
+ * Submits everything queued and waits for at least one completion
+ * @param timeout_ms How long to wait, -1 for no limit
+ * @return 0, -1 with errno ETIME when timed out, or another error
+ */
+int uring_submit_wait(uring_t *u, int timeout_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (unsigned long long)&ts;
+    }
+
+    unsigned int queued = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    int rc = uring_enter(u, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * Oldest completion, hand it back with uring_cqe_seen
+ * @return completion, NULL when there is none
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u)
+{
+    unsigned int head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+    u->inflight--;
+}
+
+/**
+ * Cancels every operation and waits until the kernel let go of their buffers.
+ * Gives up after a second, e.g. on kernels before 5.19 that can't cancel all at once.
+ */
+void uring_cancel_all(uring_t *u)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u, 0);
+    if (sqe == NULL)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+    while (u->inflight > 0)
+    {
+        if (uring_submit_wait(u, 1000) != 0 && errno != EINTR)
+            return;
+        while (uring_peek_cqe(u) != NULL)
+            uring_cqe_seen(u);
+    }
+}
+
+void uring_exit(uring_t *u)
+{
+    if (u->sqes != NULL && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+/**
+ * Minimal io_uring on top of the raw system calls, for the poller when built
+ * with `make IO_URING=1`. Operations are queued with uring_get_sqe and all
+ * go to the kernel with the next uring_submit_wait, one system call per tick.
+ */
+#ifdef IO_URING
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// Submission queue entries, the completion queue gets twice as many
+#define URING_ENTRIES 256
+
+typedef struct
+{
+    int fd;
+    unsigned int inflight;      // Operations queued or submitted without completion
+
+    // Submission queue, shared with the kernel
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue, shared with the kernel
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Function predefinitions
+ */
+int uring_init(uring_t *u, unsigned int entries);
+struct io_uring_sqe *uring_get_sqe(uring_t *u, unsigned long long user_data);
+int uring_submit_wait(uring_t *u, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+void uring_cancel_all(uring_t *u);
+void uring_exit(uring_t *u);
+
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "window.h"
+
+/**
+ * Counters and states are summarized by their last value only
+ */
+static int window_last_only(const sma_register *reg)
+{
+    return reg->type == SMA_U32 || reg->type == SMA_ENUM;
+}
+
+/**
+ * @param regs Registers of the inverter
+ * @param seconds Length of a window
+ */
+window_t *window_create(const sma_register *regs, size_t nregs, int seconds)
+{
+    window_t *w = (window_t *)calloc(1, sizeof(window_t));
+    w->regs = regs;
+    w->nregs = nregs;
+    w->period_ms = seconds * 1000LL;
+    w->fields = (window_field *)calloc(nregs ? nregs : 1, sizeof(window_field));
+    return w;
+}
+
+/**
+ * @param now Wall clock ms
+ * @return 1 when the window holds samples and ended before now
+ */
+int window_expired(const window_t *w, long long now)
+{
+    return w->start != 0 && now >= w->start + w->period_ms;
+}
+
+/**
+ * Adds a sample, call window_expired() first
+ * @param valid Bit r set for registers whose value is valid
+ * @param now Wall clock ms of the sample
+ */
+void window_add(window_t *w, const SMA_Inverter *inv, unsigned long valid, long long now)
+{
+    if (w->start == 0)
+        w->start = now / w->period_ms * w->period_ms;
+    w->samples++;
+
+    for (size_t r = 0; r < w->nregs; r++)
+    {
+        if (!(valid & (1UL << r)))
+            continue;
+
+        window_field *f = &w->fields[r];
+        double value = sma_field_value(&w->regs[r], inv);
+
+        if (f->n == 0 || value < f->min)
+            f->min = value;
+        if (f->n == 0 || value > f->max)
+            f->max = value;
+        f->sum += value;
+        f->last = value;
+        f->n++;
+    }
+}
+
+static void window_value(LineBuffer &buf, const sma_register *reg, double value)
+{
+    if (reg->kind == SMA_FIELD_DOUBLE)
+    {
+        buf.append(value);
+        return;
+    }
+
+    // min, max and last are values the member had, whole and in its range
+    if (reg->kind == SMA_FIELD_LONG || value < 0)
+        buf.append((long long)value);
+    else
+        buf.append((unsigned long long)value);
+    buf.append('i');
+}
+
+static void window_key(LineBuffer &buf, const sma_register *reg, const char *suffix, bool &first)
+{
+    if (!first)
+        buf.append(',');
+    first = false;
+    buf.append(reg->name, strlen(reg->name));
+    buf.append(suffix, strlen(suffix));
+    buf.append('=');
+}
+
+/**
+ * Appends the summary as one line, without trailing newline:
+ * <field>_min, <field>_max, <field>_mean, the number of samples that had
+ * the field as <field>_count and the last value as <field>,
+ * the last value only for counters and states, and the number of samples.
+ * Stamped with the start of the window.
+ * @param precision_ns Length of a timestamp unit in ns
+ */
+void window_write(const window_t *w, LineBuffer &buf, const char *measurement, const char *tag, const char *tagValue, long long precision_ns)
+{
+    buf.append(measurement, strlen(measurement));
+    buf.append(',');
+    buf.append(tag, strlen(tag));
+    buf.append('=');
+    buf.appendTag(tagValue);
+    buf.append(' ');
+
+    bool first = true;
+    for (size_t r = 0; r < w->nregs; r++)
+    {
+        const window_field *f = &w->fields[r];
+        const sma_register *reg = &w->regs[r];
+        if (f->n == 0)
+            continue;
+
+        if (!window_last_only(reg))
+        {
+            window_key(buf, reg, "_min", first);
+            window_value(buf, reg, f->min);
+            window_key(buf, reg, "_max", first);
+            window_value(buf, reg, f->max);
+            window_key(buf, reg, "_mean", first);
+            buf.append(f->sum / f->n);
+            window_key(buf, reg, "_count", first);
+            buf.append((unsigned long long)f->n);
+            buf.append('i');
+        }
+        window_key(buf, reg, "", first);
+        window_value(buf, reg, f->last);
+    }
+
+    if (!first)
+        buf.append(',');
+    buf.append("samples=", 8);
+    buf.append((unsigned long long)w->samples);
+    buf.append('i');
+
+    buf.append(' ');
+    buf.append((unsigned long long)(w->start * 1000000 / precision_ns));
+}
+
+void window_reset(window_t *w)
+{
+    w->start = 0;
+    w->samples = 0;
+    memset(w->fields, 0, sizeof(window_field) * (w->nregs ? w->nregs : 1));
+}
+
+void window_destroy(window_t *w)
+{
+    if (w == NULL)
+        return;
+
+    free(w->fields);
+    free(w);
+}
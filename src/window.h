@@ -0,0 +1,42 @@
+#ifndef WINDOW_H
+#define WINDOW_H
+
+#include "sma_map.h"
+#include "lineproto.hpp"
+
+/**
+ * Summary of one field over a window
+ */
+typedef struct
+{
+    double min;
+    double max;
+    double sum;
+    double last;
+    unsigned long n;
+} window_field;
+
+/**
+ * Tumbling window over the samples of an inverter, aligned to the wall clock
+ */
+typedef struct
+{
+    const sma_register *regs;
+    size_t nregs;
+    long long period_ms;
+    long long start;            // Wall clock ms at which the window started, 0 when empty
+    unsigned long samples;
+    window_field *fields;       // Per register
+} window_t;
+
+/**
+ * Function predefinitions
+ */
+window_t *window_create(const sma_register *regs, size_t nregs, int seconds);
+int window_expired(const window_t *w, long long now);
+void window_add(window_t *w, const SMA_Inverter *inv, unsigned long valid, long long now);
+void window_write(const window_t *w, LineBuffer &buf, const char *measurement, const char *tag, const char *tagValue, long long precision_ns);
+void window_reset(window_t *w);
+void window_destroy(window_t *w);
+
+#endif
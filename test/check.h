@@ -0,0 +1,21 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+/**
+ * Counts a failed condition and goes on, main returns failed != 0
+ */
+static int failed;
+
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failed++;                                                   \
+        }                                                               \
+    } while (0)
+
+#endif
@@ -0,0 +1,95 @@
+/**
+ * Decoding of signed registers, the inverter reports negative power while
+ * it draws from the grid and temperatures below zero.
+ * Build and run with `make test`
+ */
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "sma.h"
+#include "sma_map.h"
+#include "sma_decode.h"
+#include "lineproto.hpp"
+#include "check.h"
+
+static const sma_register *reg_of(const char *name)
+{
+    for (size_t r = 0; r < sma_inverter_registers_count; r++)
+        if (strcmp(sma_inverter_registers[r].name, name) == 0)
+            return &sma_inverter_registers[r];
+    return NULL;
+}
+
+/**
+ * Decodes a single S32 register from its two words, high word first
+ */
+static void decode(const sma_register *reg, unsigned long raw, SMA_Inverter *inv)
+{
+    uint16_t words[2] = {(uint16_t)(raw >> 16), (uint16_t)raw};
+    sma_decode_registers(reg, 1, reg->addr, words, inv);
+}
+
+static constexpr auto powerLine = lineSchema<SMA_Inverter>("measurement", "inverter",
+    lineField("Pac1", &SMA_Inverter::Pac1),
+    lineField("TotalYield", &SMA_Inverter::TotalYield));
+
+int main(void)
+{
+    const sma_register *pac = reg_of("Pac1");
+    const sma_register *reactive = reg_of("ReactivePower");
+    const sma_register *yield = reg_of("TotalYield");
+    const sma_register *temp = reg_of("Temperature");
+    CHECK(pac != NULL && reactive != NULL && yield != NULL && temp != NULL);
+    if (failed)
+        return 1;
+    CHECK(pac->kind == SMA_FIELD_LONG);
+    CHECK(reactive->kind == SMA_FIELD_LONG);
+
+    SMA_Inverter inv = {};
+
+    // -250 W
+    decode(pac, 0xFFFFFF06UL, &inv);
+    CHECK(inv.Pac1 == -250);
+    CHECK(sma_field_value(pac, &inv) == -250.0);
+
+    decode(reactive, 0xFFFFFC18UL, &inv);
+    CHECK(inv.ReactivePower == -1000);
+
+    // All ones is -1 for signed types, not NaN
+    decode(pac, 0xFFFFFFFFUL, &inv);
+    CHECK(inv.Pac1 == -1);
+    CHECK(sma_valid_fields(pac, 1, &inv) == 1);
+
+    // -0.1 C
+    decode(temp, 0xFFFFFFFFUL, &inv);
+    CHECK(fabs(inv.Temperature + 0.1) < 1e-9);
+
+    // Lowest value that isn't NaN
+    decode(pac, 0x80000001UL, &inv);
+    CHECK(inv.Pac1 == -2147483647L);
+
+    decode(pac, SMA_NAN_S32, &inv);
+    CHECK(inv.Pac1 == SMA_FIELD_NAN_LONG);
+    CHECK(isnan(sma_field_value(pac, &inv)));
+    CHECK(sma_valid_fields(pac, 1, &inv) == 0);
+
+    // Unsigned counters stay unsigned
+    decode(yield, 0x80000001UL, &inv);
+    CHECK(inv.TotalYield == 0x80000001UL);
+    decode(yield, SMA_NAN_U32, &inv);
+    CHECK(inv.TotalYield == SMA_FIELD_NAN);
+
+    // Written as a signed integer
+    inv.Pac1 = -250;
+    inv.TotalYield = 12345;
+    LineBuffer line;
+    powerLine.write(line, inv, "a", 1716631685);
+    const char expect[] = "measurement,inverter=a Pac1=-250i,TotalYield=12345i 1716631685";
+    CHECK(line.length() == sizeof(expect) - 1 && memcmp(line.data(), expect, line.length()) == 0);
+
+    if (failed)
+        return 1;
+    printf("decode: ok\n");
+    return 0;
+}
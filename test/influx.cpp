@@ -0,0 +1,297 @@
+/**
+ * The InfluxDB client against a stand-in server on 127.0.0.1 that answers
+ * every request with the next response of a script.
+ * Build and run with `make test`
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "influx.hpp"
+#include "check.h"
+
+#define STANDIN_MAX_STEPS 8
+
+enum
+{
+    STEP_KEEP,      // Respond and keep the connection
+    STEP_CLOSE,     // Respond, then close the connection without saying so
+    STEP_SILENT,    // Don't respond, wait for the client to give up
+};
+
+typedef struct
+{
+    const char *response;
+    int action;
+} standin_step;
+
+/**
+ * Stand-in server, serves the steps one request after the other, then quits
+ */
+typedef struct
+{
+    int listen_fd;
+    unsigned short port;
+    standin_step steps[STANDIN_MAX_STEPS];
+    int nsteps;
+    int accepts;                // Connections accepted
+    int requests;               // Requests read
+    std::string body;           // Of the last request
+    pthread_t thread;
+} standin_t;
+
+/**
+ * Reads one request
+ * @return 0, -1 when the client closed the connection
+ */
+static int standin_read(int c, std::string &rx, std::string &body)
+{
+    char buf[4096];
+    size_t end;
+    while ((end = rx.find("\r\n\r\n")) == std::string::npos)
+    {
+        ssize_t n = recv(c, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return -1;
+        rx.append(buf, n);
+    }
+
+    const char *cl = strcasestr(rx.c_str(), "Content-Length:");
+    size_t len = cl != NULL && (size_t)(cl - rx.c_str()) < end ? atol(cl + 15) : 0;
+    while (rx.length() < end + 4 + len)
+    {
+        ssize_t n = recv(c, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return -1;
+        rx.append(buf, n);
+    }
+
+    body = rx.substr(end + 4, len);
+    rx.erase(0, end + 4 + len);
+    return 0;
+}
+
+static void *standin_serve(void *arg)
+{
+    standin_t *srv = (standin_t *)arg;
+    int step = 0;
+
+    while (step < srv->nsteps)
+    {
+        int c = accept(srv->listen_fd, NULL, NULL);
+        if (c == -1)
+            break;
+        __atomic_fetch_add(&srv->accepts, 1, __ATOMIC_RELEASE);
+
+        std::string rx, body;
+        while (step < srv->nsteps && standin_read(c, rx, body) == 0)
+        {
+            const standin_step *st = &srv->steps[step++];
+            srv->body = body;
+            __atomic_fetch_add(&srv->requests, 1, __ATOMIC_RELEASE);
+
+            if (st->action == STEP_SILENT)
+            {
+                while (standin_read(c, rx, body) == 0)
+                    ;
+                break;
+            }
+            send(c, st->response, strlen(st->response), MSG_NOSIGNAL);
+            if (st->action == STEP_CLOSE)
+                break;
+        }
+        close(c);
+    }
+
+    return NULL;
+}
+
+static void standin_start(standin_t *srv)
+{
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t salen = sizeof(sa);
+    if (bind(srv->listen_fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(srv->listen_fd, 4) == -1
+        || getsockname(srv->listen_fd, (struct sockaddr *)&sa, &salen) == -1)
+    {
+        perror("standin");
+        exit(1);
+    }
+    srv->port = ntohs(sa.sin_port);
+    pthread_create(&srv->thread, NULL, standin_serve, srv);
+}
+
+static void standin_stop(standin_t *srv)
+{
+    shutdown(srv->listen_fd, SHUT_RDWR);
+    pthread_join(srv->thread, NULL);
+    close(srv->listen_fd);
+}
+
+static void standin_add(standin_t *srv, const char *response, int action)
+{
+    srv->steps[srv->nsteps].response = response;
+    srv->steps[srv->nsteps].action = action;
+    srv->nsteps++;
+}
+
+static const char NO_CONTENT[] = "HTTP/1.1 204 No Content\r\n\r\n";
+static const char NO_CONTENT_CLOSE[] = "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n";
+static const char BAD_REQUEST[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 25\r\n\r\n{\"message\":\"bad points\"}\n";
+static const char SERVER_ERROR[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+static const char UNAUTHORIZED[] = "HTTP/1.1 401 Unauthorized\r\nContent-Length: 0\r\n\r\n";
+static const char TOO_LARGE[] = "HTTP/1.1 413 Request Entity Too Large\r\nContent-Length: 0\r\n\r\n";
+static const char TOO_MANY[] = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 60\r\nContent-Length: 0\r\n\r\n";
+
+static void keep_alive(void)
+{
+    standin_t srv = {};
+    for (int i = 0; i < 3; i++)
+        standin_add(&srv, NO_CONTENT, STEP_KEEP);
+    standin_start(&srv);
+
+    Influx ifx("127.0.0.1", srv.port, "org", "bucket", "token");
+    CHECK(ifx.connectNow() == 0);
+    CHECK(ifx.writeLines("m,t=a f=1i 1") == 0);
+    CHECK(ifx.writeLines("m,t=a f=2i 2") == 0);
+    CHECK(ifx.writeLines("m,t=a f=3i 3") == 0);
+    CHECK(ifx.status() == 204);
+    ifx.close();
+
+    standin_stop(&srv);
+    CHECK(srv.accepts == 1);
+    CHECK(srv.requests == 3);
+    CHECK(srv.body == "m,t=a f=3i 3");
+}
+
+static void reconnect(void)
+{
+    standin_t srv = {};
+    standin_add(&srv, NO_CONTENT_CLOSE, STEP_CLOSE);
+    standin_add(&srv, NO_CONTENT, STEP_CLOSE);
+    standin_add(&srv, NO_CONTENT, STEP_KEEP);
+    standin_start(&srv);
+
+    Influx ifx("127.0.0.1", srv.port, "org", "bucket", "token");
+    CHECK(ifx.connectNow() == 0);
+
+    // Announced with Connection: close
+    CHECK(ifx.writeLines("m f=1i 1") == 0);
+    CHECK(ifx.writeLines("m f=2i 2") == 0);
+
+    // Closed while idle, e.g. by its keep-alive timeout
+    usleep(50000);
+    CHECK(ifx.writeLines("m f=3i 3") == 0);
+
+    std::string body;
+    CHECK(!ifx.takeFailed(body));
+    ifx.close();
+
+    standin_stop(&srv);
+    CHECK(srv.accepts == 3);
+    CHECK(srv.requests == 3);
+}
+
+static void statuses(void)
+{
+    standin_t srv = {};
+    standin_add(&srv, NO_CONTENT, STEP_KEEP);
+    standin_add(&srv, BAD_REQUEST, STEP_KEEP);
+    standin_add(&srv, TOO_LARGE, STEP_KEEP);
+    standin_add(&srv, UNAUTHORIZED, STEP_KEEP);
+    standin_add(&srv, SERVER_ERROR, STEP_KEEP);
+    standin_add(&srv, TOO_MANY, STEP_KEEP);
+    standin_start(&srv);
+
+    Influx ifx("127.0.0.1", srv.port, "org", "bucket", "token");
+    CHECK(ifx.connectNow() == 0);
+    std::string body;
+
+    CHECK(ifx.writeLines("m f=1i 1") == 0);
+    CHECK(ifx.status() == 204);
+
+    // The points are wrong, retrying doesn't help
+    CHECK(ifx.writeLines("m f=bad 2") == Influx::ERR_REJECTED);
+    CHECK(ifx.status() == 400);
+    CHECK(!ifx.takeFailed(body));
+    CHECK(ifx.writeLines("m f=2i 2") == Influx::ERR_REJECTED);
+    CHECK(ifx.status() == 413);
+    CHECK(!ifx.takeFailed(body));
+
+    // The token may be fixed
+    CHECK(ifx.writeLines("m f=3i 3") == Influx::ERR_REJECTED);
+    CHECK(ifx.status() == 401);
+    CHECK(ifx.takeFailed(body) && body == "m f=3i 3");
+
+    // The server is, worth retrying
+    CHECK(ifx.writeLines("m f=3i 3") == Influx::ERR_REJECTED);
+    CHECK(ifx.status() == 500);
+    CHECK(ifx.takeFailed(body) && body == "m f=3i 3");
+
+    CHECK(ifx.writeLines("m f=4i 4") == Influx::ERR_REJECTED);
+    CHECK(ifx.status() == 429);
+    CHECK(ifx.takeFailed(body) && body == "m f=4i 4");
+    CHECK(!ifx.available());
+    CHECK(ifx.retryAfter() > time(NULL));
+
+    // Not sent before Retry-After
+    CHECK(ifx.writeLines("m f=5i 5") == Influx::ERR_REJECTED);
+    CHECK(ifx.takeFailed(body) && body == "m f=5i 5");
+    ifx.close();
+
+    standin_stop(&srv);
+    CHECK(srv.requests == 6);
+}
+
+static void unresolved(void)
+{
+    Influx ifx("", 8086, "org", "bucket", "token");
+    CHECK(ifx.connectNow() == -2);
+    CHECK(!ifx.available());
+}
+
+static void timeout(void)
+{
+    standin_t srv = {};
+    standin_add(&srv, NULL, STEP_SILENT);
+    standin_start(&srv);
+
+    Influx ifx("127.0.0.1", srv.port, "org", "bucket", "token");
+    ifx.timeout(200);
+    CHECK(ifx.connectNow() == 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK(ifx.writeLines("m f=1i 1") == Influx::ERR_CONNECTION);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    CHECK(ms >= 150 && ms < 1000);
+
+    std::string body;
+    CHECK(ifx.takeFailed(body) && body == "m f=1i 1");
+    ifx.close();
+
+    standin_stop(&srv);
+}
+
+int main(void)
+{
+    keep_alive();
+    reconnect();
+    statuses();
+    timeout();
+    unresolved();
+
+    if (failed)
+        return 1;
+    printf("influx: ok\n");
+    return 0;
+}
@@ -0,0 +1,49 @@
+/**
+ * Window summaries of signed fields and of fields some samples don't have.
+ * Build and run with `make test`
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "sma.h"
+#include "sma_map.h"
+#include "window.h"
+#include "check.h"
+
+int main(void)
+{
+    const sma_register *pac = NULL;
+    for (size_t r = 0; r < sma_inverter_registers_count; r++)
+        if (strcmp(sma_inverter_registers[r].name, "Pac1") == 0)
+            pac = &sma_inverter_registers[r];
+    CHECK(pac != NULL);
+    if (failed)
+        return 1;
+
+    // Drawing power, then feeding in, then without Pac1
+    window_t *w = window_create(pac, 1, 60);
+    SMA_Inverter inv = {};
+    inv.Pac1 = -100;
+    window_add(w, &inv, 1, 60000);
+    inv.Pac1 = 50;
+    window_add(w, &inv, 1, 65000);
+    window_add(w, &inv, 0, 70000);
+    CHECK(!window_expired(w, 110000));
+    CHECK(window_expired(w, 120000));
+
+    LineBuffer line;
+    window_write(w, line, "measurement", "inverter", "a", 1000000000);
+    const char expect[] = "measurement,inverter=a Pac1_min=-100i,Pac1_max=50i,Pac1_mean=-25,Pac1_count=2i,Pac1=50i,samples=3i 60";
+    CHECK(line.length() == sizeof(expect) - 1 && memcmp(line.data(), expect, line.length()) == 0);
+    if (failed)
+        fprintf(stderr, "%.*s\n", (int)line.length(), line.data());
+
+    window_reset(w);
+    CHECK(w->start == 0 && w->samples == 0 && w->fields[0].n == 0);
+    window_destroy(w);
+
+    if (failed)
+        return 1;
+    printf("window: ok\n");
+    return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * Reads ARCHIVE day files back as InfluxDB line protocol, e.g. to fill in
+ * a database once the uplink is back:
+ *   sma_archive -f 1700000000 archive/20231114.sma | curl --data-binary @- ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "lineproto.hpp"
+
+typedef struct
+{
+    LineBuffer line;
+    long long precision_ns;
+    size_t bytes;               // Of line protocol written
+} reader_t;
+
+/**
+ * Writes a sample like main does, one line per sample with all fields that were read
+ */
+static void writeLine(void *ctx, const char *name, const archive_field *fields, int nfields,
+    long long ts_ms, const archive_value *values, unsigned long mask)
+{
+    reader_t *rd = (reader_t *)ctx;
+    LineBuffer &line = rd->line;
+    line.clear();
+
+    line.append("measurement,inverter=", 21);
+    line.appendTag(name);
+    line.append(' ');
+
+    bool first = true;
+    for (int f = 0; f < nfields; f++)
+    {
+        if (!(mask & (1UL << f)))
+            continue;
+        if (!first)
+            line.append(',');
+        first = false;
+
+        line.append(fields[f].name, strlen(fields[f].name));
+        line.append('=');
+        if (fields[f].kind == SMA_FIELD_DOUBLE)
+            line.append(values[f].d);
+        else
+        {
+            if (fields[f].kind == SMA_FIELD_LONG)
+                line.append((long long)values[f].l);
+            else
+                line.append((unsigned long long)values[f].u);
+            line.append('i');
+        }
+    }
+
+    line.append(' ');
+    line.append((unsigned long long)(ts_ms * 1000000 / rd->precision_ns));
+    line.append('\n');
+
+    fwrite(line.data(), 1, line.length(), stdout);
+    rd->bytes += line.length();
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: sma_archive [-f from s] [-t to s] [-i inverter] [-p s|ms|us|ns] [-s] file.sma...\n");
+}
+
+int main(int argc, char **argv)
+{
+    long long from_ms = 0;
+    long long to_ms = LLONG_MAX;
+    const char *name = NULL;
+    const char *precision = "ms";
+    int stats = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:i:p:sh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': from_ms = atoll(optarg) * 1000; break;
+        case 't': to_ms = atoll(optarg) * 1000 + 999; break;
+        case 'i': name = optarg; break;
+        case 'p': precision = optarg; break;
+        case 's': stats = 1; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind == argc)
+    {
+        usage();
+        return 1;
+    }
+
+    reader_t rd;
+    rd.bytes = 0;
+    rd.precision_ns = linePrecisionNs(precision);
+    if (rd.precision_ns == 0)
+    {
+        fprintf(stderr, "sma_archive: Precision must be s, ms, us or ns\n");
+        return 1;
+    }
+
+    long samples = 0;
+    unsigned long long archived = 0;
+    int rc = 0;
+    for (int i = optind; i < argc; i++)
+    {
+        long n = archive_read(argv[i], from_ms, to_ms, name, writeLine, &rd);
+        if (n < 0)
+        {
+            rc = 1;
+            continue;
+        }
+        samples += n;
+
+        // Archive size includes the index
+        struct stat st;
+        char index[PATH_MAX];
+        snprintf(index, sizeof(index), "%.*s.idx", (int)strlen(argv[i]) - 4, argv[i]);
+        if (stat(argv[i], &st) == 0)
+            archived += st.st_size;
+        if (stat(index, &st) == 0)
+            archived += st.st_size;
+    }
+    fflush(stdout);
+
+    if (stats)
+        fprintf(stderr, "sma_archive: %ld samples, %llu bytes archived, %lu bytes of line protocol, %.1fx\n",
+            samples, archived, (unsigned long)rd.bytes, archived ? (double)rd.bytes / archived : 0.0);
+
+    return rc;
+}